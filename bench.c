@@ -0,0 +1,238 @@
+/* shex benchmark driver.
+ * built by "make bench" from the same shex.c as the editor, with its main()
+ * left out. generates test files (dense text, random bytes, sparse), opens
+ * each one the way the editor does and times the screen paths with the
+ * terminal output going to /dev/null: a full repaint, scrolling one line,
+ * runs of page down and "go to" jumps. one JSON object per line goes to
+ * stdout for every file and operation, with per operation averages of wall
+ * time, read()/write() class syscalls and bytes read (from /proc/self/io,
+ * readahead and other threads included) and bytes sent to the terminal. */
+#define SHEX_NO_MAIN
+#include "shex.c"
+
+#define BENCH_GEN_CHUNK		(4 << 20)
+
+typedef struct BenchIo {
+	double			t;
+	unsigned long long	syscr,syscw,rchar;
+	unsigned long long	term;
+} BenchIo;
+
+enum {				BENCH_DENSE=0,
+				BENCH_RANDOM,
+				BENCH_SPARSE };
+
+static const char		*bench_kinds[3] = { "dense", "random", "sparse" };
+static unsigned long long	bench_rand = 0x2545F4914F6CDD1DULL;
+
+static unsigned long long BenchRand()
+{
+	/* xorshift64, the same sequence every run */
+	bench_rand ^= bench_rand << 13;
+	bench_rand ^= bench_rand >> 7;
+	bench_rand ^= bench_rand << 17;
+	return bench_rand;
+}
+
+static void BenchSample(BenchIo *s)
+{
+	char line[128];
+	FILE *f;
+
+	memset(s,0,sizeof(*s));
+	if ((f=fopen("/proc/self/io","r")) != NULL) {
+		while (fgets(line,sizeof(line),f) != NULL) {
+			if (!strncmp(line,"syscr:",6))		s->syscr = strtoull(line+6,NULL,10);
+			else if (!strncmp(line,"syscw:",6))	s->syscw = strtoull(line+6,NULL,10);
+			else if (!strncmp(line,"rchar:",6))	s->rchar = strtoull(line+6,NULL,10);
+		}
+		fclose(f);
+	}
+	s->term = term_total_bytes;
+	s->t = JobNow();
+}
+
+/* write "size" bytes of the kind asked for to "path". returns 0 on error */
+static int BenchGen(const char *path,int kind,unsigned long long size)
+{
+	static const char *text = "The quick brown fox jumps over the lazy dog. 0123456789\n";
+	unsigned long long o,k,*w;
+	unsigned char *buf;
+	size_t i,tl;
+	int fd,ok = 1;
+
+	if ((fd=open(path,O_WRONLY | O_CREAT | O_TRUNC,0644)) < 0) return 0;
+	if (kind == BENCH_SPARSE) {
+		/* a megabyte of data every 256MB, holes in between */
+		ok = ftruncate(fd,(off_t)size) == 0;
+		if ((buf=(unsigned char*)malloc(1 << 20)) == NULL) ok = 0;
+		for (o=0;ok && o < size;o += 256ULL << 20) {
+			k = (size - o) < (1 << 20) ? size - o : (1 << 20);
+			for (i=0;i < k;i++) buf[i] = (unsigned char)BenchRand();
+			if (pwrite(fd,buf,(size_t)k,(off_t)o) != (ssize_t)k) ok = 0;
+		}
+		free(buf);
+		close(fd);
+		return ok;
+	}
+
+	if ((buf=(unsigned char*)malloc(BENCH_GEN_CHUNK)) == NULL) {
+		close(fd);
+		return 0;
+	}
+	tl = strlen(text);
+	for (i=0;i < BENCH_GEN_CHUNK;i++) buf[i] = (unsigned char)text[i % tl];
+	for (o=0;ok && o < size;o += k) {
+		k = (size - o) < BENCH_GEN_CHUNK ? size - o : BENCH_GEN_CHUNK;
+		if (kind == BENCH_RANDOM)
+			for (w=(unsigned long long*)buf,i=0;i < (BENCH_GEN_CHUNK / 8);i++) w[i] = BenchRand();
+		if (write(fd,buf,(size_t)k) != (ssize_t)k) ok = 0;
+	}
+	free(buf);
+	if (fsync(fd) < 0) ok = 0;
+	close(fd);
+	return ok;
+}
+
+/* one pass of the editor's main loop: lay out and draw a frame */
+static void BenchFrame()
+{
+	ViewOfsToCoord();
+	RaNote(view_offset,(unsigned long long)view_rows * view_columns);
+	TermFrameBegin();
+	ViewRefresh();
+	ViewStatus();
+	TermPosCurs(viewcon_y+1,viewcon_x+1);
+	TermFrameEnd();
+}
+
+static void BenchReport(const char *kind,unsigned long long size,const char *op,int n,BenchIo *a,BenchIo *b)
+{
+	printf("{\"file\":\"%s\",\"size\":%llu,\"op\":\"%s\",\"count\":%d,"
+		"\"wall_us\":%.3f,\"syscr\":%.2f,\"syscw\":%.2f,\"read_bytes\":%.1f,\"term_bytes\":%.1f}\n",
+		kind,size,op,n,
+		((b->t - a->t) * 1e6) / n,
+		(double)(b->syscr - a->syscr) / n,
+		(double)(b->syscw - a->syscw) / n,
+		(double)(b->rchar - a->rchar) / n,
+		(double)(b->term - a->term) / n);
+	fflush(stdout);
+}
+
+static void BenchFile(const char *path,const char *kind,unsigned long long size)
+{
+	char cmd[64];
+	BenchIo a,b;
+	int i,n;
+
+	/* start cold, like opening the file for the first time */
+	if ((i=open(path,O_RDONLY)) >= 0) {
+		posix_fadvise(i,0,0,POSIX_FADV_DONTNEED);
+		close(i);
+	}
+	if (!FaOpen((char*)path,O_RDONLY)) {
+		fprintf(stderr,"unable to open %s\n",path);
+		return;
+	}
+	file_cursor = 0;
+	view_offset = 0;
+	viewup_all = 1;
+
+	BenchSample(&a);
+	BenchFrame();
+	BenchSample(&b);
+	BenchReport(kind,size,"first_frame",1,&a,&b);
+
+	n = 100;
+	BenchSample(&a);
+	for (i=0;i < n;i++) {
+		viewup_all = 1;
+		BenchFrame();
+	}
+	BenchSample(&b);
+	BenchReport(kind,size,"repaint",n,&a,&b);
+
+	/* cursor on the bottom row, so every down arrow scrolls a line */
+	file_cursor = (view_rows - 1) * view_columns;
+	BenchFrame();
+	n = 1000;
+	BenchSample(&a);
+	for (i=0;i < n && (file_cursor + view_columns) < file_size;i++) {
+		file_cursor += view_columns;
+		BenchFrame();
+	}
+	BenchSample(&b);
+	if (i > 0) BenchReport(kind,size,"scroll_line",i,&a,&b);
+
+	n = 500;
+	BenchSample(&a);
+	for (i=0;i < n && (file_cursor + (view_rows * view_columns)) < file_size;i++) {
+		file_cursor += (view_rows - 1) * view_columns;
+		FaAdvise(FA_ADV_SEQUENTIAL);
+		FaWillNeed(file_cursor + (view_rows * view_columns),view_rows * view_columns);
+		BenchFrame();
+	}
+	BenchSample(&b);
+	if (i > 0) BenchReport(kind,size,"page_down",i,&a,&b);
+
+	n = 200;
+	BenchSample(&a);
+	for (i=0;i < n;i++) {
+		sprintf(cmd,"go to 0x%llx",BenchRand() % size);
+		CmdExec(cmd);
+		BenchFrame();
+	}
+	BenchSample(&b);
+	BenchReport(kind,size,"goto",n,&a,&b);
+
+	FaClose();
+}
+
+int main(int argc,char **argv)
+{
+	static const unsigned long long sizes[] = { 1ULL << 20, 64ULL << 20, 1ULL << 30, 10ULL << 30 };
+	unsigned long long max = 1ULL << 30,smax = 10ULL << 30;
+	const char *dir = "/tmp";
+	char path[4096];
+	int i,k,w = 80,h = 25;
+
+	for (i=1;i < argc;i++) {
+		if (!strcmp(argv[i],"-dir") && (i+1) < argc)
+			dir = argv[++i];
+		else if (!strcmp(argv[i],"-max") && (i+1) < argc)
+			max = strtoull(argv[++i],NULL,0) << 20;
+		else if (!strcmp(argv[i],"-sparsemax") && (i+1) < argc)
+			smax = strtoull(argv[++i],NULL,0) << 20;
+		else if (!strcmp(argv[i],"-size") && (i+2) < argc) {
+			w = atoi(argv[++i]);
+			h = atoi(argv[++i]);
+		}
+		else {
+			fprintf(stderr,"%s [-dir <dir>] [-max <MB>] [-sparsemax <MB>] [-size <w> <h>]\n",argv[0]);
+			fprintf(stderr,"dense and random files go up to -max (default 1024MB), sparse\n");
+			fprintf(stderr,"ones up to -sparsemax (default 10240MB)\n");
+			return 1;
+		}
+	}
+
+	FmtInit();
+	if ((term_out_fd=open("/dev/null",O_WRONLY)) < 0) return 1;
+	TermSizeSet(w,h);
+	printf("{\"bench\":\"shex\",\"width\":%d,\"height\":%d,\"cpus\":%ld}\n",w,h,sysconf(_SC_NPROCESSORS_ONLN));
+
+	for (k=BENCH_DENSE;k <= BENCH_SPARSE;k++) {
+		for (i=0;i < (int)(sizeof(sizes) / sizeof(sizes[0]));i++) {
+			if (sizes[i] > (k == BENCH_SPARSE ? smax : max)) continue;
+			snprintf(path,sizeof(path),"%s/shexbench.%s.%llu",dir,bench_kinds[k],sizes[i]);
+			if (!BenchGen(path,k,sizes[i])) {
+				fprintf(stderr,"unable to create %s\n",path);
+				unlink(path);
+				continue;
+			}
+			BenchFile(path,bench_kinds[k],sizes[i]);
+			unlink(path);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,111 @@
+/* shex formatter check.
+ * built by "make check" from the same shex.c as the editor, with its main()
+ * left out. the hex and ASCII formatters FmtInit() picks for this CPU
+ * (SSE2/SSSE3) and every row kernel FmtRowSelect() can hand out are run
+ * next to the 256-entry table formatters: all lengths up to CHECK_MAX at
+ * source alignments 0-15, and every row width up to CHECK_COLS with every
+ * tail length and every byte value in every column. output buffers are
+ * filled with a marker first and compared in full, so a kernel writing
+ * past what it should shows up too. prints one line per kind of check and
+ * exits 1 on any difference. */
+#define SHEX_NO_MAIN
+#include "shex.c"
+
+#define CHECK_MAX		300
+#define CHECK_COLS		80
+#define CHECK_BUF		((CHECK_MAX * 4) + 64)
+
+static unsigned char	check_src[CHECK_MAX + 256];
+static char		check_a[CHECK_BUF],check_b[CHECK_BUF];
+static int		check_bad = 0;
+
+static void CheckFail(const char *what,int a,int n,int w)
+{
+	/* only the first few, one broken kernel fails thousands of cases */
+	if (check_bad++ < 10)
+		fprintf(stderr,"%s: differs at align %d, %d bytes, width %d\n",what,a,n,w);
+}
+
+/* a formatter against its table version */
+static unsigned long long CheckFmt(const char *what,void (*fast)(char*,const unsigned char*,int),
+	void (*ref)(char*,const unsigned char*,int))
+{
+	unsigned long long runs = 0;
+	int a,n;
+
+	for (a=0;a < 16;a++) {
+		for (n=0;n <= CHECK_MAX;n++) {
+			memset(check_a,0x5A,sizeof(check_a));
+			memset(check_b,0x5A,sizeof(check_b));
+			fast(check_a,check_src+a,n);
+			ref(check_b,check_src+a,n);
+			if (memcmp(check_a,check_b,sizeof(check_a)) != 0) CheckFail(what,a,n,0);
+			runs++;
+		}
+	}
+
+	return runs;
+}
+
+/* every kernel FmtRowSelect() can give against the generic ones on the
+ * table formatters */
+static unsigned long long CheckRows(int hex,int asc)
+{
+	void (*hf)(char*,const unsigned char*,int) = FmtHex,(*af)(char*,const unsigned char*,int) = FmtAsc;
+	FmtRowFn fast,ref;
+	unsigned long long runs = 0;
+	int a,n,w,e,la,lb,narrow;
+	char edge;
+
+	ref = hex && asc ? FmtRowHexAsc : hex ? FmtRowHex : FmtRowAsc;
+	for (w=1;w <= CHECK_COLS;w++) {
+		/* the whole row on screen, or cut off a column early */
+		for (narrow=0;narrow < 2;narrow++) {
+			if (narrow && w < 2) continue;
+			fast = FmtRowSelect(hex,asc,narrow ? w + 1 : w,w);
+			/* starting 0-255 bytes in puts every byte value in every column */
+			for (a=0;a < 256;a++) {
+				for (n=0;n <= w;n++) {
+					for (e=0;e < 2;e++) {
+						edge = e ? '>' : ' ';
+						memset(check_a,0x5A,sizeof(check_a));
+						memset(check_b,0x5A,sizeof(check_b));
+						la = fast(check_a,check_src+a,n,w,edge);
+						FmtHex = FmtHexScalar;
+						FmtAsc = FmtAscScalar;
+						lb = ref(check_b,check_src+a,n,w,edge);
+						FmtHex = hf;
+						FmtAsc = af;
+						if (la != lb || memcmp(check_a,check_b,sizeof(check_a)) != 0)
+							CheckFail(hex && asc ? "row hex+ascii" : hex ? "row hex" : "row ascii",a,n,w);
+						runs++;
+					}
+				}
+			}
+		}
+	}
+
+	return runs;
+}
+
+int main()
+{
+	unsigned long long runs;
+	int i;
+
+	/* every byte value turns up at every alignment */
+	for (i=0;i < (int)sizeof(check_src);i++) check_src[i] = (unsigned char)((i * 167) + (i >> 8));
+
+	FmtInit();
+	printf("{\"check\":\"shex\",\"hex\":\"%s\",\"ascii\":\"%s\"}\n",
+		FmtHex == FmtHexScalar ? "table" : "ssse3",FmtAsc == FmtAscScalar ? "table" : "sse2");
+
+	runs = CheckFmt("hex",FmtHex,FmtHexScalar);
+	printf("{\"op\":\"hex\",\"runs\":%llu,\"bad\":%d}\n",runs,check_bad);
+	runs = CheckFmt("ascii",FmtAsc,FmtAscScalar);
+	printf("{\"op\":\"ascii\",\"runs\":%llu,\"bad\":%d}\n",runs,check_bad);
+	runs = CheckRows(1,1) + CheckRows(1,0) + CheckRows(0,1);
+	printf("{\"op\":\"rows\",\"runs\":%llu,\"bad\":%d}\n",runs,check_bad);
+
+	return check_bad ? 1 : 0;
+}
@@ -0,0 +1,462 @@
+/* shex keystroke replay harness.
+ * runs a command (shex) on a pseudo terminal of a given size, answers the
+ * "ESC [ 6n" cursor position queries the way a terminal would, and plays
+ * a key script at it. after every key it waits for the output to settle
+ * and takes the time from writing the key to the last byte that came
+ * back. the output is fed through a small terminal emulator, covering
+ * what shex sends, so the screen can be checked against golden snapshots.
+ *
+ * script lines:
+ *   # comment
+ *   gen <path> <size>     make a test file (the same bytes every time) before
+ *                         starting, removed at the end
+ *   key <keys>            send <keys> and wait for the screen to settle
+ *   repeat <n> <keys>     "key" <n> times, each timed on its own
+ *   burst <n> <keys>      send <keys> <n> times in one write, timed as one
+ *   snap <name>           compare the screen with <golden>/<name>.snap
+ * keys may use \e \r \n \t \\ and \xHH.
+ *
+ * one JSON object per key/repeat/burst line and a summary go to stdout.
+ * exits with 1 if a snapshot did not match. */
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <termios.h>
+#include <poll.h>
+#include <time.h>
+#include <pty.h>
+
+#define REPLAY_MAX_ROWS		256
+#define REPLAY_MAX_COLS		512
+#define REPLAY_MAX_GEN		16
+#define REPLAY_MAX_STEPS	65536
+
+/* the emulated terminal */
+static char		scr[REPLAY_MAX_ROWS][REPLAY_MAX_COLS];
+static int		scr_rows = 24,scr_cols = 80;
+static int		scr_y = 0,scr_x = 0,scr_top = 0,scr_bot = 23;
+static int		esc_state = 0;			/* 0 = text, 1 = after ESC, 2 = in CSI */
+static char		esc_buf[64];
+static int		esc_len = 0;
+
+static int		pty_fd = -1;
+static pid_t		child = -1;
+static int		settle_ms = 50;
+static unsigned long long out_bytes = 0;
+static double		out_last = 0;			/* when the last output came in */
+
+static double Now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+}
+
+static void ScrClear(int y0,int x0,int y1,int x1)
+{
+	int y;
+
+	for (y=y0;y <= y1;y++)
+		memset(scr[y]+(y == y0 ? x0 : 0),' ',(y == y1 ? x1 + 1 : scr_cols) - (y == y0 ? x0 : 0));
+}
+
+/* move rows [top,bot] up by n (down if n < 0), blanking what comes in */
+static void ScrScroll(int top,int bot,int n)
+{
+	int y;
+
+	if (n > (bot - top + 1)) n = bot - top + 1;
+	if (n < -(bot - top + 1)) n = -(bot - top + 1);
+	if (n > 0) {
+		for (y=top;y <= (bot - n);y++) memcpy(scr[y],scr[y+n],scr_cols);
+		ScrClear(bot - n + 1,0,bot,scr_cols - 1);
+	}
+	else if (n < 0) {
+		for (y=bot;y >= (top - n);y--) memcpy(scr[y],scr[y+n],scr_cols);
+		ScrClear(top,0,top - n - 1,scr_cols - 1);
+	}
+}
+
+static void ScrCsi(char f)
+{
+	int p[8],np = 0,n;
+	char *s = esc_buf,rep[32];
+
+	if (*s == '?') s++;
+	memset(p,0,sizeof(p));
+	while (*s && np < 8) {
+		p[np++] = atoi(s);
+		while (*s && *s != ';') s++;
+		if (*s == ';') s++;
+	}
+	n = p[0] > 0 ? p[0] : 1;
+
+	switch (f) {
+		case 'H': case 'f':
+			scr_y = (p[0] > 0 ? p[0] : 1) - 1;
+			scr_x = (np > 1 && p[1] > 0 ? p[1] : 1) - 1;
+			break;
+		case 'A':	scr_y -= n; break;
+		case 'B':	scr_y += n; break;
+		case 'C':	scr_x += n; break;
+		case 'D':	scr_x -= n; break;
+		case 'G':	scr_x = n - 1; break;
+		case 'K':
+			if (p[0] == 1)		ScrClear(scr_y,0,scr_y,scr_x);
+			else if (p[0] == 2)	ScrClear(scr_y,0,scr_y,scr_cols - 1);
+			else			ScrClear(scr_y,scr_x,scr_y,scr_cols - 1);
+			break;
+		case 'J':
+			if (p[0] == 2)		ScrClear(0,0,scr_rows - 1,scr_cols - 1);
+			else if (p[0] == 1)	ScrClear(0,0,scr_y,scr_x);
+			else			ScrClear(scr_y,scr_x,scr_rows - 1,scr_cols - 1);
+			break;
+		case 'r':
+			scr_top = (p[0] > 0 ? p[0] : 1) - 1;
+			scr_bot = (np > 1 && p[1] > 0 ? p[1] : scr_rows) - 1;
+			if (scr_bot >= scr_rows) scr_bot = scr_rows - 1;
+			if (scr_top > scr_bot) scr_top = 0;
+			scr_y = scr_x = 0;
+			break;
+		case 'S':	ScrScroll(scr_top,scr_bot,n); break;
+		case 'T':	ScrScroll(scr_top,scr_bot,-n); break;
+		case 'L':	if (scr_y >= scr_top && scr_y <= scr_bot) ScrScroll(scr_y,scr_bot,-n); break;
+		case 'M':	if (scr_y >= scr_top && scr_y <= scr_bot) ScrScroll(scr_y,scr_bot,n); break;
+		case 'n':
+			/* where the cursor is, which after "go to 255,255" is the size */
+			if (p[0] == 6) {
+				n = snprintf(rep,sizeof(rep),"\x1B[%d;%dR",scr_y + 1,scr_x + 1);
+				if (write(pty_fd,rep,n) != n) perror("write");
+			}
+			break;
+		default:	/* colors, modes: no effect on the text */
+			break;
+	}
+
+	if (scr_y < 0) scr_y = 0;
+	if (scr_y >= scr_rows) scr_y = scr_rows - 1;
+	if (scr_x < 0) scr_x = 0;
+	if (scr_x >= scr_cols) scr_x = scr_cols - 1;
+}
+
+static void ScrFeed(const unsigned char *s,size_t n)
+{
+	unsigned char c;
+
+	while (n-- > 0) {
+		c = *s++;
+		if (esc_state == 1) {
+			esc_state = c == '[' ? 2 : 0;
+			esc_len = 0;
+			continue;
+		}
+		if (esc_state == 2) {
+			if ((c >= '0' && c <= '9') || c == ';' || c == '?') {
+				if (esc_len < (int)sizeof(esc_buf) - 1) esc_buf[esc_len++] = (char)c;
+				continue;
+			}
+			esc_buf[esc_len] = 0;
+			esc_state = 0;
+			ScrCsi((char)c);
+			continue;
+		}
+
+		if (c == 27) {
+			esc_state = 1;
+		}
+		else if (c == '\r') {
+			scr_x = 0;
+		}
+		else if (c == '\n') {
+			if (scr_y == scr_bot)			ScrScroll(scr_top,scr_bot,1);
+			else if (scr_y < (scr_rows - 1))	scr_y++;
+		}
+		else if (c == '\b') {
+			if (scr_x > 0) scr_x--;
+		}
+		else if (c >= 32) {
+			/* no autowrap: shex turns it off, the last column is overwritten */
+			scr[scr_y][scr_x] = (char)c;
+			if (scr_x < (scr_cols - 1)) scr_x++;
+		}
+	}
+}
+
+/* take output until none has come for settle_ms, or for "wait_ms" if
+ * nothing comes at all. returns the bytes taken */
+static unsigned long long Pump(int wait_ms)
+{
+	unsigned char buf[65536];
+	unsigned long long got = 0;
+	struct pollfd pf;
+	ssize_t rd;
+
+	for (;;) {
+		pf.fd = pty_fd;
+		pf.events = POLLIN;
+		if (poll(&pf,1,got ? settle_ms : wait_ms) <= 0) break;
+		if ((rd=read(pty_fd,buf,sizeof(buf))) <= 0) break;
+		out_last = Now();
+		got += (unsigned long long)rd;
+		ScrFeed(buf,(size_t)rd);
+	}
+
+	out_bytes += got;
+	return got;
+}
+
+/* unescape "s" into "d", returning the length */
+static int Keys(char *d,const char *s)
+{
+	char *d0 = d;
+	char h[3];
+
+	while (*s) {
+		if (*s != '\\' || !s[1]) {
+			*d++ = *s++;
+			continue;
+		}
+		s++;
+		switch (*s) {
+			case 'e':	*d++ = 27; s++; break;
+			case 'r':	*d++ = '\r'; s++; break;
+			case 'n':	*d++ = '\n'; s++; break;
+			case 't':	*d++ = '\t'; s++; break;
+			case 'x':
+				h[0] = s[1]; h[1] = s[1] ? s[2] : 0; h[2] = 0;
+				*d++ = (char)strtoul(h,NULL,16);
+				s += 1 + strlen(h);
+				break;
+			default:	*d++ = *s++; break;
+		}
+	}
+
+	return (int)(d - d0);
+}
+
+static int MsCmp(const void *a,const void *b)
+{
+	double x = *(const double*)a,y = *(const double*)b;
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static double Pct(double *v,int n,double p)
+{
+	int k;
+
+	if (n == 0) return 0;
+	k = (int)((p * n) + 0.999999) - 1;
+	if (k < 0) k = 0;
+	if (k >= n) k = n - 1;
+	return v[k];
+}
+
+/* send "keys" "n" times ("burst": all in one write) and report the timing */
+static double *step_ms = NULL;
+static int step_n = 0;
+
+static void Play(int line,const char *op,const char *keys,int n,int burst)
+{
+	static char buf[65536];
+	unsigned long long bytes = 0;
+	int i,len,nt = 0,k;
+	double *ms,t;
+
+	len = Keys(buf,keys);
+	if (burst) {
+		for (k=len,i=1;i < n && (k + len) <= (int)sizeof(buf);i++,k += len) memcpy(buf+k,buf,len);
+		len = k;
+		n = 1;
+	}
+	if ((ms=(double*)malloc(sizeof(double) * n)) == NULL) return;
+
+	for (i=0;i < n;i++) {
+		t = Now();
+		out_last = 0;
+		if (write(pty_fd,buf,len) != len) break;
+		bytes += Pump(settle_ms);
+		if (out_last != 0) {
+			ms[nt++] = (out_last - t) * 1000.0;
+			if (step_n < REPLAY_MAX_STEPS) step_ms[step_n++] = ms[nt-1];
+		}
+	}
+
+	qsort(ms,nt,sizeof(double),MsCmp);
+	printf("{\"line\":%d,\"op\":\"%s\",\"count\":%d,\"answered\":%d,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f,\"bytes\":%llu}\n",
+		line,op,i,nt,Pct(ms,nt,0.50),Pct(ms,nt,0.99),nt ? ms[nt-1] : 0.0,bytes);
+	fflush(stdout);
+	free(ms);
+}
+
+/* check the screen against a golden snapshot, or write it with -update */
+static int Snap(const char *dir,const char *name,int update)
+{
+	char path[4096],line[REPLAY_MAX_COLS + 2];
+	int y,l,bad = 0;
+	FILE *f;
+
+	snprintf(path,sizeof(path),"%s/%s.snap",dir,name);
+	if ((f=fopen(path,update ? "w" : "r")) == NULL) {
+		fprintf(stderr,"unable to open %s\n",path);
+		return 0;
+	}
+
+	for (y=0;y < scr_rows;y++) {
+		for (l=scr_cols;l > 0 && scr[y][l-1] == ' ';) l--;
+		if (update) {
+			fprintf(f,"%.*s\n",l,scr[y]);
+			continue;
+		}
+
+		if (fgets(line,sizeof(line),f) == NULL) line[0] = 0;
+		line[strcspn(line,"\n")] = 0;
+		if ((int)strlen(line) != l || memcmp(line,scr[y],l)) {
+			if (!bad) fprintf(stderr,"snapshot %s differs:\n",name);
+			fprintf(stderr,"  row %2d want: %s\n",y + 1,line);
+			fprintf(stderr,"  row %2d got:  %.*s\n",y + 1,l,scr[y]);
+			bad = 1;
+		}
+	}
+
+	fclose(f);
+	return !bad;
+}
+
+/* write "size" bytes to "path": text and random bytes mixed, the same every time */
+static int Gen(const char *path,unsigned long long size)
+{
+	static const char *text = "The quick brown fox jumps over the lazy dog. ";
+	unsigned long long x = 0x9E3779B97F4A7C15ULL,o;
+	unsigned char buf[4096];
+	size_t i,k;
+	int fd;
+
+	if ((fd=open(path,O_WRONLY | O_CREAT | O_TRUNC,0644)) < 0) return 0;
+	for (o=0;o < size;o += k) {
+		k = (size - o) < sizeof(buf) ? (size_t)(size - o) : sizeof(buf);
+		for (i=0;i < k;i++) {
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			buf[i] = ((o + i) & 256) ? (unsigned char)x : (unsigned char)text[(o + i) % 45];
+		}
+		if (write(fd,buf,k) != (ssize_t)k) {
+			close(fd);
+			return 0;
+		}
+	}
+
+	return close(fd) == 0;
+}
+
+int main(int argc,char **argv)
+{
+	char *gen[REPLAY_MAX_GEN],line[4096],*c,*a;
+	const char *golden = ".",*script = NULL;
+	int i,n,ng = 0,ln,update = 0,failed = 0,snaps = 0,status;
+	struct winsize ws;
+	double t0;
+	FILE *f;
+
+	for (i=1;i < argc && strcmp(argv[i],"--");i++) {
+		if (!strcmp(argv[i],"-rows") && (i+1) < argc)		scr_rows = atoi(argv[++i]);
+		else if (!strcmp(argv[i],"-cols") && (i+1) < argc)	scr_cols = atoi(argv[++i]);
+		else if (!strcmp(argv[i],"-settle") && (i+1) < argc)	settle_ms = atoi(argv[++i]);
+		else if (!strcmp(argv[i],"-golden") && (i+1) < argc)	golden = argv[++i];
+		else if (!strcmp(argv[i],"-update"))			update = 1;
+		else if (argv[i][0] != '-' && !script)			script = argv[i];
+		else							break;
+	}
+	if (!script || i >= (argc - 1) || strcmp(argv[i],"--") ||
+		scr_rows < 4 || scr_rows > REPLAY_MAX_ROWS || scr_cols < 16 || scr_cols > REPLAY_MAX_COLS) {
+		fprintf(stderr,"%s [-rows <n>] [-cols <n>] [-settle <ms>] [-golden <dir>] [-update] <script> -- <command...>\n",argv[0]);
+		return 2;
+	}
+	scr_bot = scr_rows - 1;
+	ScrClear(0,0,scr_rows - 1,scr_cols - 1);
+	if ((f=fopen(script,"r")) == NULL) {
+		fprintf(stderr,"unable to open %s\n",script);
+		return 2;
+	}
+	if ((step_ms=(double*)malloc(sizeof(double) * REPLAY_MAX_STEPS)) == NULL) return 2;
+
+	/* test files first */
+	while (fgets(line,sizeof(line),f) != NULL) {
+		if (strncmp(line,"gen ",4) || ng >= REPLAY_MAX_GEN) continue;
+		c = strtok(line+4," \t\r\n");
+		a = strtok(NULL," \t\r\n");
+		if (!c || !a || !Gen(c,strtoull(a,NULL,0))) {
+			fprintf(stderr,"unable to make %s\n",c ? c : "test file");
+			return 2;
+		}
+		gen[ng++] = strdup(c);
+	}
+	rewind(f);
+
+	memset(&ws,0,sizeof(ws));
+	ws.ws_row = (unsigned short)scr_rows;
+	ws.ws_col = (unsigned short)scr_cols;
+	if ((child=forkpty(&pty_fd,NULL,NULL,&ws)) < 0) {
+		perror("forkpty");
+		return 2;
+	}
+	if (child == 0) {
+		execvp(argv[i+1],argv+i+1);
+		perror(argv[i+1]);
+		_exit(127);
+	}
+
+	/* startup, up to the first frame */
+	t0 = Now();
+	out_last = 0;
+	Pump(5000);
+	printf("{\"op\":\"startup\",\"ms\":%.3f,\"bytes\":%llu}\n",out_last ? (out_last - t0) * 1000.0 : -1.0,out_bytes);
+
+	for (ln=1;fgets(line,sizeof(line),f) != NULL;ln++) {
+		line[strcspn(line,"\r\n")] = 0;
+		for (c=line;*c == ' ' || *c == '\t';) c++;
+		if (*c == 0 || *c == '#' || !strncmp(c,"gen ",4)) continue;
+
+		if (!strncmp(c,"key ",4)) {
+			Play(ln,"key",c+4,1,0);
+		}
+		else if (!strncmp(c,"repeat ",7) || !strncmp(c,"burst ",6)) {
+			n = (int)strtol(strchr(c,' ')+1,&a,0);
+			if (*a == ' ') a++;
+			Play(ln,c[0] == 'r' ? "repeat" : "burst",a,n,c[0] == 'b');
+		}
+		else if (!strncmp(c,"snap ",5)) {
+			snaps++;
+			if (!Snap(golden,c+5,update)) failed++;
+		}
+		else {
+			fprintf(stderr,"%s:%d: unknown line: %s\n",script,ln,c);
+			failed++;
+		}
+	}
+	fclose(f);
+
+	kill(child,SIGTERM);
+	Pump(100);
+	waitpid(child,&status,0);
+	for (i=0;i < ng;i++) {
+		unlink(gen[i]);
+		free(gen[i]);
+	}
+
+	qsort(step_ms,step_n,sizeof(double),MsCmp);
+	printf("{\"op\":\"total\",\"keys\":%d,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f,\"bytes\":%llu,\"snapshots\":%d,\"failed\":%d}\n",
+		step_n,Pct(step_ms,step_n,0.50),Pct(step_ms,step_n,0.99),step_n ? step_ms[step_n-1] : 0.0,out_bytes,snaps,failed);
+	free(step_ms);
+	return failed ? 1 : 0;
+}
@@ -1,14 +1,34 @@
 /* simple hex editor
  * (C) 2004 Jonathan Campbell */
 
+#define _GNU_SOURCE
+
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <linux/fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <termios.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define SHEX_SSE 1
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#endif
 
 #ifndef O_LARGEFILE
 #define O_LARGEFILE 0
@@ -22,7 +42,8 @@
 /* file variables */
 int			file_fd = -1;
 int			file_mode = 0;
-unsigned long long	file_size = 0;
+unsigned long long	file_size = 0;		/* size as viewed, with edits */
+unsigned long long	fa_size = 0;		/* size on disk */
 unsigned long long	file_cursor = 0;
 
 /* view variables */
@@ -39,17 +60,271 @@ int			view_with_asc = 1;
 int			viewcon_x = 0;
 int			viewcon_y = 0;
 int			view_modifymode = 0;
+int			view_insertmode = 0;	/* typing in modify mode inserts */
+int			view_with_map = 0;	/* minimap column on the right */
+int			view_map_sel = 0;	/* map row picked while view_tab == 3 */
+#define VIEW_MAP_W		2
 
 /* console vars */
 int			con_width;
 int			con_height;
 
 /* view update vars */
-char			viewup_all = 0;
-char			viewup_scroll = 0;
-char			viewup_cursor = 0;
-enum {				VUPS_UP=1,
-				VUPS_DOWN=2 };
+char			viewup_all = 0;		/* screen contents unknown, repaint everything */
+
+/* row formatting.
+ * FmtHex() turns bytes into "XX " triples and FmtAsc() into printable
+ * characters ('.' for the rest), with 256-entry tables or with SSE2/SSSE3
+ * when the CPU has it. a row kernel for the panels shown and the bytes per
+ * row is picked once per layout by FmtRowSelect(). */
+typedef int (*FmtRowFn)(char *d,const unsigned char *s,int n,int w,char edge);
+
+static char			fmt_hex3[256][4];
+static char			fmt_asc[256];
+void				(*FmtHex)(char *d,const unsigned char *s,int n);
+void				(*FmtAsc)(char *d,const unsigned char *s,int n);
+FmtRowFn			view_fmtrow = NULL;
+
+static void FmtHexScalar(char *d,const unsigned char *s,int n)
+{
+	/* copy 4 at a time, the 4th byte lands where the next triple starts */
+	for (;n > 1;n--,d += 3) memcpy(d,fmt_hex3[*s++],4);
+	if (n > 0) memcpy(d,fmt_hex3[*s],3);
+}
+
+static void FmtAscScalar(char *d,const unsigned char *s,int n)
+{
+	while (n-- > 0) *d++ = fmt_asc[*s++];
+}
+
+#ifdef SHEX_SSE
+/* pshufb controls spreading 32 hex digits (two registers) over 48 output bytes */
+static unsigned char		fmt_shuf_a[3][16] __attribute__((aligned(16)));
+static unsigned char		fmt_shuf_b[3][16] __attribute__((aligned(16)));
+static unsigned char		fmt_space[3][16] __attribute__((aligned(16)));
+
+static void FmtAscSSE2(char *d,const unsigned char *s,int n)
+{
+	const __m128i lo = _mm_set1_epi8(0x1F),hi = _mm_set1_epi8(0x7F),dot = _mm_set1_epi8('.');
+	__m128i v,m;
+
+	/* bytes >= 0x80 are negative as signed chars and fail the > 0x1F test */
+	for (;n >= 16;n -= 16,s += 16,d += 16) {
+		v = _mm_loadu_si128((const __m128i*)s);
+		m = _mm_and_si128(_mm_cmpgt_epi8(v,lo),_mm_cmplt_epi8(v,hi));
+		_mm_storeu_si128((__m128i*)d,_mm_or_si128(_mm_and_si128(m,v),_mm_andnot_si128(m,dot)));
+	}
+
+	FmtAscScalar(d,s,n);
+}
+
+__attribute__((target("ssse3")))
+static void FmtHexSSSE3(char *d,const unsigned char *s,int n)
+{
+	const __m128i m0f = _mm_set1_epi8(0x0F),nine = _mm_set1_epi8(9);
+	const __m128i c0 = _mm_set1_epi8('0'),c7 = _mm_set1_epi8('A' - '0' - 10);
+	__m128i v,hi,lo,a,b;
+	int k;
+
+	for (;n >= 16;n -= 16,s += 16,d += 48) {
+		v = _mm_loadu_si128((const __m128i*)s);
+		hi = _mm_and_si128(_mm_srli_epi16(v,4),m0f);
+		lo = _mm_and_si128(v,m0f);
+		hi = _mm_add_epi8(_mm_add_epi8(hi,c0),_mm_and_si128(_mm_cmpgt_epi8(hi,nine),c7));
+		lo = _mm_add_epi8(_mm_add_epi8(lo,c0),_mm_and_si128(_mm_cmpgt_epi8(lo,nine),c7));
+		a = _mm_unpacklo_epi8(hi,lo);
+		b = _mm_unpackhi_epi8(hi,lo);
+
+		for (k=0;k < 3;k++) {
+			v = _mm_or_si128(_mm_shuffle_epi8(a,_mm_load_si128((const __m128i*)fmt_shuf_a[k])),
+				_mm_shuffle_epi8(b,_mm_load_si128((const __m128i*)fmt_shuf_b[k])));
+			v = _mm_or_si128(v,_mm_load_si128((const __m128i*)fmt_space[k]));
+			_mm_storeu_si128((__m128i*)(d+(k*16)),v);
+		}
+	}
+
+	FmtHexScalar(d,s,n);
+}
+#endif
+
+void FmtInit()
+{
+	static const char *hd = "0123456789ABCDEF";
+	int i;
+
+	for (i=0;i < 256;i++) {
+		fmt_hex3[i][0] = hd[i >> 4];
+		fmt_hex3[i][1] = hd[i & 15];
+		fmt_hex3[i][2] = ' ';
+		fmt_hex3[i][3] = ' ';
+		fmt_asc[i] = (i < 32 || i >= 127) ? '.' : (char)i;
+	}
+
+	FmtHex = FmtHexScalar;
+	FmtAsc = FmtAscScalar;
+
+#ifdef SHEX_SSE
+	for (i=0;i < 48;i++) {
+		int k = i / 16,l = i % 16,di = ((i / 3) * 2) + (i % 3);
+
+		fmt_shuf_a[k][l] = fmt_shuf_b[k][l] = 0x80;
+		fmt_space[k][l] = 0;
+		if ((i % 3) == 2)	fmt_space[k][l] = ' ';
+		else if (di < 16)	fmt_shuf_a[k][l] = di;
+		else			fmt_shuf_b[k][l] = di - 16;
+	}
+
+	FmtAsc = FmtAscSSE2;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3")) FmtHex = FmtHexSSSE3;
+#endif
+}
+
+/* 16 hex digits of a file offset */
+void FmtOffset(char *d,unsigned long long o)
+{
+	int i;
+
+	for (i=0;i < 8;i++)
+		memcpy(d+(i*2),fmt_hex3[(o >> (56 - (i * 8))) & 0xFF],2);
+}
+
+/* row kernels: n bytes of data in a row w bytes wide, edge is '>' if the
+ * row continues off screen. each returns the number of characters written */
+static int FmtRowHexAsc(char *d,const unsigned char *s,int n,int w,char edge)
+{
+	FmtHex(d,s,n);
+	memset(d+(n*3),' ',(w-n)*3);
+	d[w*3] = edge;
+	FmtAsc(d+(w*3)+1,s,n);
+	memset(d+(w*3)+1+n,' ',w-n);
+	d[(w*4)+1] = edge;
+	return (w*4)+2;
+}
+
+static int FmtRowHex(char *d,const unsigned char *s,int n,int w,char edge)
+{
+	FmtHex(d,s,n);
+	memset(d+(n*3),' ',(w-n)*3);
+	d[w*3] = edge;
+	return (w*3)+1;
+}
+
+static int FmtRowAsc(char *d,const unsigned char *s,int n,int w,char edge)
+{
+	FmtAsc(d,s,n);
+	memset(d+n,' ',w-n);
+	d[w] = edge;
+	return w+1;
+}
+
+static int FmtRowNone(char *d,const unsigned char *s,int n,int w,char edge)
+{
+	return 0;
+}
+
+/* kernels for the usual bytes-per-row with the whole row on screen: the
+ * size is a constant and there is no padding unless the row ends at EOF */
+#define FMT_ROW_FIXED(W)										\
+static int FmtRowHexAsc##W(char *d,const unsigned char *s,int n,int w,char edge)			\
+{													\
+	if (n != W) return FmtRowHexAsc(d,s,n,w,edge);							\
+	FmtHex(d,s,W);											\
+	memset(d+(W*3),' ',(w-W)*3);									\
+	d[w*3] = edge;											\
+	FmtAsc(d+(w*3)+1,s,W);										\
+	memset(d+(w*3)+1+W,' ',w-W);									\
+	d[(w*4)+1] = edge;										\
+	return (w*4)+2;											\
+}													\
+static int FmtRowHex##W(char *d,const unsigned char *s,int n,int w,char edge)			\
+{													\
+	if (n != W) return FmtRowHex(d,s,n,w,edge);							\
+	FmtHex(d,s,W);											\
+	memset(d+(W*3),' ',(w-W)*3);									\
+	d[w*3] = edge;											\
+	return (w*3)+1;											\
+}													\
+static int FmtRowAsc##W(char *d,const unsigned char *s,int n,int w,char edge)			\
+{													\
+	if (n != W) return FmtRowAsc(d,s,n,w,edge);							\
+	FmtAsc(d,s,W);											\
+	memset(d+W,' ',w-W);										\
+	d[w] = edge;											\
+	return w+1;											\
+}
+
+FMT_ROW_FIXED(8)
+FMT_ROW_FIXED(16)
+FMT_ROW_FIXED(32)
+
+#ifdef SHEX_SSE
+/* a whole 16 byte row with both panels in one pass: the common case on
+ * screen and nearly all of a dump */
+__attribute__((target("ssse3")))
+static int FmtRowHexAsc16SSSE3(char *d,const unsigned char *s,int n,int w,char edge)
+{
+	const __m128i m0f = _mm_set1_epi8(0x0F),nine = _mm_set1_epi8(9);
+	const __m128i c0 = _mm_set1_epi8('0'),c7 = _mm_set1_epi8('A' - '0' - 10);
+	const __m128i lo1f = _mm_set1_epi8(0x1F),hi7f = _mm_set1_epi8(0x7F),dot = _mm_set1_epi8('.');
+	__m128i v,hi,lo,a,b,m;
+
+	if (n != 16 || w != 16) return FmtRowHexAsc(d,s,n,w,edge);
+	v = _mm_loadu_si128((const __m128i*)s);
+	hi = _mm_and_si128(_mm_srli_epi16(v,4),m0f);
+	lo = _mm_and_si128(v,m0f);
+	hi = _mm_add_epi8(_mm_add_epi8(hi,c0),_mm_and_si128(_mm_cmpgt_epi8(hi,nine),c7));
+	lo = _mm_add_epi8(_mm_add_epi8(lo,c0),_mm_and_si128(_mm_cmpgt_epi8(lo,nine),c7));
+	a = _mm_unpacklo_epi8(hi,lo);
+	b = _mm_unpackhi_epi8(hi,lo);
+	_mm_storeu_si128((__m128i*)d,_mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(a,_mm_load_si128((const __m128i*)fmt_shuf_a[0])),
+		_mm_shuffle_epi8(b,_mm_load_si128((const __m128i*)fmt_shuf_b[0]))),
+		_mm_load_si128((const __m128i*)fmt_space[0])));
+	_mm_storeu_si128((__m128i*)(d+16),_mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(a,_mm_load_si128((const __m128i*)fmt_shuf_a[1])),
+		_mm_shuffle_epi8(b,_mm_load_si128((const __m128i*)fmt_shuf_b[1]))),
+		_mm_load_si128((const __m128i*)fmt_space[1])));
+	_mm_storeu_si128((__m128i*)(d+32),_mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(a,_mm_load_si128((const __m128i*)fmt_shuf_a[2])),
+		_mm_shuffle_epi8(b,_mm_load_si128((const __m128i*)fmt_shuf_b[2]))),
+		_mm_load_si128((const __m128i*)fmt_space[2])));
+	d[48] = edge;
+
+	m = _mm_and_si128(_mm_cmpgt_epi8(v,lo1f),_mm_cmplt_epi8(v,hi7f));
+	_mm_storeu_si128((__m128i*)(d+49),_mm_or_si128(_mm_and_si128(m,v),_mm_andnot_si128(m,dot)));
+	d[65] = edge;
+	return 66;
+}
+#endif
+
+FmtRowFn FmtRowSelect(int hex,int asc,unsigned long long columns,unsigned long long scrcols)
+{
+	static const FmtRowFn fixed[3][3] = {
+		{ FmtRowHexAsc8,	FmtRowHexAsc16,		FmtRowHexAsc32 },
+		{ FmtRowHex8,		FmtRowHex16,		FmtRowHex32 },
+		{ FmtRowAsc8,		FmtRowAsc16,		FmtRowAsc32 }
+	};
+	int p,c;
+
+	if (hex && asc)		p = 0;
+	else if (hex)		p = 1;
+	else if (asc)		p = 2;
+	else			return FmtRowNone;
+
+	if (columns == 8)		c = 0;
+	else if (columns == 16)		c = 1;
+	else if (columns == 32)		c = 2;
+	else				c = -1;
+
+#ifdef SHEX_SSE
+	if (p == 0 && c == 1 && columns <= scrcols && FmtHex == FmtHexSSSE3) return FmtRowHexAsc16SSSE3;
+#endif
+	if (c >= 0 && columns <= scrcols) return fixed[p][c];
+	if (p == 0)	return FmtRowHexAsc;
+	if (p == 1)	return FmtRowHex;
+	return FmtRowAsc;
+}
 
 /* converts (file cursor + view offset) -> coordinates */
 void ViewOfsToCoord()
@@ -57,41 +332,30 @@ void ViewOfsToCoord()
 	unsigned long long o;
 	int x,y;
 
-	if (view_with_hex && view_with_asc)	view_scrcols = (con_width - 19) / 4;
-	else if (view_with_hex)			view_scrcols = (con_width - 19) / 3;
-	else if (view_with_asc)			view_scrcols = (con_width - 19);
+	x = con_width - 19 - (view_with_map ? VIEW_MAP_W : 0);
+	if (view_with_hex && view_with_asc)	view_scrcols = x / 4;
+	else if (view_with_hex)			view_scrcols = x / 3;
+	else if (view_with_asc)			view_scrcols = x;
 	else					view_scrcols = 1;
+	if ((long long)view_scrcols < 1)	view_scrcols = 1;
+	view_fmtrow = FmtRowSelect(view_with_hex,view_with_asc,view_columns,view_scrcols);
 
 	if (file_cursor < view_offset) {
 		o = view_offset - file_cursor;
 		x = o % view_columns;
 		y = o / view_columns;
 		if (x != 0) y++;
-		if (view_offset < view_columns) {
+		if (view_offset < view_columns)
 			view_offset = 0;
-			viewup_all = 1;
-		}
-		else if (y == 1) {
-			view_offset -= view_columns;
-			viewup_scroll = VUPS_DOWN;
-		}
-		else {
+		else
 			view_offset -= y * view_columns;
-			viewup_all = 1;
-		}
 	}
 	else {
 		o = file_cursor - view_offset;
 		x = o % view_columns;
 		y = o / view_columns;
-		if (y > view_rows) {
+		if (y >= view_rows)
 			view_offset += (y - (view_rows - 1)) * view_columns;
-			viewup_all = 1;
-		}
-		else if (y == view_rows) {
-			viewup_scroll = VUPS_UP;
-			view_offset += view_columns;
-		}
 	}
 
 	/* from this point on it should be that view_offset >= file_cursor */
@@ -99,464 +363,6247 @@ void ViewOfsToCoord()
 	x = o % view_columns;
 	y = o / view_columns;
 
-	if (x < view_colofs) {
+	if (x < view_colofs)
 		view_colofs = x;
-		viewup_all = 1;
-	}
-	else if ((x-view_colofs) >= view_scrcols) {
+	else if ((x-view_colofs) >= view_scrcols)
 		view_colofs = x - (view_scrcols - 1);
-		viewup_all = 1;
-	}
 
-	/* update the cursor if it moved */
-	if (x != view_ofs_x || y != view_ofs_y) {
-		view_ofs_x = x;
-		view_ofs_y = y;
-		viewup_cursor = 1;
-	}
+	view_ofs_x = x;
+	view_ofs_y = y;
 }
 
-/* file abstraction */
-void FaClose()
+/* statistics.
+ * reads, writes and seeks on the file and on the file compared with go
+ * through StatPread()/StatPwrite()/StatLseek(), which count calls and
+ * bytes with an atomic add, so worker threads are counted too; what goes
+ * to the terminal is counted in TermFlush(). TermFrameBegin() and
+ * TermFrameEnd() keep the difference over the last frame and put its
+ * time in a histogram of the last STAT_RING frames, in quarter octave
+ * buckets, that p50/p99 are read from. a few adds per syscall and two
+ * clock reads per frame, so it is always on. */
+#define STAT_RING		256
+#define STAT_BUCKETS		96		/* bucket b is up to 2^((b+1)/4) us, ~16s at the top */
+
+typedef struct StatCount {
+	unsigned long long	reads,read_bytes;
+	unsigned long long	writes,write_bytes;
+	unsigned long long	seeks;
+	unsigned long long	term_writes,term_bytes;
+	unsigned long long	frames;
+	double			draw,refresh,frame;	/* seconds in DrawRow(), ViewRefresh(), whole frames */
+} StatCount;
+
+StatCount		stat_total;			/* since startup or "stats reset" */
+StatCount		stat_last;			/* the last frame */
+static StatCount	stat_frame0;			/* stat_total as the frame began */
+int			view_with_stats = 0;		/* last frame counters on the status line */
+const char		*stat_file = NULL;		/* -statsfile: written on the way out */
+static unsigned char	stat_ring[STAT_RING];
+static unsigned int	stat_hist[STAT_BUCKETS];
+static unsigned int	stat_nring = 0,stat_ring_pos = 0;
+
+static void StatRead(ssize_t r)
 {
-	if (file_fd >= 0) close(file_fd);
-	file_fd = -1;
-	file_size = 0;
-	file_cursor = 0;
-	view_offset = 0;
+	__sync_fetch_and_add(&stat_total.reads,1);
+	if (r > 0) __sync_fetch_and_add(&stat_total.read_bytes,(unsigned long long)r);
 }
 
-int FaOpen(char *path,int mode)
+static void StatWrite(ssize_t r)
 {
-	FaClose();
+	__sync_fetch_and_add(&stat_total.writes,1);
+	if (r > 0) __sync_fetch_and_add(&stat_total.write_bytes,(unsigned long long)r);
+}
 
-	file_mode = mode;
-	file_fd = open(path,mode | O_LARGEFILE);
-	if (file_fd < 0) return 0;
-	file_size = lseek(file_fd,0,SEEK_END);
-	if (file_size == ((unsigned long long)(-1))) {
-		fprintf(stderr,"FaOpen(): descriptor can't seek!\n");
-		FaClose();
-		return 0;
-	}
-	
-	file_cursor = 0;
-	return 1;
+ssize_t StatPread(int fd,void *buf,size_t len,off_t ofs)
+{
+	ssize_t r = pread(fd,buf,len,ofs);
+
+	StatRead(r);
+	return r;
 }
 
-unsigned long long FaSeek(unsigned long long ofs)
+ssize_t StatPwrite(int fd,const void *buf,size_t len,off_t ofs)
 {
-	if (file_fd < 0) return 0;
-	return lseek(file_fd,ofs,SEEK_SET);
+	ssize_t r = pwrite(fd,buf,len,ofs);
+
+	StatWrite(r);
+	return r;
 }
 
-unsigned long long FaTell()
+off_t StatLseek(int fd,off_t ofs,int whence)
 {
-	if (file_fd < 0) return 0;
-	return lseek(file_fd,0,SEEK_CUR);
+	__sync_fetch_and_add(&stat_total.seeks,1);
+	return lseek(fd,ofs,whence);
 }
 
-/* console setup code */
-int TermSetup()
+void StatReset()
 {
-	struct termios t;
-	const char *nowrap = "\x1B[?7l";
+	memset(&stat_total,0,sizeof(stat_total));
+	memset(&stat_last,0,sizeof(stat_last));
+	memset(&stat_frame0,0,sizeof(stat_frame0));
+	memset(stat_hist,0,sizeof(stat_hist));
+	stat_nring = stat_ring_pos = 0;
+}
 
-	/* get STDIN to send us all input UNBUFFERED */
-	if (tcgetattr(0,&t) < 0) return 0;
-	t.c_lflag &= ~(ICANON | ECHO | ECHOE);
-	if (tcsetattr(0,TCSAFLUSH,&t) < 0) return 0;
+/* a frame of "t" seconds has gone out: the counters it took and its time */
+void StatFrame(double t)
+{
+	StatCount *a = &stat_total,*b = &stat_frame0,*d = &stat_last;
+	int k;
 
-	/* disable wrap-around */
-	write(1,nowrap,strlen(nowrap));
+	a->frames++;
+	a->frame += t;
+	d->reads = a->reads - b->reads;
+	d->read_bytes = a->read_bytes - b->read_bytes;
+	d->writes = a->writes - b->writes;
+	d->write_bytes = a->write_bytes - b->write_bytes;
+	d->seeks = a->seeks - b->seeks;
+	d->term_writes = a->term_writes - b->term_writes;
+	d->term_bytes = a->term_bytes - b->term_bytes;
+	d->frames = 1;
+	d->draw = a->draw - b->draw;
+	d->refresh = a->refresh - b->refresh;
+	d->frame = t;
 
-	return 1;
+	k = t > 1e-6 ? (int)(4.0 * log2(t * 1e6)) : 0;
+	if (k >= STAT_BUCKETS) k = STAT_BUCKETS - 1;
+	if (stat_nring == STAT_RING)	stat_hist[stat_ring[stat_ring_pos]]--;
+	else				stat_nring++;
+	stat_ring[stat_ring_pos] = (unsigned char)k;
+	stat_ring_pos = (stat_ring_pos + 1) % STAT_RING;
+	stat_hist[k]++;
 }
 
-int TermReset()
+/* the "p"th percentile (0..1) of recent frame times in ms, to the top of its bucket */
+double StatPercentile(double p)
 {
-	struct termios t;
+	unsigned int want,sum;
+	int k;
 
-	if (tcgetattr(0,&t) < 0) return 0;
-	t.c_lflag |= ICANON | ECHO | ECHOE;
-	if (tcsetattr(0,TCSAFLUSH,&t) < 0) return 0;
-	return 1;
+	if (stat_nring == 0) return 0;
+	want = (unsigned int)ceil(p * stat_nring);
+	if (want < 1) want = 1;
+	for (sum=0,k=0;k < (STAT_BUCKETS - 1) && (sum += stat_hist[k]) < want;) k++;
+	return pow(2.0,(k + 1) / 4.0) / 1000.0;
 }
 
-int TermEcho(int x)
+/* file abstraction: holes.
+ * a sparse file is described by the sorted list of its data extents on
+ * disk, found with SEEK_DATA/SEEK_HOLE the first time anything asks and
+ * again after the file is written to. FaDiskRead() fills holes in with
+ * zeros instead of reading them, rows that are all hole are drawn
+ * without reading, and whole-file operations skip chunks that are all
+ * hole when what they look for can't be all zeros. */
+typedef struct FaExtent {
+	unsigned long long	start,end;
+} FaExtent;
+
+static FaExtent		*fa_ext = NULL;
+static int		fa_next = 0;			/* extents, -1 = all data */
+static int		fa_ext_alloc = 0;
+static int		fa_ext_valid = 0;
+static pthread_mutex_t	fa_ext_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* forget the extents, the file has changed */
+void FaExtReset()
 {
-	struct termios t;
+	pthread_mutex_lock(&fa_ext_lock);
+	fa_ext_valid = 0;
+	pthread_mutex_unlock(&fa_ext_lock);
+}
 
-	if (tcgetattr(0,&t) < 0) return 0;
-	if (x)	t.c_lflag |= ECHO | ECHOE;
-	else	t.c_lflag &= ~(ECHO | ECHOE);
-	if (tcsetattr(0,TCSADRAIN,&t) < 0) return 0;
-	return 1;
+static void FaExtBuild()
+{
+	unsigned long long d,h;
+	FaExtent *ne;
+	off_t r;
+
+	fa_next = 0;
+	fa_ext_valid = 1;
+	for (d=0;d < fa_size;d=h) {
+		if ((r=StatLseek(file_fd,(off_t)d,SEEK_DATA)) < 0) {
+			if (errno != ENXIO) fa_next = -1;	/* no SEEK_DATA here, take it all as data */
+			break;
+		}
+		if ((d=(unsigned long long)r) >= fa_size) break;
+		r = StatLseek(file_fd,(off_t)d,SEEK_HOLE);
+		h = (r < 0 || (unsigned long long)r > fa_size) ? fa_size : (unsigned long long)r;
+		if (h <= d) {
+			fa_next = -1;
+			break;
+		}
+
+		if (fa_next >= fa_ext_alloc) {
+			if ((ne=(FaExtent*)realloc(fa_ext,sizeof(FaExtent) * (fa_ext_alloc + 256))) == NULL) {
+				fa_next = -1;
+				break;
+			}
+			fa_ext = ne;
+			fa_ext_alloc += 256;
+		}
+		fa_ext[fa_next].start = d;
+		fa_ext[fa_next].end = h;
+		fa_next++;
+	}
 }
 
-static char TermBuf[32];
-char *TermRead()
+/* is "ofs" on disk data (1) or hole (0)? *end is where that stops */
+int FaExtFind(unsigned long long ofs,unsigned long long *end)
 {
-	char c;
-	int i;
+	int lo,hi,mid,data;
 
-	/* read char */
-	i=0;
-	TermBuf[0]=0;
-	if (read(0,TermBuf,1) < 1) return TermBuf;
-	TermBuf[++i] = 0;
-	
-	/* escape sequence? */
-	if (TermBuf[0] == 27) {
-		read(0,TermBuf+1,1); i++;
-		/* ESC ESC means ESC */
-		if (TermBuf[1] == 27) {
-			TermBuf[2] = 0;
-			return TermBuf;
-		}
-		/* ESC[ means a VT100 scan code */
-		else if (TermBuf[1] == '[') {		
-			do {
-				read(0,&c,1);
-				TermBuf[i++] = c;
-			} while (i < 31 && (isdigit(c) || c == ';'));
-
-			TermBuf[i]=0;
-			return TermBuf;
-		}
-		/* ESC whatever? */
+	pthread_mutex_lock(&fa_ext_lock);
+	if (!fa_ext_valid) FaExtBuild();
+
+	if (fa_next < 0 || ofs >= fa_size) {
+		*end = ~0ULL;
+		data = 1;
+	}
+	else {
+		/* the last extent starting at or before ofs */
+		for (lo=0,hi=fa_next;lo < hi;) {
+			mid = (lo + hi) / 2;
+			if (fa_ext[mid].start <= ofs)	lo = mid + 1;
+			else				hi = mid;
+		}
+		if (lo > 0 && ofs < fa_ext[lo-1].end) {
+			*end = fa_ext[lo-1].end;
+			data = 1;
+		}
 		else {
-			TermBuf[2]=0;
-			return TermBuf;
+			*end = lo < fa_next ? fa_ext[lo].start : fa_size;
+			data = 0;
 		}
 	}
 
-	TermBuf[1]=0;
-	return TermBuf;
+	pthread_mutex_unlock(&fa_ext_lock);
+	return data;
 }
 
-int TermPosCurs(int y,int x)
+/* file abstraction: direct I/O.
+ * with -direct the file is opened O_DIRECT so that looking at a device
+ * does not push anything through the host's page cache. O_DIRECT wants
+ * the offset, length and memory aligned to the logical block size, so
+ * FaIoRead() and FaIoWrite() go through aligned bounce buffers of
+ * fa_dio_size bytes (or straight to the caller's buffer when it happens
+ * to be aligned already, like the block cache's). writes that don't
+ * cover whole blocks read the blocks first. everything that touches
+ * file_fd does its I/O through these two. */
+#define FA_DIO_POOL		20		/* job threads plus the helpers */
+
+int			fa_direct = 0;			/* -direct */
+unsigned long long	fa_dio_size = 1ULL << 20;	/* -dbuf, bounce buffer size */
+static unsigned long long fa_dio_align = 4096;		/* logical block size */
+static int		fa_dio_reg = 0;			/* file_fd is a regular file */
+static unsigned char	*fa_dio_pool[FA_DIO_POOL];
+static int		fa_dio_free = 0;		/* buffers in fa_dio_pool */
+static pthread_mutex_t	fa_dio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t	fa_dio_wlock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned char *FaDioGet()
 {
-	char buf[16];
+	unsigned char *b = NULL;
 
-	if (x < 1) x=1;
-	if (y < 1) y=1;
-	if (x > con_width) x=con_width;
-	if (y > con_height) y=con_height;
+	pthread_mutex_lock(&fa_dio_lock);
+	if (fa_dio_free > 0) b = fa_dio_pool[--fa_dio_free];
+	pthread_mutex_unlock(&fa_dio_lock);
 
-	sprintf(buf,"\x1b[%d;%df",y,x);
-	write(1,buf,strlen(buf));
-	return 1;
+	if (b == NULL && posix_memalign((void**)(&b),(size_t)(fa_dio_align > 4096 ? fa_dio_align : 4096),(size_t)fa_dio_size))
+		b = NULL;
+	return b;
 }
 
-int TermSize()
+static void FaDioPut(unsigned char *b)
 {
-	const char *rq = "\x1b[6n";		/* "ESC [ 6n" cursor position request */
-	const char *rqcm = "\x1b[255;255f";	/* tell it to put the cursor down to 255,255 or as far as it goes */
-	char *r,*r2;
-	char buf[32];
-	int ox,oy;
+	pthread_mutex_lock(&fa_dio_lock);
+	if (fa_dio_free < FA_DIO_POOL) {
+		fa_dio_pool[fa_dio_free++] = b;
+		b = NULL;
+	}
+	pthread_mutex_unlock(&fa_dio_lock);
+	free(b);
+}
 
-	/* print notice */
-	fprintf(stderr,"querying terminal..."); fflush(stderr);
+/* drop the pooled buffers, when nothing can be using them */
+static void FaDioRelease()
+{
+	while (fa_dio_free > 0) free(fa_dio_pool[--fa_dio_free]);
+}
 
-	/* current cursor position? */
-	write(1,rq,strlen(rq));
-	do { r=TermRead(); } while (r[0] != 27);
-	oy=atoi(r+2); r2=strstr(r,";");
-	ox=r2 ? atoi(r2+1) : 1;
+/* pick up the block size (and for a device, the size) of the file just opened */
+static unsigned long long FaDioSetup(int fd)
+{
+	unsigned long long size,a;
+	struct stat st;
+	int lbs;
 
-	/* how far can we go? */
-	write(1,rqcm,strlen(rqcm));
-	write(1,rq,strlen(rq));
-	do { r=TermRead(); } while (r[0] != 27);
-	con_height = atoi(r+2); r2=strstr(r,";");
-	con_width = r2 ? atoi(r2+1) : 1;
+	FaDioRelease();
+	fa_dio_align = 4096;
+	fa_dio_reg = 0;
+	size = (unsigned long long)StatLseek(fd,0,SEEK_END);
+	if (fstat(fd,&st) == 0) {
+		if (S_ISBLK(st.st_mode)) {
+			if (ioctl(fd,BLKSSZGET,&lbs) == 0 && lbs > 0) fa_dio_align = (unsigned long long)lbs;
+			if (ioctl(fd,BLKGETSIZE64,&a) == 0) size = a;
+		}
+		else {
+			fa_dio_reg = S_ISREG(st.st_mode);
+		}
+	}
 
-	/* restore cursor */
-	sprintf(buf,"\x1b[%d;%dH",oy,ox);
-	write(1,buf,strlen(buf));
+	/* the bounce buffer must hold a whole number of blocks */
+	a = fa_dio_align > 4096 ? fa_dio_align : 4096;
+	fa_dio_size = (fa_dio_size + a - 1) & ~(a - 1);
+	if (fa_dio_size < a) fa_dio_size = a;
+	return size;
+}
 
-	/* sanity check */
-	if (con_width < 16) con_width = 16;
-	if (con_height < 4) con_height = 4;
+/* pread() from fd, through aligned buffers when it is the O_DIRECT file_fd */
+ssize_t FaIoRead(int fd,void *buf,size_t len,unsigned long long ofs)
+{
+	unsigned long long at,a,skip,n,k;
+	unsigned char *b;
+	size_t done;
+	ssize_t rd;
 
-	/* print it to the console */
-	fflush(stderr);
-	fprintf(stderr,"\x0D");
-	fflush(stderr);
-	fprintf(stderr,"console size: %d rows x %d cols\n",con_height,con_width);
-	view_rows = con_height - 1;
+	if (!fa_direct || fd != file_fd) return StatPread(fd,buf,len,(off_t)ofs);
+	if ((((unsigned long)buf | ofs | len) & (fa_dio_align - 1)) == 0) return StatPread(fd,buf,len,(off_t)ofs);
+	if ((b=FaDioGet()) == NULL) return -1;
 
-	return 1;
+	for (done=0;done < len;done += (size_t)k) {
+		at = ofs + done;
+		a = at & ~(fa_dio_align - 1);
+		skip = at - a;
+		n = (skip + (len - done) + fa_dio_align - 1) & ~(fa_dio_align - 1);
+		if (n > fa_dio_size) n = fa_dio_size;
+
+		rd = StatPread(fd,b,(size_t)n,(off_t)a);
+		if (rd < 0 && done == 0) {
+			FaDioPut(b);
+			return -1;
+		}
+		if (rd <= (ssize_t)skip) break;
+		k = (unsigned long long)rd - skip;
+		if (k > (len - done)) k = len - done;
+		memcpy((unsigned char*)buf+done,b+skip,(size_t)k);
+		if ((unsigned long long)rd < n) {
+			done += (size_t)k;
+			break;
+		}
+	}
+
+	FaDioPut(b);
+	return (ssize_t)done;
 }
 
-void TermSizeSet(int w,int h)
+/* pwrite() to fd; on the O_DIRECT file_fd, partial blocks are read,
+ * patched and written back whole. a regular file is trimmed back if
+ * that padded it past its end. */
+ssize_t FaIoWrite(int fd,const void *buf,size_t len,unsigned long long ofs)
 {
-	con_width = w;
-	con_height = h;
-	view_rows = con_height - 1;
+	unsigned long long at,a,skip,n,k,oldsize = 0;
+	unsigned char *b;
+	struct stat st;
+	size_t done;
+	ssize_t rd;
+
+	if (fd == file_fd) FaExtReset();		/* may fill in a hole */
+	if (!fa_direct || fd != file_fd) return StatPwrite(fd,buf,len,(off_t)ofs);
+	if ((((unsigned long)buf | ofs | len) & (fa_dio_align - 1)) == 0) return StatPwrite(fd,buf,len,(off_t)ofs);
+	if ((b=FaDioGet()) == NULL) return -1;
+
+	/* read-modify-write of blocks shared between two writers would lose one */
+	pthread_mutex_lock(&fa_dio_wlock);
+	if (fa_dio_reg && fstat(fd,&st) == 0) oldsize = (unsigned long long)st.st_size;
+
+	for (done=0;done < len;done += (size_t)k) {
+		at = ofs + done;
+		a = at & ~(fa_dio_align - 1);
+		skip = at - a;
+		n = (skip + (len - done) + fa_dio_align - 1) & ~(fa_dio_align - 1);
+		if (n > fa_dio_size) n = fa_dio_size;
+		k = n - skip;
+		if (k > (len - done)) k = len - done;
+
+		if (skip != 0 || k != n) {
+			rd = StatPread(fd,b,(size_t)n,(off_t)a);
+			if (rd < 0) break;
+			if ((unsigned long long)rd < n) memset(b+rd,0,(size_t)(n - rd));
+		}
+		memcpy(b+skip,(const unsigned char*)buf+done,(size_t)k);
+		if (StatPwrite(fd,b,(size_t)n,(off_t)a) != (ssize_t)n) break;
+	}
+
+	at = (ofs + done) > oldsize ? ofs + done : oldsize;
+	if (fa_dio_reg && done != 0 && ((ofs + done + fa_dio_align - 1) & ~(fa_dio_align - 1)) > at)
+		if (ftruncate(fd,(off_t)at) < 0) done = 0;
+	pthread_mutex_unlock(&fa_dio_wlock);
+
+	FaDioPut(b);
+	return done != 0 ? (ssize_t)done : -1;
+}
+
+/* FaIoRead() of the file on disk, with holes filled in rather than read */
+ssize_t FaDiskRead(void *buf,size_t len,unsigned long long ofs)
+{
+	unsigned long long at,end;
+	size_t done,n;
+	ssize_t rd;
+
+	for (done=0;done < len;done += n) {
+		at = ofs + done;
+		n = len - done;
+		if (FaExtFind(at,&end)) {
+			if ((end - at) < n) n = (size_t)(end - at);
+			rd = FaIoRead(file_fd,(unsigned char*)buf+done,n,at);
+			if (rd < 0) return done != 0 ? (ssize_t)done : -1;
+			if ((size_t)rd < n) return (ssize_t)(done + rd);
+		}
+		else {
+			if ((end - at) < n) n = (size_t)(end - at);
+			memset((unsigned char*)buf+done,0,n);
+		}
+	}
+
+	return (ssize_t)done;
+}
+
+/* file abstraction: block cache.
+ * the file is read in aligned FA_BLOCK_SIZE blocks with pread() and kept
+ * around until the CLOCK hand comes by and finds the block unreferenced.
+ * fa_cache_max caps the memory used for block data. */
+#define FA_BLOCK_SHIFT		12
+#define FA_BLOCK_SIZE		(1 << FA_BLOCK_SHIFT)
+#define FA_CACHE_MIN		(16 * FA_BLOCK_SIZE)
+
+typedef struct FaBlock {
+	unsigned long long	blk;		/* block number (offset >> FA_BLOCK_SHIFT) */
+	int			len;		/* valid bytes in data[] */
+	int			next;		/* hash chain, -1 = end */
+	unsigned char		used;		/* slot holds a block */
+	unsigned char		ref;		/* CLOCK reference bit */
+	unsigned char		*data;
+} FaBlock;
+
+unsigned long long	fa_cache_max = 4ULL << 20;
+static FaBlock		*fa_blocks = NULL;
+static unsigned char	*fa_blockmem = NULL;
+static int		*fa_hash = NULL;
+static int		fa_nblocks = 0;
+static int		fa_hashsize = 0;
+static int		fa_clock = 0;
+
+void FaCacheFlush()
+{
+	int i;
+
+	for (i=0;i < fa_nblocks;i++) {
+		fa_blocks[i].used = 0;
+		fa_blocks[i].ref = 0;
+		fa_blocks[i].next = -1;
+	}
+	for (i=0;i < fa_hashsize;i++)
+		fa_hash[i] = -1;
+	fa_clock = 0;
 }
 
-static char			PrtTmp[256];
-static unsigned char		RowTmp[256];
-static unsigned long long	LastRowTmp;
-static int			LastRowTmpI=0;
+void FaCacheFree()
+{
+	if (fa_blocks) free(fa_blocks);
+	if (fa_blockmem) free(fa_blockmem);
+	if (fa_hash) free(fa_hash);
+	fa_blocks = NULL;
+	fa_blockmem = NULL;
+	fa_hash = NULL;
+	fa_nblocks = 0;
+	fa_hashsize = 0;
+}
 
-void DrawRowCacheFlush()
+/* (re)allocate the cache for a memory cap of "bytes" */
+int FaCacheSetup(unsigned long long bytes)
 {
-	LastRowTmp=0;
-	LastRowTmpI=0;
+	int i;
+
+	FaCacheFree();
+	if (bytes < FA_CACHE_MIN) bytes = FA_CACHE_MIN;
+	fa_cache_max = bytes;
+	fa_nblocks = (int)(bytes >> FA_BLOCK_SHIFT);
+	for (fa_hashsize=16;fa_hashsize < fa_nblocks*2;) fa_hashsize <<= 1;
+
+	fa_blocks = (FaBlock*)malloc(sizeof(FaBlock) * fa_nblocks);
+	fa_hash = (int*)malloc(sizeof(int) * fa_hashsize);
+	if (posix_memalign((void**)(&fa_blockmem),FA_BLOCK_SIZE,(size_t)fa_nblocks << FA_BLOCK_SHIFT))
+		fa_blockmem = NULL;
+	if (!fa_blocks || !fa_hash || !fa_blockmem) {
+		FaCacheFree();
+		return 0;
+	}
+
+	for (i=0;i < fa_nblocks;i++)
+		fa_blocks[i].data = fa_blockmem + ((size_t)i << FA_BLOCK_SHIFT);
+
+	FaCacheFlush();
+	return 1;
 }
 
-void DrawRow(int y,unsigned long long o)
-{
-	int x,w;
-	unsigned char c;
+static int FaCacheHash(unsigned long long blk)
+{
+	return (int)((blk * 0x9E3779B97F4A7C15ULL) >> 40) & (fa_hashsize - 1);
+}
+
+static FaBlock *FaCacheLookup(unsigned long long blk)
+{
+	int i;
+
+	for (i=fa_hash[FaCacheHash(blk)];i >= 0;i=fa_blocks[i].next) {
+		if (fa_blocks[i].blk == blk) {
+			fa_blocks[i].ref = 1;
+			return fa_blocks+i;
+		}
+	}
+
+	return NULL;
+}
+
+/* pick a victim slot with the CLOCK algorithm and unhook it from the hash */
+static int FaCacheVictim()
+{
+	int i,*pp;
+
+	for (;;) {
+		i = fa_clock;
+		fa_clock = (fa_clock + 1) % fa_nblocks;
+		if (!fa_blocks[i].used) break;
+		if (fa_blocks[i].ref) {
+			fa_blocks[i].ref = 0;
+			continue;
+		}
+
+		pp = &fa_hash[FaCacheHash(fa_blocks[i].blk)];
+		while (*pp != i) pp = &fa_blocks[*pp].next;
+		*pp = fa_blocks[i].next;
+		fa_blocks[i].used = 0;
+		break;
+	}
+
+	return i;
+}
+
+/* return the cached block, reading it in if necessary */
+static FaBlock *FaCacheGet(unsigned long long blk)
+{
+	FaBlock *b;
+	ssize_t rd;
+	int i,h;
+
+	if (!fa_blocks && !FaCacheSetup(fa_cache_max)) return NULL;
+	if ((b=FaCacheLookup(blk)) != NULL) return b;
+
+	i = FaCacheVictim();
+	b = fa_blocks+i;
+	rd = FaDiskRead(b->data,FA_BLOCK_SIZE,blk << FA_BLOCK_SHIFT);
+	if (rd < 0) rd = 0;
+	b->len = (int)rd;
+	b->blk = blk;
+	b->used = 1;
+	b->ref = 1;
+	h = FaCacheHash(blk);
+	b->next = fa_hash[h];
+	fa_hash[h] = i;
+	return b;
+}
+
+/* file abstraction: memory mapped viewing.
+ * with -mmap a read-only file is viewed through a window of fa_map_window
+ * bytes (the whole file if it fits) instead of the block cache, and the
+ * kernel page cache does the work. */
+enum {				FA_ADV_NORMAL=0,
+				FA_ADV_RANDOM=1,
+				FA_ADV_SEQUENTIAL=2 };
+
+int			fa_use_mmap = 0;
+int			fa_mapped = 0;
+unsigned long long	fa_map_window = 1ULL << 30;
+static unsigned char	*fa_map_base = NULL;
+static unsigned long long fa_map_ofs = 0;
+static unsigned long long fa_map_len = 0;
+static int		fa_advice = FA_ADV_NORMAL;
+
+void FaMapRelease()
+{
+	if (fa_map_base) munmap(fa_map_base,fa_map_len);
+	fa_map_base = NULL;
+	fa_map_ofs = 0;
+	fa_map_len = 0;
+}
+
+/* cut the file on disk to "size" bytes and bring the extent list, the
+ * mapping and the block cache in line with it. returns 0 on error */
+int FaTruncate(unsigned long long size)
+{
+	if (ftruncate(file_fd,(off_t)size) < 0) return 0;
+	FaExtReset();
+	FaMapRelease();
+	FaCacheFlush();
+	fa_size = file_size = size;
+	return 1;
+}
+
+static void FaMapAdvise()
+{
+	int a;
+
+	if (!fa_map_base) return;
+	if (fa_advice == FA_ADV_RANDOM)			a = MADV_RANDOM;
+	else if (fa_advice == FA_ADV_SEQUENTIAL)	a = MADV_SEQUENTIAL;
+	else						a = MADV_NORMAL;
+	madvise(fa_map_base,fa_map_len,a);
+}
+
+/* make sure [ofs,ofs+len) is inside the mapped window, sliding it if needed */
+static const unsigned char *FaMapWindow(unsigned long long ofs,int len)
+{
+	unsigned long long st,ml,pg;
+	void *p;
+
+	if (ofs >= fa_map_ofs && (ofs + len) <= (fa_map_ofs + fa_map_len))
+		return fa_map_base + (ofs - fa_map_ofs);
+
+	FaMapRelease();
+	pg = (unsigned long long)sysconf(_SC_PAGESIZE);
+	if (fa_size <= fa_map_window) {
+		st = 0;
+		ml = fa_size;
+	}
+	else {
+		/* keep a quarter of the window behind us for scrolling back */
+		st = ofs > (fa_map_window / 4) ? ofs - (fa_map_window / 4) : 0;
+		st &= ~(pg - 1);
+		ml = fa_map_window;
+		if ((st + ml) > fa_size) ml = fa_size - st;
+		if ((ofs + len) > (st + ml)) return NULL;
+	}
+
+	if (ml == 0) return NULL;
+	p = mmap(NULL,(size_t)ml,PROT_READ,MAP_SHARED,file_fd,(off_t)st);
+	if (p == MAP_FAILED) {
+		/* not mappable (pipe, some devices): fall back to the block cache */
+		fa_mapped = 0;
+		return NULL;
+	}
+	fa_map_base = (unsigned char*)p;
+	fa_map_ofs = st;
+	fa_map_len = ml;
+	FaMapAdvise();
+	return fa_map_base + (ofs - fa_map_ofs);
+}
+
+/* tell the kernel how we are about to move through the file */
+void FaAdvise(int how)
+{
+	if (file_fd < 0 || fa_direct || how == fa_advice) return;
+	fa_advice = how;
+
+	if (fa_mapped) {
+		FaMapAdvise();
+	}
+	else {
+		if (how == FA_ADV_RANDOM)		posix_fadvise(file_fd,0,0,POSIX_FADV_RANDOM);
+		else if (how == FA_ADV_SEQUENTIAL)	posix_fadvise(file_fd,0,0,POSIX_FADV_SEQUENTIAL);
+		else					posix_fadvise(file_fd,0,0,POSIX_FADV_NORMAL);
+	}
+}
+
+/* hint that [ofs,ofs+len) will be viewed soon */
+void FaWillNeed(unsigned long long ofs,unsigned long long len)
+{
+	unsigned long long pg,e;
+
+	if (file_fd < 0 || fa_direct || ofs >= fa_size) return;
+	if (len > (fa_size - ofs)) len = fa_size - ofs;
+
+	if (fa_mapped) {
+		if (!fa_map_base) return;
+		e = ofs + len;
+		if (ofs < fa_map_ofs) ofs = fa_map_ofs;
+		if (e > (fa_map_ofs + fa_map_len)) e = fa_map_ofs + fa_map_len;
+		if (ofs >= e) return;
+		pg = (unsigned long long)sysconf(_SC_PAGESIZE);
+		ofs = (ofs - fa_map_ofs) & ~(pg - 1);
+		madvise(fa_map_base+ofs,(size_t)(e - fa_map_ofs - ofs),MADV_WILLNEED);
+	}
+	else {
+		posix_fadvise(file_fd,(off_t)ofs,(off_t)len,POSIX_FADV_WILLNEED);
+	}
+}
+
+/* read "len" bytes of the file on disk at "ofs" through the block cache.
+ * returns the number of bytes actually available (short at EOF). */
+int FaRawRead(unsigned long long ofs,int len,unsigned char *buf)
+{
+	const unsigned char *p;
+	unsigned long long blk;
+	int bo,n,got;
+	FaBlock *b;
+
+	if (file_fd < 0 || ofs >= fa_size) return 0;
+	if ((unsigned long long)len > (fa_size - ofs)) len = (int)(fa_size - ofs);
+
+	if (fa_mapped && (p=FaMapWindow(ofs,len)) != NULL) {
+		memcpy(buf,p,len);
+		return len;
+	}
+
+	got = 0;
+	while (got < len) {
+		blk = (ofs + got) >> FA_BLOCK_SHIFT;
+		bo = (int)((ofs + got) & (FA_BLOCK_SIZE - 1));
+		if ((b=FaCacheGet(blk)) == NULL || bo >= b->len) break;
+		n = b->len - bo;
+		if (n > (len - got)) n = len - got;
+		memcpy(buf+got,b->data+bo,n);
+		got += n;
+	}
+
+	return got;
+}
+
+/* return a pointer to up to "len" bytes of the file on disk at "ofs"
+ * without copying, or NULL if the range is not contiguous in memory.
+ * *got receives the usable length. the pointer is only valid until the
+ * next Fa call. */
+const unsigned char *FaRawMap(unsigned long long ofs,int len,int *got)
+{
+	const unsigned char *p;
+	FaBlock *b;
+	int bo;
+
+	*got = 0;
+	if (file_fd < 0 || ofs >= fa_size) return NULL;
+	if ((unsigned long long)len > (fa_size - ofs)) len = (int)(fa_size - ofs);
+
+	if (fa_mapped) {
+		if ((p=FaMapWindow(ofs,len)) == NULL) return NULL;
+		*got = len;
+		return p;
+	}
+
+	bo = (int)(ofs & (FA_BLOCK_SIZE - 1));
+	if ((bo + len) > FA_BLOCK_SIZE) return NULL;
+	if ((b=FaCacheGet(ofs >> FA_BLOCK_SHIFT)) == NULL || (bo + len) > b->len) return NULL;
+	*got = len;
+	return b->data + bo;
+}
+
+/* bring cached blocks up to date after "len" bytes were written at "ofs" */
+void FaCacheUpdate(unsigned long long ofs,size_t len,const unsigned char *buf)
+{
+	unsigned long long blk;
+	size_t done;
+	int bo,n;
+	FaBlock *b;
+
+	if (!fa_blocks) return;
+	for (done=0;done < len;done += n) {
+		blk = (ofs + done) >> FA_BLOCK_SHIFT;
+		bo = (int)((ofs + done) & (FA_BLOCK_SIZE - 1));
+		n = FA_BLOCK_SIZE - bo;
+		if ((size_t)n > (len - done)) n = (int)(len - done);
+		if ((b=FaCacheLookup(blk)) != NULL) {
+			if (b->len < bo) memset(b->data+b->len,0,bo-b->len);
+			memcpy(b->data+bo,buf+done,n);
+			if (b->len < (bo + n)) b->len = bo + n;
+		}
+	}
+}
+
+/* write "len" bytes to the file on disk at "ofs", keeping cached blocks coherent */
+int FaRawWrite(unsigned long long ofs,int len,const unsigned char *buf)
+{
+	ssize_t wr;
+
+	if (file_fd < 0) return 0;
+	wr = FaIoWrite(file_fd,buf,len,ofs);
+	if (wr <= 0) return 0;
+
+	FaCacheUpdate(ofs,(size_t)wr,buf);
+	if ((ofs + wr) > fa_size) fa_size = ofs + wr;
+	return (int)wr;
+}
+
+/* edit overlay.
+ * changes are not written to the file as they are made. once something is
+ * edited, ed_pieces describes the whole file as a list of pieces sorted by
+ * offset, each either a run of the file on disk or a run of ed_add where
+ * new bytes are appended. FaRead() merges them. every edit replaces the
+ * pieces covering a range and remembers both sets on the undo list, and
+ * EdCommit() writes the ed_add pieces back with pwritev(). */
+typedef struct EdPiece {
+	unsigned long long	ofs;		/* offset in the file as viewed */
+	unsigned long long	len;
+	unsigned long long	src;		/* offset on disk or in ed_add */
+	int			add;		/* bytes are in ed_add */
+} EdPiece;
+
+typedef struct EdUndo {
+	unsigned long long	ofs;
+	unsigned long long	oldlen,newlen;	/* bytes covered before and after */
+	EdPiece			*oldp,*newp;
+	int			noldp,nnewp;
+} EdUndo;
+
+static int		ed_active = 0;		/* ed_pieces describes the file */
+static EdPiece		*ed_pieces = NULL;
+static int		ed_npieces = 0;
+static int		ed_apieces = 0;
+static unsigned char	*ed_add = NULL;
+static size_t		ed_add_len = 0;
+static size_t		ed_add_alloc = 0;
+static EdUndo		*ed_undo = NULL;
+static int		ed_nundo = 0;		/* records on the list */
+static int		ed_undo_pos = 0;	/* records before this one are applied */
+static int		ed_aundo = 0;
+
+int EdDirty()
+{
+	return ed_active;
+}
+
+static void EdUndoFree(int from)
+{
+	int i;
+
+	for (i=from;i < ed_nundo;i++) {
+		free(ed_undo[i].oldp);
+		free(ed_undo[i].newp);
+	}
+	ed_nundo = from;
+	if (ed_undo_pos > ed_nundo) ed_undo_pos = ed_nundo;
+}
+
+/* forget all edits */
+void EdReset()
+{
+	EdUndoFree(0);
+	ed_undo_pos = 0;
+	ed_active = 0;
+	ed_npieces = 0;
+	ed_add_len = 0;
+	file_size = fa_size;
+}
+
+static int EdPieceRoom(int n)
+{
+	EdPiece *p;
+	int na;
+
+	if (n <= ed_apieces) return 1;
+	for (na=ed_apieces ? ed_apieces : 64;na < n;) na *= 2;
+	if ((p=(EdPiece*)realloc(ed_pieces,sizeof(EdPiece) * na)) == NULL) return 0;
+	ed_pieces = p;
+	ed_apieces = na;
+	return 1;
+}
+
+/* make room for "len" more bytes at the end of ed_add */
+static int EdAddRoom(size_t len)
+{
+	unsigned char *p;
+	size_t na;
+
+	if ((ed_add_len + len) > ed_add_alloc) {
+		for (na=ed_add_alloc ? ed_add_alloc : 65536;na < (ed_add_len + len);) na *= 2;
+		if ((p=(unsigned char*)realloc(ed_add,na)) == NULL) return 0;
+		ed_add = p;
+		ed_add_alloc = na;
+	}
+
+	return 1;
+}
+
+/* append bytes to ed_add, returning where they went or -1 */
+static long long EdAddBytes(const unsigned char *buf,size_t len)
+{
+	size_t o;
+
+	if (!EdAddRoom(len)) return -1;
+	o = ed_add_len;
+	memcpy(ed_add+o,buf,len);
+	ed_add_len += len;
+	return (long long)o;
+}
+
+/* index of the piece containing "ofs", or ed_npieces if ofs is at the end */
+static int EdFind(unsigned long long ofs)
+{
+	int lo,hi,mid;
+
+	lo = 0;
+	hi = ed_npieces;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if ((ed_pieces[mid].ofs + ed_pieces[mid].len) <= ofs)	lo = mid + 1;
+		else							hi = mid;
+	}
+
+	return lo;
+}
+
+/* make sure a piece starts at "ofs", returning its index */
+static int EdSplit(unsigned long long ofs)
+{
+	EdPiece *p;
+	int i;
+	unsigned long long d;
+
+	i = EdFind(ofs);
+	if (i >= ed_npieces || ed_pieces[i].ofs == ofs) return i;
+	if (!EdPieceRoom(ed_npieces + 1)) return -1;
+
+	memmove(ed_pieces+i+1,ed_pieces+i,sizeof(EdPiece) * (ed_npieces - i));
+	ed_npieces++;
+	p = ed_pieces + i;
+	d = ofs - p->ofs;
+	p[1].ofs = ofs;
+	p[1].len = p->len - d;
+	p[1].src = p->src + d;
+	p->len = d;
+	return i + 1;
+}
+
+/* join neighbouring pieces around [i0,i1) that continue each other */
+static void EdMerge(int i0,int i1)
+{
+	EdPiece *a,*b;
+	int i;
+
+	if (i0 < 1) i0 = 1;
+	if (i1 > (ed_npieces - 1)) i1 = ed_npieces - 1;
+	for (i=i1;i >= i0;i--) {
+		a = ed_pieces + i - 1;
+		b = ed_pieces + i;
+		if (a->add == b->add && (a->src + a->len) == b->src) {
+			a->len += b->len;
+			memmove(b,b+1,sizeof(EdPiece) * (ed_npieces - i - 1));
+			ed_npieces--;
+		}
+	}
+}
+
+/* replace the "dellen" bytes at "ofs" with pieces np[0..nn) (nn may be 0).
+ * the pieces taken out are returned through oldp and nold if asked for. */
+static int EdReplace(unsigned long long ofs,unsigned long long dellen,const EdPiece *np,int nn,EdPiece **oldp,int *nold)
+{
+	unsigned long long o,inslen;
+	int i,j,k;
+
+	if (!ed_active) {
+		if (!EdPieceRoom(1)) return 0;
+		ed_pieces[0].ofs = 0;
+		ed_pieces[0].len = fa_size;
+		ed_pieces[0].src = 0;
+		ed_pieces[0].add = 0;
+		ed_npieces = fa_size != 0 ? 1 : 0;
+		ed_active = 1;
+	}
+
+	if ((i=EdSplit(ofs)) < 0 || (j=EdSplit(ofs + dellen)) < 0) return 0;
+	if (!EdPieceRoom(ed_npieces + nn)) return 0;
+
+	if (oldp) {
+		*nold = j - i;
+		*oldp = (EdPiece*)malloc(sizeof(EdPiece) * (j - i + 1));
+		if (!*oldp) return 0;
+		memcpy(*oldp,ed_pieces+i,sizeof(EdPiece) * (j - i));
+	}
+
+	inslen = 0;
+	for (k=0;k < nn;k++) inslen += np[k].len;
+
+	memmove(ed_pieces+i+nn,ed_pieces+j,sizeof(EdPiece) * (ed_npieces - j));
+	ed_npieces += nn - (j - i);
+	for (o=ofs,k=0;k < nn;k++) {
+		ed_pieces[i+k] = np[k];
+		ed_pieces[i+k].ofs = o;
+		o += np[k].len;
+	}
+	for (k=i+nn;k < ed_npieces;k++)
+		ed_pieces[k].ofs = ed_pieces[k].ofs - dellen + inslen;
+
+	file_size = file_size - dellen + inslen;
+	EdMerge(i,i+nn+1);
+	return 1;
+}
+
+/* replace "dellen" bytes at "ofs" with the "len" bytes already at "src"
+ * in ed_add, as one undoable edit */
+static int EdEditAdd(unsigned long long ofs,unsigned long long dellen,unsigned long long src,unsigned long long len)
+{
+	EdPiece np,*oldp,*newp;
+	EdUndo *u;
+	int nold;
+
+	if (ed_nundo >= ed_aundo) {
+		int na = ed_aundo ? ed_aundo * 2 : 256;
+		EdUndo *p = (EdUndo*)realloc(ed_undo,sizeof(EdUndo) * na);
+
+		if (!p) return 0;
+		ed_undo = p;
+		ed_aundo = na;
+	}
+
+	np.ofs = ofs;
+	np.len = len;
+	np.src = src;
+	np.add = 1;
+
+	/* get the undo entry's copy before anything changes, so redo has it */
+	if ((newp=(EdPiece*)malloc(sizeof(EdPiece))) == NULL) return 0;
+	*newp = np;
+	if (!EdReplace(ofs,dellen,&np,len != 0 ? 1 : 0,&oldp,&nold)) {
+		free(newp);
+		return 0;
+	}
+
+	/* a new edit makes anything undone unreachable */
+	EdUndoFree(ed_undo_pos);
+	u = ed_undo + ed_nundo++;
+	u->ofs = ofs;
+	u->oldlen = dellen;
+	u->newlen = len;
+	u->oldp = oldp;
+	u->noldp = nold;
+	u->newp = newp;
+	u->nnewp = len != 0 ? 1 : 0;
+	ed_undo_pos = ed_nundo;
+	return 1;
+}
+
+/* record an edit that replaces "dellen" bytes at "ofs" with "buf" */
+static int EdEdit(unsigned long long ofs,unsigned long long dellen,const unsigned char *buf,size_t len)
+{
+	long long src = 0;
+
+	if (len != 0 && (src=EdAddBytes(buf,len)) < 0) return 0;
+	return EdEditAdd(ofs,dellen,(unsigned long long)src,len);
+}
+
+/* overwrite "len" bytes at "ofs" */
+int EdOverwrite(unsigned long long ofs,const unsigned char *buf,size_t len)
+{
+	if (ofs >= file_size) return 0;
+	if (len > (file_size - ofs)) len = (size_t)(file_size - ofs);
+	return EdEdit(ofs,len,buf,len);
+}
+
+/* undo the last edit, returning the offset it was at or -1 */
+long long EdUndoLast()
+{
+	EdUndo *u;
+
+	if (ed_undo_pos == 0) return -1;
+	u = ed_undo + --ed_undo_pos;
+	EdReplace(u->ofs,u->newlen,u->oldp,u->noldp,NULL,NULL);
+	return (long long)u->ofs;
+}
+
+long long EdRedo()
+{
+	EdUndo *u;
+
+	if (ed_undo_pos >= ed_nundo) return -1;
+	u = ed_undo + ed_undo_pos++;
+	EdReplace(u->ofs,u->oldlen,u->newp,u->nnewp,NULL,NULL);
+	return (long long)u->ofs;
+}
+
+/* insert "len" bytes at "ofs" */
+int EdInsert(unsigned long long ofs,const unsigned char *buf,size_t len)
+{
+	if (ofs > file_size || len == 0) return 0;
+	return EdEdit(ofs,0,buf,len);
+}
+
+/* delete "len" bytes at "ofs" */
+int EdDelete(unsigned long long ofs,unsigned long long len)
+{
+	if (ofs >= file_size) return 0;
+	if (len > (file_size - ofs)) len = file_size - ofs;
+	return EdEdit(ofs,len,NULL,0);
+}
+
+/* saving.
+ * only pieces from the first one that is not the file's own data in its
+ * own place need writing. if every moved run of the file moves towards the
+ * start (deletes) writing front to back never overwrites data still to be
+ * read, and if every one moves towards the end (inserts) back to front
+ * doesn't either. anything else is staged in a temporary file first. */
+#define ED_COPY_BUF		(8 << 20)
+
+static unsigned char	*ed_copy_buf = NULL;
+
+/* copy "len" bytes from sfd at "src" to dfd at "dst". the ranges may overlap
+ * when sfd == dfd, in which case the copy runs in the safe direction: a
+ * chunk bounced through memory is all read before any of it is written, so
+ * it may overlap itself, but copy_file_range() refuses overlapping ranges
+ * and is only used when the shift is at least a whole chunk. */
+static int EdCopy(int dfd,unsigned long long dst,int sfd,unsigned long long src,unsigned long long len)
+{
+	unsigned long long d,done;
+	loff_t so,doo;
+	ssize_t rd;
+	int back,kernel;
+
+	if (len == 0 || (sfd == dfd && src == dst)) return 1;
+	if (!ed_copy_buf && (ed_copy_buf=(unsigned char*)malloc(ED_COPY_BUF)) == NULL) return 0;
+
+	back = (sfd == dfd && dst > src);
+	kernel = !fa_direct || (sfd != file_fd && dfd != file_fd);
+	if (sfd == dfd) {
+		d = back ? dst - src : src - dst;
+		if (d < ED_COPY_BUF) kernel = 0;
+	}
+
+	for (done=0;done < len;done += (unsigned long long)rd) {
+		unsigned long long n = (len - done) < ED_COPY_BUF ? (len - done) : ED_COPY_BUF;
+		unsigned long long at = back ? len - done - n : done;
+
+		/* let the kernel move it if it can, otherwise bounce through memory */
+		so = (loff_t)(src + at);
+		doo = (loff_t)(dst + at);
+		if (kernel) {
+			rd = copy_file_range(sfd,&so,dfd,&doo,(size_t)n,0);
+			StatWrite(rd);
+			if (rd == (ssize_t)n) continue;
+		}
+
+		rd = FaIoRead(sfd,ed_copy_buf,(size_t)n,src + at);
+		if (rd != (ssize_t)n) return 0;
+		if (FaIoWrite(dfd,ed_copy_buf,(size_t)n,dst + at) != (ssize_t)n) return 0;
+	}
+
+	return 1;
+}
+
+/* write the run of ed_add pieces [a,b) to fd, shifted by "base" */
+static int EdWriteAdd(int fd,int a,int b,unsigned long long base)
+{
+	struct iovec iov[64];
+	unsigned long long at;
+	ssize_t want,rd;
+	int i,n;
+
+	while (a < b) {
+		at = ed_pieces[a].ofs - base;
+		for (n=0,want=0;a < b && n < 64;a++,n++) {
+			iov[n].iov_base = ed_add + ed_pieces[a].src;
+			iov[n].iov_len = (size_t)ed_pieces[a].len;
+			want += (ssize_t)ed_pieces[a].len;
+		}
+
+		if (fa_direct && fd == file_fd) {
+			/* O_DIRECT wants aligned buffers, which these aren't */
+			for (i=0;i < n;at += iov[i].iov_len,i++)
+				if (FaIoWrite(fd,iov[i].iov_base,iov[i].iov_len,at) != (ssize_t)iov[i].iov_len) return 0;
+		}
+		else {
+			rd = pwritev(fd,iov,n,(off_t)at);
+			StatWrite(rd);
+			if (rd != want) return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* write pieces [first,ed_npieces) in place, front to back or back to front */
+static int EdWriteInPlace(int first,int back)
+{
+	int i,j;
+
+	if (!back) {
+		for (i=first;i < ed_npieces;) {
+			if (ed_pieces[i].add) {
+				for (j=i;j < ed_npieces && ed_pieces[j].add;) j++;
+				if (!EdWriteAdd(file_fd,i,j,0)) return 0;
+				i = j;
+			}
+			else {
+				if (!EdCopy(file_fd,ed_pieces[i].ofs,file_fd,ed_pieces[i].src,ed_pieces[i].len)) return 0;
+				i++;
+			}
+		}
+	}
+	else {
+		for (i=ed_npieces-1;i >= first;) {
+			if (ed_pieces[i].add) {
+				for (j=i;j >= first && ed_pieces[j].add;) j--;
+				if (!EdWriteAdd(file_fd,j+1,i+1,0)) return 0;
+				i = j;
+			}
+			else {
+				if (!EdCopy(file_fd,ed_pieces[i].ofs,file_fd,ed_pieces[i].src,ed_pieces[i].len)) return 0;
+				i--;
+			}
+		}
+	}
+
+	return 1;
+}
+
+/* build everything from pieces[first] on in a temporary file, then copy it back */
+static int EdWriteStaged(int first)
+{
+	unsigned long long base;
+	int i,j,tfd,ok;
+	FILE *tf;
+
+	if ((tf=tmpfile()) == NULL) return 0;
+	tfd = fileno(tf);
+	base = ed_pieces[first].ofs;
+	ok = 1;
+
+	for (i=first;ok && i < ed_npieces;) {
+		if (ed_pieces[i].add) {
+			for (j=i;j < ed_npieces && ed_pieces[j].add;) j++;
+			ok = EdWriteAdd(tfd,i,j,base);
+			i = j;
+		}
+		else {
+			ok = EdCopy(tfd,ed_pieces[i].ofs - base,file_fd,ed_pieces[i].src,ed_pieces[i].len);
+			i++;
+		}
+	}
+
+	if (ok) ok = EdCopy(file_fd,base,tfd,0,file_size - base);
+	fclose(tf);
+	return ok;
+}
+
+/* write the file as edited back to disk */
+int EdCommit()
+{
+	int i,first,fwd,back,moved;
+	EdPiece *p;
+
+	if (!ed_active) return 1;
+	FaExtReset();
+
+	/* pieces before "first" are already on disk as they should be */
+	for (first=0;first < ed_npieces;first++) {
+		p = ed_pieces + first;
+		if (p->add || p->src != p->ofs) break;
+	}
+
+	fwd = back = 1;
+	moved = 0;
+	for (i=first;i < ed_npieces;i++) {
+		p = ed_pieces + i;
+		if (p->add || p->src == p->ofs) continue;
+		moved = 1;
+		if (p->src < p->ofs)	fwd = 0;
+		else			back = 0;
+	}
+
+	if (first < ed_npieces) {
+		if (fwd) {
+			if (!EdWriteInPlace(first,0)) return 0;
+		}
+		else if (back) {
+			if (!EdWriteInPlace(first,1)) return 0;
+		}
+		else if (!EdWriteStaged(first)) {
+			return 0;
+		}
+	}
+
+	if (file_size < fa_size && ftruncate(file_fd,(off_t)file_size) < 0) return 0;
+
+	/* plain overwrites can patch the cache, anything that moved data can't */
+	if (moved || file_size != fa_size) {
+		FaCacheFlush();
+	}
+	else {
+		for (i=first;i < ed_npieces;i++)
+			if (ed_pieces[i].add)
+				FaCacheUpdate(ed_pieces[i].ofs,(size_t)ed_pieces[i].len,ed_add+ed_pieces[i].src);
+	}
+
+	fa_size = file_size;
+	EdReset();
+	return 1;
+}
+
+/* read "len" bytes at "ofs" of the file as edited.
+ * returns the number of bytes actually available (short at EOF). */
+int FaRead(unsigned long long ofs,int len,unsigned char *buf)
+{
+	EdPiece *p;
+	int i,got,n;
+	unsigned long long d;
+
+	if (!ed_active) return FaRawRead(ofs,len,buf);
+	if (ofs >= file_size) return 0;
+	if ((unsigned long long)len > (file_size - ofs)) len = (int)(file_size - ofs);
+
+	got = 0;
+	for (i=EdFind(ofs);got < len && i < ed_npieces;i++) {
+		p = ed_pieces + i;
+		d = (ofs + got) - p->ofs;
+		n = (p->len - d) < (unsigned long long)(len - got) ? (int)(p->len - d) : len - got;
+		if (p->add)
+			memcpy(buf+got,ed_add+p->src+d,n);
+		else if (FaRawRead(p->src+d,n,buf+got) < n)
+			break;
+		got += n;
+	}
+
+	return got;
+}
+
+/* like FaRawMap(), for the file as edited */
+const unsigned char *FaMap(unsigned long long ofs,int len,int *got)
+{
+	EdPiece *p;
+	unsigned long long d;
+	int i;
+
+	if (!ed_active) return FaRawMap(ofs,len,got);
+	*got = 0;
+	if (ofs >= file_size) return NULL;
+	if ((unsigned long long)len > (file_size - ofs)) len = (int)(file_size - ofs);
+
+	i = EdFind(ofs);
+	p = ed_pieces + i;
+	d = ofs - p->ofs;
+	if ((d + len) > p->len) return NULL;
+	if (!p->add) return FaRawMap(p->src+d,len,got);
+	*got = len;
+	return ed_add + p->src + d;
+}
+
+/* read "len" bytes at "ofs" of the file as edited without going through
+ * the block cache, for long scans. safe to call from worker threads as
+ * long as nothing is being edited. returns the bytes read. */
+size_t FaBulkRead(unsigned long long ofs,size_t len,unsigned char *buf)
+{
+	unsigned long long d,pofs,plen,psrc;
+	size_t got,n;
+	ssize_t rd;
+	int i,add;
+
+	if (file_fd < 0 || ofs >= file_size) return 0;
+	if (len > (file_size - ofs)) len = (size_t)(file_size - ofs);
+
+	i = ed_active ? EdFind(ofs) : 0;
+	for (got=0;got < len;got += n) {
+		if (ed_active) {
+			if (i >= ed_npieces) break;
+			pofs = ed_pieces[i].ofs;
+			plen = ed_pieces[i].len;
+			psrc = ed_pieces[i].src;
+			add = ed_pieces[i].add;
+			i++;
+		}
+		else {
+			pofs = psrc = 0;
+			plen = fa_size;
+			add = 0;
+		}
+
+		d = (ofs + got) - pofs;
+		n = (plen - d) < (len - got) ? (size_t)(plen - d) : len - got;
+		if (add) {
+			memcpy(buf+got,ed_add+psrc+d,n);
+		}
+		else {
+			rd = FaDiskRead(buf+got,n,psrc + d);
+			if (rd <= 0) break;
+			if ((size_t)rd < n) n = (size_t)rd;
+		}
+	}
+
+	return got;
+}
+
+/* is all of [ofs,ofs+len) of the file as edited hole on disk? */
+int FaIsHole(unsigned long long ofs,unsigned long long len)
+{
+	unsigned long long d,n,pofs,plen,psrc,end;
+	int i;
+
+	if (file_fd < 0 || len == 0 || ofs >= file_size) return 0;
+	if (len > (file_size - ofs)) len = file_size - ofs;
+
+	i = ed_active ? EdFind(ofs) : 0;
+	while (len > 0) {
+		if (ed_active) {
+			if (i >= ed_npieces || ed_pieces[i].add) return 0;
+			pofs = ed_pieces[i].ofs;
+			plen = ed_pieces[i].len;
+			psrc = ed_pieces[i].src;
+			i++;
+		}
+		else {
+			pofs = psrc = 0;
+			plen = fa_size;
+		}
+
+		d = ofs - pofs;
+		n = (plen - d) < len ? plen - d : len;
+		if (FaExtFind(psrc + d,&end) || (end - (psrc + d)) < n) return 0;
+		ofs += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+/* the first offset at or after "ofs" of the file as edited that is hole
+ * on disk (hole = 1) or not (hole = 0), file_size if none */
+unsigned long long FaNextExtent(unsigned long long ofs,int hole)
+{
+	unsigned long long d,n,pofs,plen,psrc,end;
+	int i,add;
+
+	if (file_fd < 0) return file_size;
+	i = ed_active ? EdFind(ofs) : 0;
+	while (ofs < file_size) {
+		if (ed_active) {
+			if (i >= ed_npieces) break;
+			pofs = ed_pieces[i].ofs;
+			plen = ed_pieces[i].len;
+			psrc = ed_pieces[i].src;
+			add = ed_pieces[i].add;
+		}
+		else {
+			pofs = psrc = 0;
+			plen = fa_size;
+			add = 0;
+		}
+
+		d = ofs - pofs;
+		if (add) {
+			if (!hole) return ofs;
+			n = plen - d;
+		}
+		else {
+			if (FaExtFind(psrc + d,&end) == !hole) return ofs;
+			n = (end - (psrc + d)) < (plen - d) ? end - (psrc + d) : plen - d;
+		}
+		ofs += n;
+		if (ofs >= (pofs + plen)) i++;
+	}
+
+	return file_size;
+}
+
+/* background readahead.
+ * RaNote() is told where the view is after every key. it keeps a running
+ * estimate of which way and how fast the view is moving and sets a target
+ * that far ahead (at least RA_SCREENS screens, at most ra_max bytes); a
+ * worker thread walks toward the target with readahead() a step at a
+ * time so the page cache is warm by the time DrawRow() gets there. a
+ * jump or a change of direction bumps ra_gen, which makes the worker
+ * drop what it was doing. offsets are taken as they are on disk, which is
+ * near enough with edits pending. */
+#define RA_STEP			(1ULL << 20)
+#define RA_ALIGN		(128ULL << 10)	/* targets are rounded out to this */
+#define RA_SCREENS		4
+#define RA_HORIZON		0.5		/* seconds of movement to stay ahead by */
+
+unsigned long long	ra_max = 64ULL << 20;		/* 0 = no readahead */
+static pthread_t	ra_thread;
+static pthread_mutex_t	ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	ra_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	ra_idle = PTHREAD_COND_INITIALIZER;
+static int		ra_running = 0;
+static int		ra_stop = 0;
+static int		ra_busy = 0;
+static unsigned int	ra_gen = 0;
+static int		ra_dir = 0;			/* 1 forward, -1 back, 0 still */
+static unsigned long long ra_pos = 0;			/* where the worker has got to */
+static unsigned long long ra_target = 0;		/* where it should get to */
+static unsigned long long ra_last = 0;			/* view offset last time */
+static double		ra_last_time = 0;
+static double		ra_speed = 0;			/* bytes/second, smoothed */
+
+/* how far ahead to read at the current speed */
+static unsigned long long RaAhead(unsigned long long screen)
+{
+	unsigned long long ahead = screen * RA_SCREENS;
+
+	if (ahead < (unsigned long long)(ra_speed * RA_HORIZON)) ahead = (unsigned long long)(ra_speed * RA_HORIZON);
+	if (ahead > ra_max) ahead = ra_max;
+	return ahead;
+}
+
+static void *RaWorker(void *arg)
+{
+	unsigned long long ofs,len;
+	unsigned int gen;
+	int fd;
+
+	(void)arg;
+	pthread_mutex_lock(&ra_lock);
+	while (!ra_stop) {
+		if (ra_dir == 0 || file_fd < 0 || (ra_dir > 0 ? ra_pos >= ra_target : ra_pos <= ra_target)) {
+			pthread_cond_wait(&ra_wake,&ra_lock);
+			continue;
+		}
+
+		/* take the next step toward the target */
+		if (ra_dir > 0) {
+			ofs = ra_pos;
+			len = (ra_target - ra_pos) > RA_STEP ? RA_STEP : ra_target - ra_pos;
+			ra_pos += len;
+		}
+		else {
+			len = (ra_pos - ra_target) > RA_STEP ? RA_STEP : ra_pos - ra_target;
+			ra_pos -= len;
+			ofs = ra_pos;
+		}
+		gen = ra_gen;
+		fd = file_fd;
+		ra_busy = 1;
+		pthread_mutex_unlock(&ra_lock);
+
+		if (readahead(fd,(off_t)ofs,(size_t)len) < 0)
+			posix_fadvise(fd,(off_t)ofs,(off_t)len,POSIX_FADV_WILLNEED);
+
+		pthread_mutex_lock(&ra_lock);
+		ra_busy = 0;
+		if (gen != ra_gen) pthread_cond_broadcast(&ra_idle);
+	}
+	pthread_mutex_unlock(&ra_lock);
+	return NULL;
+}
+
+/* drop whatever readahead is going on and wait until the worker is not
+ * touching file_fd, so it can be closed */
+void RaCancel()
+{
+	if (!ra_running) return;
+	pthread_mutex_lock(&ra_lock);
+	ra_gen++;
+	ra_dir = 0;
+	ra_speed = 0;
+	while (ra_busy) pthread_cond_wait(&ra_idle,&ra_lock);
+	pthread_mutex_unlock(&ra_lock);
+}
+
+void RaShutdown()
+{
+	if (!ra_running) return;
+	pthread_mutex_lock(&ra_lock);
+	ra_stop = 1;
+	pthread_cond_signal(&ra_wake);
+	pthread_mutex_unlock(&ra_lock);
+	pthread_join(ra_thread,NULL);
+	ra_running = 0;
+}
+
+/* the view now starts at "ofs" and shows "screen" bytes */
+void RaNote(unsigned long long ofs,unsigned long long screen)
+{
+	unsigned long long ahead,d;
+	struct timespec ts;
+	double now,dt;
+	int dir;
+
+	/* readahead would fill the page cache that -direct keeps out of */
+	if (ra_max == 0 || fa_direct || file_fd < 0 || fa_size == 0) return;
+	if (!ra_running) {
+		if (pthread_create(&ra_thread,NULL,RaWorker,NULL) != 0) {
+			ra_max = 0;
+			return;
+		}
+		ra_running = 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	now = (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+	dt = now - ra_last_time;
+	ra_last_time = now;
+
+	if (ofs == ra_last) return;
+	dir = ofs > ra_last ? 1 : -1;
+	d = ofs > ra_last ? ofs - ra_last : ra_last - ofs;
+	ra_last = ofs;
+
+	pthread_mutex_lock(&ra_lock);
+
+	/* anything further than what we would have read ahead is a jump */
+	if (dir != ra_dir || d > (RaAhead(screen) + screen)) {
+		ra_gen++;
+		ra_dir = dir;
+		ra_speed = 0;
+		ra_pos = dir > 0 ? ofs + screen : ofs;
+	}
+	else if (dt > 0) {
+		ra_speed = (ra_speed * 0.75) + (((double)d / dt) * 0.25);
+	}
+
+	ahead = RaAhead(screen);
+
+	/* don't bother with what has already scrolled by */
+	if (dir > 0) {
+		if (ra_pos < ofs + screen) ra_pos = ofs + screen;
+		ra_target = (ofs + screen + ahead + RA_ALIGN - 1) & ~(RA_ALIGN - 1);
+		if (ra_target > fa_size) ra_target = fa_size;
+	}
+	else {
+		if (ra_pos > ofs) ra_pos = ofs;
+		ra_target = ofs > ahead ? (ofs - ahead) & ~(RA_ALIGN - 1) : 0;
+	}
+
+	pthread_cond_signal(&ra_wake);
+	pthread_mutex_unlock(&ra_lock);
+}
+
+/* minimap.
+ * the file on disk is split into MAP_BUCKETS buckets and a background
+ * thread builds a byte histogram for each. the first round reads one
+ * MAP_SAMPLE from every bucket so the whole map fills in quickly; each
+ * round after that samples every bucket again at a spot in between the
+ * earlier ones until MAP_ROUNDS, or reads buckets small enough to cover
+ * straight through. the view merges the buckets of each screen row into
+ * an entropy and a byte class. FaClose() cancels it through map_gen. */
+#define MAP_BUCKETS		512
+#define MAP_SAMPLE		(64 << 10)
+#define MAP_ROUNDS		64
+
+static unsigned long long	map_hist[MAP_BUCKETS][256];
+static unsigned long long	map_size = 0;		/* file size the buckets are cut from */
+static pthread_t		map_thread;
+static pthread_mutex_t		map_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		map_idle = PTHREAD_COND_INITIALIZER;
+static volatile unsigned int	map_gen = 0;
+static int			map_running = 0;	/* thread exists for this file */
+static int			map_busy = 0;		/* thread is still reading */
+static int			map_changed = 0;	/* new data since the last draw */
+
+/* histogram n bytes into h, four tables so that runs of the same byte do
+ * not stall on one counter. disk images are mostly long runs of zeros or
+ * fill bytes, so every 64 bytes are first checked with SSE2 for being one
+ * byte repeated, which is counted in one go */
+static void MapHistogram(const unsigned char *p,size_t n,unsigned long long *h)
+{
+	unsigned int t[4][256];
+	size_t i,j;
+	int k;
+#ifdef SHEX_SSE
+	__m128i c,e;
+#endif
+
+	memset(t,0,sizeof(t));
+	for (i=0;(i + 64) <= n;i += 64) {
+#ifdef SHEX_SSE
+		c = _mm_set1_epi8((char)p[i]);
+		e = _mm_and_si128(
+			_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p+i)),c),
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p+i+16)),c)),
+			_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p+i+32)),c),
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p+i+48)),c)));
+		if (_mm_movemask_epi8(e) == 0xFFFF) {
+			t[0][p[i]] += 64;
+			continue;
+		}
+#endif
+		for (j=i;j < i + 64;j += 4) {
+			t[0][p[j]]++;
+			t[1][p[j+1]]++;
+			t[2][p[j+2]]++;
+			t[3][p[j+3]]++;
+		}
+	}
+	for (;i < n;i++) t[0][p[i]]++;
+	for (k=0;k < 256;k++) h[k] += (unsigned long long)t[0][k] + t[1][k] + t[2][k] + t[3][k];
+}
+
+static unsigned long long MapBucketOfs(int b)
+{
+	return (map_size * (unsigned long long)b) / MAP_BUCKETS;
+}
+
+static void *MapWorker(void *arg)
+{
+	unsigned int gen = (unsigned int)(unsigned long)arg;
+	unsigned long long h[256],bs,be,ofs,frac;
+	unsigned char *buf;
+	int round,b,k,any;
+	ssize_t rd;
+
+	buf = (unsigned char*)malloc(MAP_SAMPLE);
+	for (round=0;buf != NULL && round < MAP_ROUNDS && gen == map_gen;round++) {
+		/* where in each bucket to look this round: 0, 1/2, 1/4, 3/4, 1/8... */
+		for (frac=0,k=0;k < 6;k++) frac |= ((unsigned long long)((round >> k) & 1)) << (5 - k);
+
+		for (any=0,b=0;b < MAP_BUCKETS && gen == map_gen;b++) {
+			bs = MapBucketOfs(b);
+			be = MapBucketOfs(b+1);
+			if (be <= bs) continue;
+
+			if ((be - bs) <= (unsigned long long)MAP_SAMPLE * MAP_ROUNDS) {
+				/* small enough to read all of it in order */
+				ofs = bs + ((unsigned long long)round * MAP_SAMPLE);
+				if (ofs >= be) continue;
+			}
+			else {
+				ofs = bs + ((((be - bs) - MAP_SAMPLE) * frac) / MAP_ROUNDS);
+				ofs &= ~4095ULL;
+				if (ofs < bs) ofs = bs;
+			}
+
+			rd = FaDiskRead(buf,(be - ofs) < MAP_SAMPLE ? (size_t)(be - ofs) : MAP_SAMPLE,ofs);
+			if (rd <= 0) continue;
+			memset(h,0,sizeof(h));
+			MapHistogram(buf,(size_t)rd,h);
+
+			pthread_mutex_lock(&map_lock);
+			if (gen == map_gen) {
+				for (k=0;k < 256;k++) map_hist[b][k] += h[k];
+				map_changed = 1;
+			}
+			pthread_mutex_unlock(&map_lock);
+			any = 1;
+		}
+		if (!any) break;
+	}
+	free(buf);
+
+	pthread_mutex_lock(&map_lock);
+	map_busy = 0;
+	pthread_cond_broadcast(&map_idle);
+	pthread_mutex_unlock(&map_lock);
+	return NULL;
+}
+
+/* stop the map thread and forget the map */
+void MapCancel()
+{
+	if (!map_running) return;
+	pthread_mutex_lock(&map_lock);
+	map_gen++;
+	while (map_busy) pthread_cond_wait(&map_idle,&map_lock);
+	pthread_mutex_unlock(&map_lock);
+	pthread_join(map_thread,NULL);
+	map_running = 0;
+	map_changed = 1;
+}
+
+/* start mapping the open file if it isn't already */
+void MapStart()
+{
+	if (map_running || file_fd < 0 || fa_size == 0) return;
+	memset(map_hist,0,sizeof(map_hist));
+	map_size = fa_size;
+	map_busy = 1;
+	if (pthread_create(&map_thread,NULL,MapWorker,(void*)(unsigned long)map_gen) != 0) {
+		map_busy = 0;
+		return;
+	}
+	map_running = 1;
+}
+
+/* still filling in? */
+int MapBusy()
+{
+	return map_running && map_busy;
+}
+
+/* the buckets shown on map row y of "rows" */
+static void MapRowBuckets(int y,int rows,int *b0,int *b1)
+{
+	*b0 = (y * MAP_BUCKETS) / rows;
+	*b1 = ((y + 1) * MAP_BUCKETS) / rows;
+	if (*b1 <= *b0) *b1 = *b0 + 1;
+}
+
+/* map row y of "rows": a character for the byte class and a level 0-3
+ * for the entropy, or ' ' and -1 when nothing is known yet */
+char MapRowClass(int y,int rows,int *level)
+{
+	unsigned long long h[256],total,zero,text;
+	double e,p;
+	int b,b0,b1,k;
+
+	MapRowBuckets(y,rows,&b0,&b1);
+	memset(h,0,sizeof(h));
+	pthread_mutex_lock(&map_lock);
+	for (b=b0;b < b1 && b < MAP_BUCKETS;b++)
+		for (k=0;k < 256;k++) h[k] += map_hist[b][k];
+	pthread_mutex_unlock(&map_lock);
+
+	for (total=0,text=0,k=0;k < 256;k++) {
+		total += h[k];
+		if ((k >= 32 && k < 127) || k == 9 || k == 10 || k == 13) text += h[k];
+	}
+	zero = h[0];
+	if (total == 0) {
+		*level = -1;
+		return ' ';
+	}
+
+	for (e=0,k=0;k < 256;k++) {
+		if (h[k] == 0) continue;
+		p = (double)h[k] / (double)total;
+		e -= p * log2(p);
+	}
+
+	*level = e < 2 ? 0 : (e < 5 ? 1 : (e < 7 ? 2 : 3));
+	if (zero * 10 >= total * 9)	return '0';
+	if (text * 10 >= total * 9)	return 'a';
+	if (e >= 7)			return '#';
+	return ':';
+}
+
+/* the map row a file offset falls in */
+int MapRowOf(unsigned long long ofs,int rows)
+{
+	int y;
+
+	if (map_size == 0) return 0;
+	if (ofs >= map_size) return rows - 1;
+	y = (int)((ofs * (unsigned long long)rows) / map_size);
+	return y < rows ? y : rows - 1;
+}
+
+/* where map row y starts in the file */
+unsigned long long MapRowOfs(int y,int rows)
+{
+	return ((map_size * (unsigned long long)y) + rows - 1) / rows;
+}
+
+/* file abstraction */
+void FaClose()
+{
+	RaCancel();
+	MapCancel();
+	FaMapRelease();
+	if (file_fd >= 0) close(file_fd);
+	file_fd = -1;
+	FaDioRelease();
+	FaExtReset();
+	fa_mapped = 0;
+	fa_advice = FA_ADV_NORMAL;
+	fa_size = 0;
+	EdReset();
+	file_cursor = 0;
+	view_offset = 0;
+	FaCacheFlush();
+}
+
+int FaOpen(char *path,int mode)
+{
+	FaClose();
+
+	file_mode = mode;
+	file_fd = open(path,mode | O_LARGEFILE | (fa_direct ? O_DIRECT : 0));
+	if (file_fd < 0) return 0;
+	file_size = fa_size = fa_direct ? FaDioSetup(file_fd) : (unsigned long long)StatLseek(file_fd,0,SEEK_END);
+	if (file_size == ((unsigned long long)(-1))) {
+		fprintf(stderr,"FaOpen(): descriptor can't seek!\n");
+		FaClose();
+		return 0;
+	}
+
+	/* only read-only files are viewed through a mapping */
+	fa_mapped = fa_use_mmap && !fa_direct && (mode & O_ACCMODE) == O_RDONLY;
+	file_cursor = 0;
+	return 1;
+}
+
+unsigned long long FaSeek(unsigned long long ofs)
+{
+	if (file_fd < 0) return 0;
+	return StatLseek(file_fd,ofs,SEEK_SET);
+}
+
+unsigned long long FaTell()
+{
+	if (file_fd < 0) return 0;
+	return StatLseek(file_fd,0,SEEK_CUR);
+}
+
+/* parallel jobs.
+ * long operations over the file are split into chunks; worker threads
+ * claim the next chunk with an atomic add until none are left. small
+ * ranges run on the calling thread alone. */
+#define JOB_MT_MIN		(64ULL << 20)
+#define JOB_MAX_THREADS		16
+
+int			job_threads = 0;		/* 0 = one per CPU */
+
+/* how many threads to use for a job covering "len" bytes */
+int JobThreads(unsigned long long len)
+{
+	long n;
+
+	if (len < JOB_MT_MIN) return 1;
+	n = job_threads > 0 ? job_threads : sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1) n = 1;
+	if (n > JOB_MAX_THREADS) n = JOB_MAX_THREADS;
+	return (int)n;
+}
+
+/* run fn(ctx) on "n" threads, the caller being one of them */
+void JobRun(int n,void *(*fn)(void*),void *ctx)
+{
+	pthread_t t[JOB_MAX_THREADS];
+	int i,started;
+
+	for (started=0,i=1;i < n;i++)
+		if (pthread_create(&t[started],NULL,fn,ctx) == 0) started++;
+
+	fn(ctx);
+	for (i=0;i < started;i++)
+		pthread_join(t[i],NULL);
+}
+
+double JobNow()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+}
+
+/* search.
+ * SrchMem()/SrchMemLast() find a pattern in memory: a single byte is a
+ * memchr(), longer patterns test the first and last byte 16 positions at
+ * a time with SSE2 and only memcmp() the candidates. SrchFile() scans the
+ * file in chunks that overlap by the pattern length, in parallel for
+ * large ranges, stopping early once a hit is found. */
+#define SRCH_MAX		256
+#define SRCH_CHUNK		(8ULL << 20)
+#define SRCH_NONE		(~0ULL)
+
+unsigned char		srch_pat[SRCH_MAX];
+int			srch_len = 0;
+
+/* first match of pat[0..m) in hay[0..n) or -1 */
+long long SrchMem(const unsigned char *hay,size_t n,const unsigned char *pat,int m)
+{
+	const unsigned char *p,*e;
+	size_t i = 0;
+
+	if (m < 1 || n < (size_t)m) return -1;
+	if (m == 1) {
+		p = (const unsigned char*)memchr(hay,pat[0],n);
+		return p ? (long long)(p - hay) : -1;
+	}
+
+#ifdef SHEX_SSE
+	{
+		const __m128i f = _mm_set1_epi8((char)pat[0]),l = _mm_set1_epi8((char)pat[m-1]);
+		unsigned int mask;
+		int b;
+
+		for (;(i + 16 + m - 1) <= n;i += 16) {
+			mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(
+				_mm_cmpeq_epi8(f,_mm_loadu_si128((const __m128i*)(hay+i))),
+				_mm_cmpeq_epi8(l,_mm_loadu_si128((const __m128i*)(hay+i+m-1)))));
+			while (mask) {
+				b = __builtin_ctz(mask);
+				if (!memcmp(hay+i+b+1,pat+1,m-2)) return (long long)(i + b);
+				mask &= mask - 1;
+			}
+		}
+	}
+#endif
+
+	/* anchor on the first byte for whatever is left */
+	for (e=hay+n-m+1,p=hay+i;p < e;p++) {
+		if ((p=(const unsigned char*)memchr(p,pat[0],e-p)) == NULL) break;
+		if (!memcmp(p+1,pat+1,m-1)) return (long long)(p - hay);
+	}
+
+	return -1;
+}
+
+/* last match of pat[0..m) in hay[0..n) or -1 */
+long long SrchMemLast(const unsigned char *hay,size_t n,const unsigned char *pat,int m)
+{
+	const unsigned char *p;
+	size_t i;
+
+	if (m < 1 || n < (size_t)m) return -1;
+	if (m == 1) {
+		p = (const unsigned char*)memrchr(hay,pat[0],n);
+		return p ? (long long)(p - hay) : -1;
+	}
+
+	/* candidate starts are [0,i) */
+	i = n - m + 1;
+
+#ifdef SHEX_SSE
+	{
+		const __m128i f = _mm_set1_epi8((char)pat[0]),l = _mm_set1_epi8((char)pat[m-1]);
+		unsigned int mask;
+		int b;
+
+		for (;i >= 16;i -= 16) {
+			mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(
+				_mm_cmpeq_epi8(f,_mm_loadu_si128((const __m128i*)(hay+i-16))),
+				_mm_cmpeq_epi8(l,_mm_loadu_si128((const __m128i*)(hay+i-16+m-1)))));
+			while (mask) {
+				b = 31 - __builtin_clz(mask);
+				if (!memcmp(hay+i-16+b+1,pat+1,m-2)) return (long long)(i - 16 + b);
+				mask &= ~(1U << b);
+			}
+		}
+	}
+#endif
+
+	while (i > 0) {
+		if ((p=(const unsigned char*)memrchr(hay,pat[0],i)) == NULL) break;
+		i = (size_t)(p - hay);
+		if (!memcmp(p+1,pat+1,m-1)) return (long long)i;
+	}
+
+	return -1;
+}
+
+/* a run of zeros, which can match inside a hole */
+static int SrchAllZero(const unsigned char *pat,int m)
+{
+	while (m > 0 && pat[m-1] == 0) m--;
+	return m == 0;
+}
+
+typedef struct SrchJob {
+	const unsigned char	*pat;
+	int			m;
+	int			back;
+	int			holes;		/* can skip chunks that are all hole */
+	unsigned long long	start,end;	/* match must lie within [start,end) */
+	unsigned long long	nchunks;
+	unsigned long long	next;		/* next chunk to claim */
+	unsigned long long	hit;		/* best match so far */
+	pthread_mutex_t		lock;
+} SrchJob;
+
+static void *SrchWorker(void *arg)
+{
+	SrchJob *j = (SrchJob*)arg;
+	unsigned long long k,cs,ce,hit;
+	unsigned char *buf;
+	long long r;
+	size_t got;
+
+	if ((buf=(unsigned char*)malloc(SRCH_CHUNK + j->m)) == NULL) return NULL;
+
+	while ((k=__sync_fetch_and_add(&j->next,1)) < j->nchunks) {
+		/* chunk k holds the match starts [cs,ce), counted from the far end when going back */
+		if (!j->back) {
+			cs = j->start + (k * SRCH_CHUNK);
+			ce = cs + SRCH_CHUNK;
+			if (ce > j->end) ce = j->end;
+		}
+		else {
+			ce = j->end - (k * SRCH_CHUNK);
+			cs = (ce - j->start) > SRCH_CHUNK ? ce - SRCH_CHUNK : j->start;
+		}
+
+		/* a closer hit already makes this chunk pointless */
+		hit = j->hit;
+		if (hit != SRCH_NONE && (j->back ? (ce <= hit) : (cs >= hit))) continue;
+		if (j->holes && FaIsHole(cs,(ce - cs) + j->m - 1)) continue;
+
+		got = FaBulkRead(cs,(size_t)(ce - cs) + j->m - 1,buf);
+		if (j->back)	r = SrchMemLast(buf,got,j->pat,j->m);
+		else		r = SrchMem(buf,got,j->pat,j->m);
+		if (r < 0 || (cs + r) >= ce) continue;
+
+		pthread_mutex_lock(&j->lock);
+		if (j->hit == SRCH_NONE || (j->back ? (cs + r) > j->hit : (cs + r) < j->hit))
+			j->hit = cs + r;
+		pthread_mutex_unlock(&j->lock);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/* find pat[0..m) starting within [start,end) of the file, the first match
+ * going forward or the last going back. returns SRCH_NONE if not found. */
+unsigned long long SrchFile(const unsigned char *pat,int m,unsigned long long start,unsigned long long end,int back)
+{
+	SrchJob j;
+
+	if (end > file_size) end = file_size;
+	if (m < 1 || end < (unsigned long long)m) return SRCH_NONE;
+	end = end - m + 1;
+	if (start >= end) return SRCH_NONE;
+
+	memset(&j,0,sizeof(j));
+	j.pat = pat;
+	j.m = m;
+	j.back = back;
+	j.holes = !SrchAllZero(pat,m);
+	j.start = start;
+	j.end = end;
+	j.nchunks = ((end - start) + SRCH_CHUNK - 1) / SRCH_CHUNK;
+	j.hit = SRCH_NONE;
+	pthread_mutex_init(&j.lock,NULL);
+	JobRun(JobThreads(end - start),SrchWorker,&j);
+	pthread_mutex_destroy(&j.lock);
+	return j.hit;
+}
+
+/* turn command arguments into bytes: unquoted arguments are hex ("4D5A" or
+ * "4D 5A"), quoted ones are taken as text. returns the length or -1. */
+int SrchPattern(char **args,const char *argq,unsigned char *pat,int max)
+{
+	const char *a;
+	int i,m,hi;
+
+	m = 0;
+	for (i=0;args[i][0] || argq[i];i++) {
+		a = args[i];
+		if (argq[i]) {
+			while (*a && m < max) pat[m++] = (unsigned char)(*a++);
+			if (*a) return -1;
+			continue;
+		}
+
+		for (hi=-1;*a;a++) {
+			if (!isxdigit((unsigned char)(*a))) return -1;
+			if (hi < 0) {
+				hi = isdigit((unsigned char)(*a)) ? *a - '0' : (toupper((unsigned char)(*a)) - 'A' + 10);
+				continue;
+			}
+			if (m >= max) return -1;
+			pat[m++] = (unsigned char)((hi << 4) | (isdigit((unsigned char)(*a)) ? *a - '0' : (toupper((unsigned char)(*a)) - 'A' + 10)));
+			hi = -1;
+		}
+		if (hi >= 0) return -1;
+	}
+
+	return m;
+}
+
+/* signature scanning.
+ * a signature file has one "<name> <pattern>" per line, the pattern being
+ * hex bytes where '?' matches any nibble ("4D 5A ?? ?0") or quoted text.
+ * the longest run of fixed bytes in each pattern (up to SCAN_ANCHOR) goes
+ * into an Aho-Corasick automaton, so the file is read once however many
+ * patterns there are, and each anchor hit is verified against the whole
+ * masked pattern. */
+#define SCAN_MAX		256		/* longest pattern */
+#define SCAN_ANCHOR		8		/* longest anchor */
+#define SCAN_CHUNK		(8ULL << 20)
+#define SCAN_HITS_MAX		(1 << 20)
+#define SCAN_OUT		0x80000000U	/* transition into a state with output */
+
+typedef struct ScanPat {
+	char			name[32];
+	unsigned char		val[SCAN_MAX];
+	unsigned char		mask[SCAN_MAX];
+	int			len;
+	int			aofs,alen;	/* anchor within the pattern */
+	int			next;		/* next pattern with the same anchor */
+} ScanPat;
+
+typedef struct ScanHit {
+	unsigned long long	ofs;
+	int			pat;
+} ScanHit;
+
+ScanPat			*scan_pats = NULL;
+int			scan_npats = 0;
+int			scan_maxlen = 0;
+unsigned int		(*scan_go)[256] = NULL;	/* automaton transitions */
+int			*scan_out = NULL;		/* first pattern ending in a state or -1 */
+unsigned int		*scan_dict = NULL;		/* next state on the fail chain with output */
+int			scan_nstates = 0;
+
+ScanHit			*scan_hits = NULL;
+int			scan_nhits = 0;
+int			scan_hit_pos = -1;
+
+void ScanFree()
+{
+	free(scan_pats); scan_pats = NULL;
+	free(scan_go); scan_go = NULL;
+	free(scan_out); scan_out = NULL;
+	free(scan_dict); scan_dict = NULL;
+	free(scan_hits); scan_hits = NULL;
+	scan_npats = scan_nstates = scan_nhits = scan_maxlen = 0;
+	scan_hit_pos = -1;
+}
+
+static int ScanNibble(char c)
+{
+	if (c == '?') return -1;
+	if (isdigit((unsigned char)c)) return c - '0';
+	return toupper((unsigned char)c) - 'A' + 10;
+}
+
+/* parse one signature line. returns 1 if a pattern was read, 0 if the line
+ * is blank or a comment, -1 if it is malformed */
+int ScanParseLine(char *line,ScanPat *p)
+{
+	char *s = line,*name;
+	int hi,lo,i,run,best;
+
+	while (*s == ' ' || *s == '\t') s++;
+	if (*s == 0 || *s == '#' || *s == '\n' || *s == '\r') return 0;
+
+	name = s;
+	while (*s && *s != ' ' && *s != '\t' && *s != '\n' && *s != '\r') s++;
+	if (*s) *s++ = 0;
+	snprintf(p->name,sizeof(p->name),"%s",name);
+
+	p->len = 0;
+	while (*s) {
+		if (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r') {
+			s++;
+		}
+		else if (*s == '\"') {
+			for (s++;*s && *s != '\"';s++) {
+				if (p->len >= SCAN_MAX) return -1;
+				p->val[p->len] = (unsigned char)(*s);
+				p->mask[p->len++] = 0xFF;
+			}
+			if (*s != '\"') return -1;
+			s++;
+		}
+		else {
+			if (!(isxdigit((unsigned char)s[0]) || s[0] == '?')) return -1;
+			if (!(isxdigit((unsigned char)s[1]) || s[1] == '?')) return -1;
+			if (p->len >= SCAN_MAX) return -1;
+			hi = ScanNibble(s[0]);
+			lo = ScanNibble(s[1]);
+			p->val[p->len] = (unsigned char)(((hi < 0 ? 0 : hi) << 4) | (lo < 0 ? 0 : lo));
+			p->mask[p->len++] = (unsigned char)((hi < 0 ? 0 : 0xF0) | (lo < 0 ? 0 : 0x0F));
+			s += 2;
+		}
+	}
+	if (p->len == 0) return -1;
+
+	/* anchor on the longest run of fixed bytes */
+	p->aofs = p->alen = 0;
+	for (i=0,run=0,best=0;i <= p->len;i++) {
+		if (i < p->len && p->mask[i] == 0xFF) {
+			run++;
+			continue;
+		}
+		if (run > best) {
+			best = run;
+			p->aofs = i - run;
+		}
+		run = 0;
+	}
+	if (best == 0) return -1;
+	p->alen = best > SCAN_ANCHOR ? SCAN_ANCHOR : best;
+	return 1;
+}
+
+/* load and compile a signature file. on failure returns 0 and puts the
+ * offending line number (or 0) in *errline */
+int ScanLoad(const char *path,int *errline)
+{
+	unsigned int *queue,s,t,f;
+	int i,j,r,line,alloc,st;
+	char buf[1024];
+	ScanPat *np;
+	FILE *fp;
+
+	*errline = 0;
+	ScanFree();
+	if ((fp=fopen(path,"r")) == NULL) return 0;
+
+	alloc = 0;
+	line = 0;
+	while (fgets(buf,sizeof(buf),fp) != NULL) {
+		line++;
+		if (scan_npats >= alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			if ((np=(ScanPat*)realloc(scan_pats,sizeof(ScanPat) * alloc)) == NULL) break;
+			scan_pats = np;
+		}
+		if ((r=ScanParseLine(buf,&scan_pats[scan_npats])) < 0) {
+			*errline = line;
+			break;
+		}
+		if (r > 0) {
+			if (scan_pats[scan_npats].len > scan_maxlen) scan_maxlen = scan_pats[scan_npats].len;
+			scan_npats++;
+		}
+	}
+	fclose(fp);
+	if (*errline || scan_npats == 0) {
+		ScanFree();
+		return 0;
+	}
+
+	/* trie of the anchors, state 0 being the root */
+	alloc = 1;
+	for (i=0;i < scan_npats;i++) alloc += scan_pats[i].alen;
+	scan_go = (unsigned int(*)[256])calloc(alloc,sizeof(*scan_go));
+	scan_out = (int*)malloc(sizeof(int) * alloc);
+	scan_dict = (unsigned int*)calloc(alloc,sizeof(unsigned int));
+	queue = (unsigned int*)malloc(sizeof(unsigned int) * alloc);
+	if (scan_go == NULL || scan_out == NULL || scan_dict == NULL || queue == NULL) {
+		free(queue);
+		ScanFree();
+		return 0;
+	}
+
+	for (i=0;i < alloc;i++) scan_out[i] = -1;
+	scan_nstates = 1;
+	for (i=0;i < scan_npats;i++) {
+		np = &scan_pats[i];
+		for (s=0,j=0;j < np->alen;j++) {
+			if (scan_go[s][np->val[np->aofs+j]] == 0)
+				scan_go[s][np->val[np->aofs+j]] = (unsigned int)(scan_nstates++);
+			s = scan_go[s][np->val[np->aofs+j]];
+		}
+		np->next = scan_out[s];
+		scan_out[s] = i;
+	}
+
+	/* breadth first, fill in the failure transitions so every state has
+	 * all 256. the fail state of each state is parked in scan_dict until
+	 * its children have been visited. */
+	r = st = 0;
+	for (i=0;i < 256;i++) {
+		if ((t=scan_go[0][i]) != 0) {
+			scan_dict[t] = 0;
+			queue[r++] = t;
+		}
+	}
+	while (st < r) {
+		s = queue[st++];
+		f = scan_dict[s];
+		for (i=0;i < 256;i++) {
+			if ((t=scan_go[s][i]) != 0) {
+				scan_dict[t] = scan_go[f][i];
+				queue[r++] = t;
+			}
+			else {
+				scan_go[s][i] = scan_go[f][i];
+			}
+		}
+	}
+
+	/* now turn the fail states into dictionary links, parents first */
+	for (i=0;i < r;i++) {
+		s = queue[i];
+		f = scan_dict[s];
+		scan_dict[s] = (f == 0 || scan_out[f] >= 0) ? f : scan_dict[f];
+	}
+
+	/* flag the transitions that need a look at the outputs */
+	for (s=0;s < (unsigned int)scan_nstates;s++) {
+		for (i=0;i < 256;i++) {
+			t = scan_go[s][i];
+			if (scan_out[t] >= 0 || scan_dict[t] != 0) scan_go[s][i] |= SCAN_OUT;
+		}
+	}
+
+	free(queue);
+	return 1;
+}
+
+typedef struct ScanJob {
+	unsigned long long	start,end;
+	unsigned long long	nchunks;
+	unsigned long long	next;
+	int			full;
+	int			holes;		/* no pattern can match in a hole */
+	pthread_mutex_t		lock;
+} ScanJob;
+
+static int ScanHitCmp(const void *a,const void *b)
+{
+	const ScanHit *x = (const ScanHit*)a,*y = (const ScanHit*)b;
+
+	if (x->ofs != y->ofs) return x->ofs < y->ofs ? -1 : 1;
+	return x->pat - y->pat;
+}
+
+/* check every pattern whose anchor ends at buf[i] */
+static void ScanVerify(const unsigned char *buf,size_t got,size_t i,unsigned int s,unsigned long long cs,ScanHit **hits,int *n,int *alloc)
+{
+	const ScanPat *p;
+	long long at;
+	ScanHit *nh;
+	int k,j;
+
+	for (;s != 0;s = scan_dict[s]) {
+		for (k=scan_out[s];k >= 0;k=p->next) {
+			p = &scan_pats[k];
+			at = (long long)i + 1 - p->alen - p->aofs;
+
+			/* a match starting before this chunk is the previous chunk's */
+			if (at < 0 || (size_t)at + p->len > got) continue;
+			for (j=0;j < p->len && (buf[at+j] & p->mask[j]) == p->val[j];j++);
+			if (j < p->len) continue;
+
+			if (*n >= *alloc) {
+				*alloc = *alloc ? *alloc * 2 : 256;
+				if ((nh=(ScanHit*)realloc(*hits,sizeof(ScanHit) * (*alloc))) == NULL) return;
+				*hits = nh;
+			}
+			(*hits)[*n].ofs = cs + at;
+			(*hits)[(*n)++].pat = k;
+		}
+	}
+}
+
+static void *ScanWorker(void *arg)
+{
+	ScanJob *j = (ScanJob*)arg;
+	unsigned long long k,cs,ce;
+	ScanHit *hits = NULL,*nh;
+	int nhits,ahits = 0;
+	unsigned char *buf;
+	unsigned int s;
+	size_t got,lim,i;
+
+	if ((buf=(unsigned char*)malloc(SCAN_CHUNK + scan_maxlen)) == NULL) return NULL;
+
+	while (!j->full && (k=__sync_fetch_and_add(&j->next,1)) < j->nchunks) {
+		cs = j->start + (k * SCAN_CHUNK);
+		ce = cs + SCAN_CHUNK;
+		if (ce > j->end) ce = j->end;
+		if (j->holes && FaIsHole(cs,(ce - cs) + scan_maxlen - 1)) continue;
+
+		/* matches start in [cs,ce) but may run past it */
+		got = FaBulkRead(cs,(size_t)(ce - cs) + scan_maxlen - 1,buf);
+		lim = got < (size_t)(ce - cs) + scan_maxlen - 1 ? got : (size_t)(ce - cs) + scan_maxlen - 1;
+
+		nhits = 0;
+		for (s=0,i=0;i < lim;i++) {
+			s = scan_go[s & ~SCAN_OUT][buf[i]];
+			if (s & SCAN_OUT)
+				ScanVerify(buf,got,i,s & ~SCAN_OUT,cs,&hits,&nhits,&ahits);
+		}
+
+		/* drop the ones that start in the overlap */
+		for (i=0;i < (size_t)nhits;) {
+			if (hits[i].ofs >= ce) hits[i] = hits[--nhits];
+			else i++;
+		}
+
+		pthread_mutex_lock(&j->lock);
+		if (nhits > SCAN_HITS_MAX - scan_nhits) {
+			nhits = SCAN_HITS_MAX - scan_nhits;
+			j->full = 1;
+		}
+		if (nhits > 0 && (nh=(ScanHit*)realloc(scan_hits,sizeof(ScanHit) * (scan_nhits + nhits))) != NULL) {
+			scan_hits = nh;
+			memcpy(scan_hits+scan_nhits,hits,sizeof(ScanHit) * nhits);
+			scan_nhits += nhits;
+		}
+		pthread_mutex_unlock(&j->lock);
+	}
+
+	free(hits);
+	free(buf);
+	return NULL;
+}
+
+/* run the loaded signatures over the whole file. returns 1 if the hit
+ * list had to be cut short */
+int ScanFile()
+{
+	ScanJob j;
+	int i,k;
+
+	free(scan_hits);
+	scan_hits = NULL;
+	scan_nhits = 0;
+	scan_hit_pos = -1;
+	if (scan_npats == 0 || file_size == 0) return 0;
+
+	memset(&j,0,sizeof(j));
+	j.holes = 1;
+	for (i=0;i < scan_npats && j.holes;i++) {
+		for (k=0;k < scan_pats[i].len && !(scan_pats[i].val[k] & scan_pats[i].mask[k]);) k++;
+		if (k == scan_pats[i].len) j.holes = 0;
+	}
+	j.start = 0;
+	j.end = file_size;
+	j.nchunks = (file_size + SCAN_CHUNK - 1) / SCAN_CHUNK;
+	pthread_mutex_init(&j.lock,NULL);
+	JobRun(JobThreads(file_size),ScanWorker,&j);
+	pthread_mutex_destroy(&j.lock);
+
+	qsort(scan_hits,scan_nhits,sizeof(ScanHit),ScanHitCmp);
+	return j.full;
+}
+
+/* replace all.
+ * same length, in place, straight to the file. matches are taken left to
+ * right without overlapping, so a chunk's matches depend on where the last
+ * match of the chunk before it ended. pass one counts the matches of every
+ * chunk in parallel as if it began at its own start and notes where its
+ * last match ends; a serial pass then chains the chunks together,
+ * recounting the rare chunk whose real starting point differs; pass two
+ * patches the chunks with matches in parallel, writing back only the
+ * spans that changed. the bytes past a chunk's end may already have been
+ * patched by the next chunk, so pass two stops after the matches pass one
+ * counted, which all lie inside [its entry,its exit); chunks never write
+ * over each other. */
+#define REPL_CHUNK		(8ULL << 20)
+#define REPL_GAP		4096		/* merge dirty spans closer than this */
+
+typedef struct ReplChunk {
+	unsigned long long	entry;		/* first offset a match may start at */
+	unsigned long long	exit;		/* end of the last match, at least the chunk end */
+	unsigned long long	count;
+} ReplChunk;
+
+typedef struct ReplJob {
+	const unsigned char	*pat,*rep;
+	int			m;
+	unsigned long long	start,last;	/* matches start in [start,last) */
+	unsigned long long	end;
+	unsigned long long	nchunks;
+	unsigned long long	next;
+	ReplChunk		*chunks;
+	int			patch;
+	int			failed;
+	int			holes;		/* can skip chunks that are all hole */
+} ReplJob;
+
+/* match (and with patch set, replace) the chunk from "entry" on */
+static void ReplDoChunk(ReplJob *j,unsigned long long k,unsigned long long entry,unsigned char *buf)
+{
+	unsigned long long cs,ce,pos,dlo,dhi,count,max;
+	size_t got,want;
+	long long r;
+
+	cs = j->start + (k * REPL_CHUNK);
+	ce = (j->last - cs) > REPL_CHUNK ? cs + REPL_CHUNK : j->last;
+	count = 0;
+	max = j->patch ? j->chunks[k].count : ~0ULL;
+	pos = entry;
+
+	if (entry < ce && !(j->holes && FaIsHole(entry,(ce - entry) + j->m - 1))) {
+		want = (size_t)(ce - entry) + j->m - 1;
+		got = FaBulkRead(entry,want,buf);
+		dlo = dhi = 0;
+
+		while (count < max && (r=SrchMem(buf+(pos-entry),got-(size_t)(pos-entry),j->pat,j->m)) >= 0 && (pos + r) < ce) {
+			pos += r;
+			count++;
+			if (j->patch) {
+				memcpy(buf+(pos-entry),j->rep,j->m);
+				if (dhi != 0 && (pos - dhi) >= REPL_GAP) {
+					if (FaIoWrite(file_fd,buf+(dlo-entry),(size_t)(dhi-dlo),dlo) != (ssize_t)(dhi-dlo)) j->failed = 1;
+					dhi = 0;
+				}
+				if (dhi == 0) dlo = pos;
+				dhi = pos + j->m;
+			}
+			pos += j->m;
+		}
+
+		if (dhi != 0 && FaIoWrite(file_fd,buf+(dlo-entry),(size_t)(dhi-dlo),dlo) != (ssize_t)(dhi-dlo))
+			j->failed = 1;
+	}
+
+	j->chunks[k].entry = entry;
+	j->chunks[k].exit = pos > ce ? pos : ce;
+	j->chunks[k].count = count;
+}
+
+static void *ReplWorker(void *arg)
+{
+	ReplJob *j = (ReplJob*)arg;
+	unsigned char *buf;
+	unsigned long long k;
+
+	if ((buf=(unsigned char*)malloc(REPL_CHUNK + j->m)) == NULL) {
+		j->failed = 1;
+		return NULL;
+	}
+
+	while ((k=__sync_fetch_and_add(&j->next,1)) < j->nchunks) {
+		if (!j->patch)
+			ReplDoChunk(j,k,j->start + (k * REPL_CHUNK),buf);
+		else if (j->chunks[k].count != 0)
+			ReplDoChunk(j,k,j->chunks[k].entry,buf);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/* replace every pat[0..m) lying within [start,end) with rep[0..m). returns
+ * the number replaced or -1 on error. the overlay must be clean. */
+long long ReplFile(const unsigned char *pat,const unsigned char *rep,int m,unsigned long long start,unsigned long long end)
+{
+	unsigned long long k,entry,total;
+	unsigned char *buf;
+	ReplJob j;
+
+	if (file_fd < 0 || !(file_mode & O_RDWR) || EdDirty() || m < 1) return -1;
+	if (end > file_size) end = file_size;
+	if (end < (unsigned long long)m || start > end - m) return 0;
+
+	memset(&j,0,sizeof(j));
+	j.pat = pat;
+	j.rep = rep;
+	j.m = m;
+	j.holes = !SrchAllZero(pat,m);
+	j.start = start;
+	j.end = end;
+	j.last = end - m + 1;
+	j.nchunks = ((j.last - start) + REPL_CHUNK - 1) / REPL_CHUNK;
+	if ((j.chunks=(ReplChunk*)malloc(sizeof(ReplChunk) * j.nchunks)) == NULL) return -1;
+	if ((buf=(unsigned char*)malloc(REPL_CHUNK + m)) == NULL) {
+		free(j.chunks);
+		return -1;
+	}
+
+	JobRun(JobThreads(end - start),ReplWorker,&j);
+
+	/* chain the chunks: a match running over the end of one moves where the next starts */
+	for (entry=start,total=0,k=0;k < j.nchunks && !j.failed;k++) {
+		if (j.chunks[k].entry != entry) ReplDoChunk(&j,k,entry,buf);
+		entry = j.chunks[k].exit;
+		total += j.chunks[k].count;
+	}
+
+	if (!j.failed && total != 0) {
+		j.patch = 1;
+		j.next = 0;
+		JobRun(JobThreads(end - start),ReplWorker,&j);
+		FaCacheFlush();
+	}
+
+	free(buf);
+	free(j.chunks);
+	return j.failed ? -1 : (long long)total;
+}
+
+/* compare mode.
+ * a second file, opened read-only, is shown under the first at the same
+ * offsets with the bytes that differ highlighted. CmpFind() looks for the
+ * next or previous difference: 64 bytes at a time are compared with SSE2
+ * and a single mask test, over chunks shared out between threads like the
+ * search. bytes past the end of the shorter file count as different. */
+#define CMP_CHUNK		(4ULL << 20)
+#define CMP_VIEW_MAX		(1 << 20)	/* read the visible part of the file in one go up to this */
+
+int			cmp_fd = -1;
+unsigned long long	cmp_size = 0;
+char			cmp_name[256] = "";
+static unsigned char	*cmp_view = NULL;		/* the visible span of the second file */
+static unsigned long long cmp_view_ofs = 0;
+static int		cmp_view_len = 0;
+static unsigned char	*cmp_row = NULL;
+static int		cmp_row_size = 0;
+
+/* split the screen for compare mode or not */
+void CmpLayout()
+{
+	if (cmp_fd >= 0)	view_rows = (con_height - 2) / 2;
+	else			view_rows = con_height - 1;
+	if (view_rows < 1) view_rows = 1;
+}
+
+void CmpClose()
+{
+	if (cmp_fd >= 0) close(cmp_fd);
+	cmp_fd = -1;
+	cmp_size = 0;
+	cmp_name[0] = 0;
+	cmp_view_len = 0;
+	CmpLayout();
+}
+
+int CmpOpen(const char *path)
+{
+	CmpClose();
+	if ((cmp_fd=open(path,O_RDONLY)) < 0) return 0;
+	cmp_size = (unsigned long long)StatLseek(cmp_fd,0,SEEK_END);
+	snprintf(cmp_name,sizeof(cmp_name),"%s",path);
+	CmpLayout();
+	return 1;
+}
+
+/* read the second file for the view: rows of "columns" bytes starting
+ * at "ofs", of which the "w" bytes at "colofs" are visible */
+void CmpViewLoad(unsigned long long ofs,unsigned long long rows,unsigned long long columns,unsigned long long colofs,int w)
+{
+	unsigned long long span;
+	ssize_t rd;
+
+	cmp_view_len = 0;
+	if (cmp_fd < 0) return;
+	span = ((rows - 1) * columns) + w;
+	if (span > CMP_VIEW_MAX) return;
+	if (cmp_view == NULL && (cmp_view=(unsigned char*)malloc(CMP_VIEW_MAX)) == NULL) return;
+
+	cmp_view_ofs = ofs + colofs;
+	rd = StatPread(cmp_fd,cmp_view,(size_t)span,(off_t)cmp_view_ofs);
+	cmp_view_len = rd > 0 ? (int)rd : 0;
+}
+
+/* "n" bytes of the second file at "ofs" for the row being drawn */
+const unsigned char *CmpRow(unsigned long long ofs,int n,int w)
+{
+	unsigned char *p;
+	ssize_t rd;
+
+	if (n <= 0) return NULL;
+	if (ofs >= cmp_view_ofs && (ofs + n) <= (cmp_view_ofs + cmp_view_len))
+		return cmp_view + (ofs - cmp_view_ofs);
+
+	/* the view gets wider on a resize or with panels hidden */
+	if (w < n) w = n;
+	if ((w + 64) > cmp_row_size) {
+		if ((p=(unsigned char*)realloc(cmp_row,w + 64)) == NULL) return NULL;
+		cmp_row = p;
+		cmp_row_size = w + 64;
+	}
+	rd = StatPread(cmp_fd,cmp_row,n,(off_t)ofs);
+	if (rd < n) memset(cmp_row+(rd > 0 ? rd : 0),0,n-(rd > 0 ? rd : 0));
+	return cmp_row;
+}
+
+/* index of the first byte that differs in a[0..n) and b[0..n), or n */
+size_t CmpFirst(const unsigned char *a,const unsigned char *b,size_t n)
+{
+	size_t i = 0;
+
+#ifdef SHEX_SSE
+	for (;(i + 64) <= n;i += 64) {
+		__m128i e = _mm_and_si128(
+			_mm_and_si128(
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a+i)),_mm_loadu_si128((const __m128i*)(b+i))),
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a+i+16)),_mm_loadu_si128((const __m128i*)(b+i+16)))),
+			_mm_and_si128(
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a+i+32)),_mm_loadu_si128((const __m128i*)(b+i+32))),
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a+i+48)),_mm_loadu_si128((const __m128i*)(b+i+48)))));
+		if (_mm_movemask_epi8(e) != 0xFFFF) break;
+	}
+#endif
+
+	while (i < n && a[i] == b[i]) i++;
+	return i;
+}
+
+/* index of the last byte that differs in a[0..n) and b[0..n), or -1 */
+long long CmpLast(const unsigned char *a,const unsigned char *b,size_t n)
+{
+	size_t i = n;
+
+#ifdef SHEX_SSE
+	for (;i >= 64;i -= 64) {
+		__m128i e = _mm_and_si128(
+			_mm_and_si128(
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a+i-64)),_mm_loadu_si128((const __m128i*)(b+i-64))),
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a+i-48)),_mm_loadu_si128((const __m128i*)(b+i-48)))),
+			_mm_and_si128(
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a+i-32)),_mm_loadu_si128((const __m128i*)(b+i-32))),
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a+i-16)),_mm_loadu_si128((const __m128i*)(b+i-16)))));
+		if (_mm_movemask_epi8(e) != 0xFFFF) break;
+	}
+#endif
+
+	while (i > 0 && a[i-1] == b[i-1]) i--;
+	return (long long)i - 1;
+}
+
+/* is [cs,ce) of the second file all hole? */
+static int CmpIsHole(unsigned long long cs,unsigned long long ce)
+{
+	off_t r;
+
+	r = StatLseek(cmp_fd,(off_t)cs,SEEK_DATA);
+	if (r < 0) return errno == ENXIO;
+	return (unsigned long long)r >= ce;
+}
+
+typedef struct CmpJob {
+	int			back;
+	unsigned long long	start,end;	/* look within [start,end) */
+	unsigned long long	nchunks;
+	unsigned long long	next;
+	unsigned long long	hit;
+	pthread_mutex_t		lock;
+} CmpJob;
+
+static void *CmpWorker(void *arg)
+{
+	CmpJob *j = (CmpJob*)arg;
+	unsigned long long k,cs,ce,hit,at;
+	unsigned char *a,*b;
+	size_t ga,n;
+	ssize_t gb;
+	long long r;
+
+	a = (unsigned char*)malloc(CMP_CHUNK);
+	b = (unsigned char*)malloc(CMP_CHUNK);
+	if (a == NULL || b == NULL) {
+		free(a);
+		free(b);
+		return NULL;
+	}
+
+	while ((k=__sync_fetch_and_add(&j->next,1)) < j->nchunks) {
+		if (!j->back) {
+			cs = j->start + (k * CMP_CHUNK);
+			ce = (j->end - cs) > CMP_CHUNK ? cs + CMP_CHUNK : j->end;
+		}
+		else {
+			ce = j->end - (k * CMP_CHUNK);
+			cs = (ce - j->start) > CMP_CHUNK ? ce - CMP_CHUNK : j->start;
+		}
+
+		/* a closer difference already makes this chunk pointless */
+		hit = j->hit;
+		if (hit != SRCH_NONE && (j->back ? (ce <= hit) : (cs >= hit))) continue;
+		if (ce <= cmp_size && CmpIsHole(cs,ce) && FaIsHole(cs,ce - cs)) continue;
+
+		ga = FaBulkRead(cs,(size_t)(ce - cs),a);
+		gb = StatPread(cmp_fd,b,(size_t)(ce - cs),(off_t)cs);
+		n = ga;
+		if (gb < 0) gb = 0;
+		if ((size_t)gb < n) n = (size_t)gb;
+
+		if (j->back) {
+			if ((r=CmpLast(a,b,n)) < 0) continue;
+			at = cs + r;
+		}
+		else {
+			at = cs + CmpFirst(a,b,n);
+			if (at >= ce) continue;
+		}
+
+		pthread_mutex_lock(&j->lock);
+		if (j->hit == SRCH_NONE || (j->back ? at > j->hit : at < j->hit))
+			j->hit = at;
+		pthread_mutex_unlock(&j->lock);
+	}
+
+	free(a);
+	free(b);
+	return NULL;
+}
+
+/* the first difference at or after "from", or the last one before it
+ * going back. returns SRCH_NONE if there is none. */
+unsigned long long CmpFind(unsigned long long from,int back)
+{
+	unsigned long long both,most;
+	CmpJob j;
+
+	if (file_fd < 0 || cmp_fd < 0) return SRCH_NONE;
+	both = file_size < cmp_size ? file_size : cmp_size;
+	most = file_size > cmp_size ? file_size : cmp_size;
+
+	memset(&j,0,sizeof(j));
+	j.back = back;
+	j.hit = SRCH_NONE;
+	if (!back) {
+		if (from >= most) return SRCH_NONE;
+		if (from >= both) return from;
+		j.start = from;
+		j.end = both;
+	}
+	else {
+		if (from == 0) return SRCH_NONE;
+		if (from > most) from = most;
+		if ((from - 1) >= both) return from - 1;
+		j.start = 0;
+		j.end = from;
+	}
+
+	j.nchunks = ((j.end - j.start) + CMP_CHUNK - 1) / CMP_CHUNK;
+	pthread_mutex_init(&j.lock,NULL);
+	JobRun(JobThreads(j.end - j.start),CmpWorker,&j);
+	pthread_mutex_destroy(&j.lock);
+
+	/* identical all the way to the end of the shorter file */
+	if (j.hit == SRCH_NONE && !back && both < most) return both;
+	return j.hit;
+}
+
+/* hashing.
+ * HashRange() runs one of the algorithms in hash_names over part of the
+ * file. CRC-32 and CRC-32C are slicing-by-8 (CRC-32C with the SSE4.2
+ * instruction when the CPU has it), computed per chunk on all threads
+ * and joined with CrcCombine(); xxHash64, SHA-256 and MD5 are inherently
+ * serial and stream through the range in chunks. */
+#define HASH_CHUNK		(8ULL << 20)
+#define CRC32_POLY		0xEDB88320U
+#define CRC32C_POLY		0x82F63B78U
+
+enum {				HASH_CRC32=0,
+				HASH_CRC32C,
+				HASH_XXH64,
+				HASH_SHA256,
+				HASH_MD5,
+				HASH_COUNT };
+
+static const char		*hash_names[HASH_COUNT] = { "crc32", "crc32c", "xxh64", "sha256", "md5" };
+
+static unsigned int		crc_tab[2][8][256];
+static int			crc_ready = 0;
+static int			crc_hw = 0;	/* SSE4.2 crc32 instruction */
+
+void CrcInit()
+{
+	unsigned int c,poly;
+	int t,i,k;
+
+	if (crc_ready) return;
+	for (t=0;t < 2;t++) {
+		poly = t ? CRC32C_POLY : CRC32_POLY;
+		for (i=0;i < 256;i++) {
+			for (c=(unsigned int)i,k=0;k < 8;k++) c = (c & 1) ? (c >> 1) ^ poly : c >> 1;
+			crc_tab[t][0][i] = c;
+		}
+		for (i=0;i < 256;i++)
+			for (k=1;k < 8;k++)
+				crc_tab[t][k][i] = (crc_tab[t][k-1][i] >> 8) ^ crc_tab[t][0][crc_tab[t][k-1][i] & 0xFF];
+	}
+#ifdef SHEX_SSE
+	crc_hw = __builtin_cpu_supports("sse4.2");
+#endif
+	crc_ready = 1;
+}
+
+/* advance a (pre-inverted) CRC over n bytes, table t */
+static unsigned int CrcSlice8(int t,unsigned int crc,const unsigned char *p,size_t n)
+{
+	const unsigned int (*T)[256] = crc_tab[t];
+	unsigned int a,b;
+
+	for (;n >= 8;n -= 8,p += 8) {
+		a = crc ^ ((unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24));
+		b = (unsigned int)p[4] | ((unsigned int)p[5] << 8) | ((unsigned int)p[6] << 16) | ((unsigned int)p[7] << 24);
+		crc =	T[7][a & 0xFF] ^ T[6][(a >> 8) & 0xFF] ^ T[5][(a >> 16) & 0xFF] ^ T[4][a >> 24] ^
+			T[3][b & 0xFF] ^ T[2][(b >> 8) & 0xFF] ^ T[1][(b >> 16) & 0xFF] ^ T[0][b >> 24];
+	}
+	while (n-- > 0) crc = (crc >> 8) ^ T[0][(crc ^ *p++) & 0xFF];
+	return crc;
+}
+
+#ifdef SHEX_SSE
+__attribute__((target("sse4.2")))
+static unsigned int Crc32cSSE42(unsigned int crc,const unsigned char *p,size_t n)
+{
+	unsigned long long c = crc,v;
+
+	for (;n >= 8;n -= 8,p += 8) {
+		memcpy(&v,p,8);
+		c = __builtin_ia32_crc32di(c,v);
+	}
+	crc = (unsigned int)c;
+	while (n-- > 0) crc = __builtin_ia32_crc32qi(crc,*p++);
+	return crc;
+}
+#endif
+
+/* CRC of n bytes, "algo" being HASH_CRC32 or HASH_CRC32C */
+unsigned int Crc(int algo,unsigned int crc,const unsigned char *p,size_t n)
+{
+	crc = ~crc;
+#ifdef SHEX_SSE
+	if (algo == HASH_CRC32C && crc_hw) return ~Crc32cSSE42(crc,p,n);
+#endif
+	return ~CrcSlice8(algo == HASH_CRC32C ? 1 : 0,crc,p,n);
+}
+
+static unsigned int CrcGf2Times(const unsigned int *mat,unsigned int vec)
+{
+	unsigned int sum = 0;
+
+	for (;vec;vec >>= 1,mat++)
+		if (vec & 1) sum ^= *mat;
+	return sum;
+}
+
+static void CrcGf2Square(unsigned int *sq,const unsigned int *mat)
+{
+	int n;
+
+	for (n=0;n < 32;n++) sq[n] = CrcGf2Times(mat,mat[n]);
+}
+
+/* the CRC of A followed by B from crc(A), crc(B) and the length of B */
+unsigned int CrcCombine(unsigned int crc1,unsigned int crc2,unsigned long long len2,unsigned int poly)
+{
+	unsigned int even[32],odd[32],row;
+	int n;
+
+	if (len2 == 0) return crc1;
+
+	/* operator for one zero bit, then two, then four */
+	odd[0] = poly;
+	for (n=1,row=1;n < 32;n++,row <<= 1) odd[n] = row;
+	CrcGf2Square(even,odd);
+	CrcGf2Square(odd,even);
+
+	/* apply len2 zero bytes to crc1 */
+	do {
+		CrcGf2Square(even,odd);
+		if (len2 & 1) crc1 = CrcGf2Times(even,crc1);
+		len2 >>= 1;
+		if (len2 == 0) break;
+
+		CrcGf2Square(odd,even);
+		if (len2 & 1) crc1 = CrcGf2Times(odd,crc1);
+		len2 >>= 1;
+	} while (len2 != 0);
+
+	return crc1 ^ crc2;
+}
+
+/* xxHash64 */
+#define XXH_P1			11400714785074694791ULL
+#define XXH_P2			14029467366897019727ULL
+#define XXH_P3			1609587929392839161ULL
+#define XXH_P4			9650029242287828579ULL
+#define XXH_P5			2870177450012600261ULL
+#define XXH_ROTL(x,r)		(((x) << (r)) | ((x) >> (64 - (r))))
+
+typedef struct Xxh64 {
+	unsigned long long	v[4];
+	unsigned long long	total;
+	unsigned char		mem[32];
+	int			memlen;
+} Xxh64;
+
+static unsigned long long XxhRound(unsigned long long acc,unsigned long long in)
+{
+	acc += in * XXH_P2;
+	acc = XXH_ROTL(acc,31);
+	return acc * XXH_P1;
+}
+
+static unsigned long long XxhMerge(unsigned long long acc,unsigned long long v)
+{
+	acc ^= XxhRound(0,v);
+	return (acc * XXH_P1) + XXH_P4;
+}
+
+static unsigned long long XxhRead64(const unsigned char *p)
+{
+	unsigned long long v;
+
+	memcpy(&v,p,8);
+	return v;
+}
+
+void Xxh64Init(Xxh64 *x)
+{
+	memset(x,0,sizeof(*x));
+	x->v[0] = XXH_P1 + XXH_P2;
+	x->v[1] = XXH_P2;
+	x->v[2] = 0;
+	x->v[3] = 0 - XXH_P1;
+}
+
+void Xxh64Update(Xxh64 *x,const unsigned char *p,size_t n)
+{
+	size_t k;
+
+	x->total += n;
+	if (x->memlen) {
+		k = (size_t)(32 - x->memlen) < n ? (size_t)(32 - x->memlen) : n;
+		memcpy(x->mem+x->memlen,p,k);
+		x->memlen += (int)k;
+		p += k;
+		n -= k;
+		if (x->memlen < 32) return;
+		for (k=0;k < 4;k++) x->v[k] = XxhRound(x->v[k],XxhRead64(x->mem+(k*8)));
+		x->memlen = 0;
+	}
+
+	for (;n >= 32;n -= 32,p += 32) {
+		x->v[0] = XxhRound(x->v[0],XxhRead64(p));
+		x->v[1] = XxhRound(x->v[1],XxhRead64(p+8));
+		x->v[2] = XxhRound(x->v[2],XxhRead64(p+16));
+		x->v[3] = XxhRound(x->v[3],XxhRead64(p+24));
+	}
+
+	memcpy(x->mem,p,n);
+	x->memlen = (int)n;
+}
+
+unsigned long long Xxh64Final(Xxh64 *x)
+{
+	const unsigned char *p = x->mem,*e = x->mem + x->memlen;
+	unsigned long long h;
+	unsigned int w;
+
+	if (x->total >= 32) {
+		h = XXH_ROTL(x->v[0],1) + XXH_ROTL(x->v[1],7) + XXH_ROTL(x->v[2],12) + XXH_ROTL(x->v[3],18);
+		h = XxhMerge(h,x->v[0]);
+		h = XxhMerge(h,x->v[1]);
+		h = XxhMerge(h,x->v[2]);
+		h = XxhMerge(h,x->v[3]);
+	}
+	else {
+		h = x->v[2] + XXH_P5;
+	}
+	h += x->total;
+
+	for (;(p + 8) <= e;p += 8) {
+		h ^= XxhRound(0,XxhRead64(p));
+		h = (XXH_ROTL(h,27) * XXH_P1) + XXH_P4;
+	}
+	if ((p + 4) <= e) {
+		memcpy(&w,p,4);
+		h ^= (unsigned long long)w * XXH_P1;
+		h = (XXH_ROTL(h,23) * XXH_P2) + XXH_P3;
+		p += 4;
+	}
+	for (;p < e;p++) {
+		h ^= (*p) * XXH_P5;
+		h = XXH_ROTL(h,11) * XXH_P1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+/* SHA-256 */
+typedef struct Sha256 {
+	unsigned int		h[8];
+	unsigned long long	total;
+	unsigned char		buf[64];
+	int			buflen;
+} Sha256;
+
+static const unsigned int sha256_k[64] = {
+	0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+	0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+	0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+	0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+	0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+	0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+	0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+	0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2 };
+
+#define SHA_ROTR(x,r)		(((x) >> (r)) | ((x) << (32 - (r))))
+
+static void Sha256Block(Sha256 *c,const unsigned char *p)
+{
+	unsigned int w[64],a,b,d,e,f,g,h,t1,t2,cc;
+	int i;
+
+	for (i=0;i < 16;i++)
+		w[i] = ((unsigned int)p[i*4] << 24) | ((unsigned int)p[(i*4)+1] << 16) | ((unsigned int)p[(i*4)+2] << 8) | p[(i*4)+3];
+	for (;i < 64;i++)
+		w[i] =	(SHA_ROTR(w[i-2],17) ^ SHA_ROTR(w[i-2],19) ^ (w[i-2] >> 10)) + w[i-7] +
+			(SHA_ROTR(w[i-15],7) ^ SHA_ROTR(w[i-15],18) ^ (w[i-15] >> 3)) + w[i-16];
+
+	a = c->h[0]; b = c->h[1]; cc = c->h[2]; d = c->h[3];
+	e = c->h[4]; f = c->h[5]; g = c->h[6]; h = c->h[7];
+	for (i=0;i < 64;i++) {
+		t1 = h + (SHA_ROTR(e,6) ^ SHA_ROTR(e,11) ^ SHA_ROTR(e,25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (SHA_ROTR(a,2) ^ SHA_ROTR(a,13) ^ SHA_ROTR(a,22)) + ((a & b) ^ (a & cc) ^ (b & cc));
+		h = g; g = f; f = e; e = d + t1;
+		d = cc; cc = b; b = a; a = t1 + t2;
+	}
+	c->h[0] += a; c->h[1] += b; c->h[2] += cc; c->h[3] += d;
+	c->h[4] += e; c->h[5] += f; c->h[6] += g; c->h[7] += h;
+}
+
+void Sha256Init(Sha256 *c)
+{
+	static const unsigned int iv[8] = {
+		0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19 };
+
+	memcpy(c->h,iv,sizeof(iv));
+	c->total = 0;
+	c->buflen = 0;
+}
+
+void Sha256Update(Sha256 *c,const unsigned char *p,size_t n)
+{
+	size_t k;
+
+	c->total += n;
+	if (c->buflen) {
+		k = (size_t)(64 - c->buflen) < n ? (size_t)(64 - c->buflen) : n;
+		memcpy(c->buf+c->buflen,p,k);
+		c->buflen += (int)k;
+		p += k;
+		n -= k;
+		if (c->buflen < 64) return;
+		Sha256Block(c,c->buf);
+		c->buflen = 0;
+	}
+	for (;n >= 64;n -= 64,p += 64) Sha256Block(c,p);
+	memcpy(c->buf,p,n);
+	c->buflen = (int)n;
+}
+
+void Sha256Final(Sha256 *c,unsigned char *out)
+{
+	unsigned long long bits = c->total * 8;
+	unsigned char pad[72];
+	int i,n;
+
+	n = (c->buflen < 56 ? 56 : 120) - c->buflen;
+	memset(pad,0,sizeof(pad));
+	pad[0] = 0x80;
+	for (i=0;i < 8;i++) pad[n+i] = (unsigned char)(bits >> (56 - (i * 8)));
+	Sha256Update(c,pad,n+8);
+	for (i=0;i < 32;i++) out[i] = (unsigned char)(c->h[i/4] >> (24 - ((i & 3) * 8)));
+}
+
+/* MD5 */
+typedef struct Md5 {
+	unsigned int		h[4];
+	unsigned long long	total;
+	unsigned char		buf[64];
+	int			buflen;
+} Md5;
+
+static const unsigned int md5_k[64] = {
+	0xd76aa478,0xe8c7b756,0x242070db,0xc1bdceee,0xf57c0faf,0x4787c62a,0xa8304613,0xfd469501,
+	0x698098d8,0x8b44f7af,0xffff5bb1,0x895cd7be,0x6b901122,0xfd987193,0xa679438e,0x49b40821,
+	0xf61e2562,0xc040b340,0x265e5a51,0xe9b6c7aa,0xd62f105d,0x02441453,0xd8a1e681,0xe7d3fbc8,
+	0x21e1cde6,0xc33707d6,0xf4d50d87,0x455a14ed,0xa9e3e905,0xfcefa3f8,0x676f02d9,0x8d2a4c8a,
+	0xfffa3942,0x8771f681,0x6d9d6122,0xfde5380c,0xa4beea44,0x4bdecfa9,0xf6bb4b60,0xbebfbc70,
+	0x289b7ec6,0xeaa127fa,0xd4ef3085,0x04881d05,0xd9d4d039,0xe6db99e5,0x1fa27cf8,0xc4ac5665,
+	0xf4292244,0x432aff97,0xab9423a7,0xfc93a039,0x655b59c3,0x8f0ccc92,0xffeff47d,0x85845dd1,
+	0x6fa87e4f,0xfe2ce6e0,0xa3014314,0x4e0811a1,0xf7537e82,0xbd3af235,0x2ad7d2bb,0xeb86d391 };
+
+static const unsigned char md5_r[64] = {
+	7,12,17,22,7,12,17,22,7,12,17,22,7,12,17,22,
+	5,9,14,20,5,9,14,20,5,9,14,20,5,9,14,20,
+	4,11,16,23,4,11,16,23,4,11,16,23,4,11,16,23,
+	6,10,15,21,6,10,15,21,6,10,15,21,6,10,15,21 };
+
+static void Md5Block(Md5 *c,const unsigned char *p)
+{
+	unsigned int w[16],a,b,d,f,cc,t;
+	int i,g;
+
+	for (i=0;i < 16;i++)
+		w[i] = (unsigned int)p[i*4] | ((unsigned int)p[(i*4)+1] << 8) | ((unsigned int)p[(i*4)+2] << 16) | ((unsigned int)p[(i*4)+3] << 24);
+
+	a = c->h[0]; b = c->h[1]; cc = c->h[2]; d = c->h[3];
+	for (i=0;i < 64;i++) {
+		if (i < 16)		{ f = (b & cc) | (~b & d);	g = i; }
+		else if (i < 32)	{ f = (d & b) | (~d & cc);	g = ((i * 5) + 1) & 15; }
+		else if (i < 48)	{ f = b ^ cc ^ d;		g = ((i * 3) + 5) & 15; }
+		else			{ f = cc ^ (b | ~d);		g = (i * 7) & 15; }
+		t = d;
+		d = cc;
+		cc = b;
+		f += a + md5_k[i] + w[g];
+		b += (f << md5_r[i]) | (f >> (32 - md5_r[i]));
+		a = t;
+	}
+	c->h[0] += a; c->h[1] += b; c->h[2] += cc; c->h[3] += d;
+}
+
+void Md5Init(Md5 *c)
+{
+	c->h[0] = 0x67452301;
+	c->h[1] = 0xefcdab89;
+	c->h[2] = 0x98badcfe;
+	c->h[3] = 0x10325476;
+	c->total = 0;
+	c->buflen = 0;
+}
+
+void Md5Update(Md5 *c,const unsigned char *p,size_t n)
+{
+	size_t k;
+
+	c->total += n;
+	if (c->buflen) {
+		k = (size_t)(64 - c->buflen) < n ? (size_t)(64 - c->buflen) : n;
+		memcpy(c->buf+c->buflen,p,k);
+		c->buflen += (int)k;
+		p += k;
+		n -= k;
+		if (c->buflen < 64) return;
+		Md5Block(c,c->buf);
+		c->buflen = 0;
+	}
+	for (;n >= 64;n -= 64,p += 64) Md5Block(c,p);
+	memcpy(c->buf,p,n);
+	c->buflen = (int)n;
+}
+
+void Md5Final(Md5 *c,unsigned char *out)
+{
+	unsigned long long bits = c->total * 8;
+	unsigned char pad[72];
+	int i,n;
+
+	n = (c->buflen < 56 ? 56 : 120) - c->buflen;
+	memset(pad,0,sizeof(pad));
+	pad[0] = 0x80;
+	for (i=0;i < 8;i++) pad[n+i] = (unsigned char)(bits >> (i * 8));
+	Md5Update(c,pad,n+8);
+	for (i=0;i < 16;i++) out[i] = (unsigned char)(c->h[i/4] >> ((i & 3) * 8));
+}
+
+typedef struct CrcJob {
+	int			algo;
+	unsigned long long	start,end;
+	unsigned long long	nchunks;
+	unsigned long long	next;
+	unsigned int		*crcs;		/* CRC of each chunk */
+	int			failed;
+} CrcJob;
+
+static void *CrcWorker(void *arg)
+{
+	CrcJob *j = (CrcJob*)arg;
+	unsigned long long k,cs,ce;
+	unsigned char *buf;
+
+	if ((buf=(unsigned char*)malloc(HASH_CHUNK)) == NULL) {
+		j->failed = 1;
+		return NULL;
+	}
+
+	while ((k=__sync_fetch_and_add(&j->next,1)) < j->nchunks) {
+		cs = j->start + (k * HASH_CHUNK);
+		ce = (j->end - cs) > HASH_CHUNK ? cs + HASH_CHUNK : j->end;
+		if (FaBulkRead(cs,(size_t)(ce - cs),buf) != (size_t)(ce - cs)) j->failed = 1;
+		j->crcs[k] = Crc(j->algo,0,buf,(size_t)(ce - cs));
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/* hash [start,end) of the file with the algorithm named "name", leaving the
+ * digest in hex in "out" (at least 65 chars). returns 0 for an unknown
+ * name or a read error */
+int HashRange(const char *name,unsigned long long start,unsigned long long end,char *out)
+{
+	unsigned long long k,ce,len,xh;
+	unsigned char dig[32],*buf;
+	unsigned int crc;
+	int algo,i,n;
+	CrcJob j;
+	Xxh64 x;
+	Sha256 sc;
+	Md5 mc;
+
+	for (algo=0;algo < HASH_COUNT && strcasecmp(name,hash_names[algo]);algo++);
+	if (algo == HASH_COUNT) return 0;
+	if (end > file_size) end = file_size;
+	if (start > end) start = end;
+	CrcInit();
+
+	if (algo == HASH_CRC32 || algo == HASH_CRC32C) {
+		memset(&j,0,sizeof(j));
+		j.algo = algo;
+		j.start = start;
+		j.end = end;
+		j.nchunks = ((end - start) + HASH_CHUNK - 1) / HASH_CHUNK;
+		if ((j.crcs=(unsigned int*)malloc(sizeof(unsigned int) * (j.nchunks + 1))) == NULL) return 0;
+		JobRun(JobThreads(end - start),CrcWorker,&j);
+
+		for (crc=0,k=0;k < j.nchunks;k++) {
+			len = (end - (start + (k * HASH_CHUNK))) > HASH_CHUNK ? HASH_CHUNK : end - (start + (k * HASH_CHUNK));
+			crc = CrcCombine(crc,j.crcs[k],len,algo == HASH_CRC32C ? CRC32C_POLY : CRC32_POLY);
+		}
+		free(j.crcs);
+		if (j.failed) return 0;
+		sprintf(out,"%08x",crc);
+		return 1;
+	}
+
+	if ((buf=(unsigned char*)malloc(HASH_CHUNK)) == NULL) return 0;
+	Xxh64Init(&x);
+	Sha256Init(&sc);
+	Md5Init(&mc);
+	for (k=start;k < end;k=ce) {
+		ce = (end - k) > HASH_CHUNK ? k + HASH_CHUNK : end;
+		if (FaBulkRead(k,(size_t)(ce - k),buf) != (size_t)(ce - k)) {
+			free(buf);
+			return 0;
+		}
+		if (algo == HASH_XXH64)		Xxh64Update(&x,buf,(size_t)(ce - k));
+		else if (algo == HASH_SHA256)	Sha256Update(&sc,buf,(size_t)(ce - k));
+		else				Md5Update(&mc,buf,(size_t)(ce - k));
+	}
+	free(buf);
+
+	if (algo == HASH_XXH64) {
+		xh = Xxh64Final(&x);
+		sprintf(out,"%016llx",xh);
+		return 1;
+	}
+
+	if (algo == HASH_SHA256)	{ Sha256Final(&sc,dig); n = 32; }
+	else				{ Md5Final(&mc,dig); n = 16; }
+	for (i=0;i < n;i++) sprintf(out+(i*2),"%02x",dig[i]);
+	return 1;
+}
+
+/* text export and import.
+ * TxExport() writes a range of the file as hex, base64 or a C array, a
+ * megabyte of input at a time into one output buffer and one write().
+ * hex digits come 16 bytes at a time from SSE2, base64 from a table of
+ * the 4096 possible character pairs. TxImport() decodes hex (16 digits
+ * at a time with SSE2 when there is no whitespace in the way) or base64
+ * straight into the edit overlay's add buffer and makes the result one
+ * undoable overwrite at the cursor. */
+#define TX_CHUNK		(1 << 20)
+
+enum {				TX_HEX=0,
+				TX_BASE64,
+				TX_CARRAY,
+				TX_COUNT };
+
+static const char		*tx_names[TX_COUNT] = { "hex", "base64", "c-array" };
+static const int		tx_line[TX_COUNT] = { 32, 57, 12 };	/* bytes per line */
+static const char		*tx_b64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static char			tx_hex2[256][2];
+static char			tx_b64pair[4096][2];
+static char			tx_carr[256][6];
+static unsigned char		tx_dec[256];		/* digit value, TX_WS or TX_BAD */
+static unsigned char		tx_b64dec[256];
+static int			tx_ready = 0;
+
+#define TX_WS			0xFE
+#define TX_BAD			0xFF
+#define TX_PAD			0xFD
+
+void TxInit()
+{
+	static const char *hd = "0123456789abcdef";
+	int i;
+
+	if (tx_ready) return;
+	memset(tx_dec,TX_BAD,sizeof(tx_dec));
+	memset(tx_b64dec,TX_BAD,sizeof(tx_b64dec));
+	for (i=0;i < 256;i++) {
+		tx_hex2[i][0] = hd[i >> 4];
+		tx_hex2[i][1] = hd[i & 15];
+		memcpy(tx_carr[i],"0x",2);
+		memcpy(tx_carr[i]+2,tx_hex2[i],2);
+		memcpy(tx_carr[i]+4,", ",2);
+	}
+	for (i=0;i < 4096;i++) {
+		tx_b64pair[i][0] = tx_b64[i >> 6];
+		tx_b64pair[i][1] = tx_b64[i & 63];
+	}
+	for (i=0;i < 16;i++) {
+		tx_dec[(unsigned char)hd[i]] = (unsigned char)i;
+		tx_dec[toupper((unsigned char)hd[i])] = (unsigned char)i;
+	}
+	for (i=0;i < 64;i++) tx_b64dec[(unsigned char)tx_b64[i]] = (unsigned char)i;
+	tx_dec[' '] = tx_dec['\t'] = tx_dec['\r'] = tx_dec['\n'] = TX_WS;
+	tx_b64dec[' '] = tx_b64dec['\t'] = tx_b64dec['\r'] = tx_b64dec['\n'] = TX_WS;
+	tx_b64dec['='] = TX_PAD;
+	tx_ready = 1;
+}
+
+/* n bytes as 2n lowercase hex digits */
+static void TxHex(char *d,const unsigned char *s,size_t n)
+{
+#ifdef SHEX_SSE
+	const __m128i m0f = _mm_set1_epi8(0x0F),nine = _mm_set1_epi8(9);
+	const __m128i c0 = _mm_set1_epi8('0'),ca = _mm_set1_epi8('a' - '0' - 10);
+	__m128i v,hi,lo;
+
+	for (;n >= 16;n -= 16,s += 16,d += 32) {
+		v = _mm_loadu_si128((const __m128i*)s);
+		hi = _mm_and_si128(_mm_srli_epi16(v,4),m0f);
+		lo = _mm_and_si128(v,m0f);
+		hi = _mm_add_epi8(_mm_add_epi8(hi,c0),_mm_and_si128(_mm_cmpgt_epi8(hi,nine),ca));
+		lo = _mm_add_epi8(_mm_add_epi8(lo,c0),_mm_and_si128(_mm_cmpgt_epi8(lo,nine),ca));
+		_mm_storeu_si128((__m128i*)d,_mm_unpacklo_epi8(hi,lo));
+		_mm_storeu_si128((__m128i*)(d+16),_mm_unpackhi_epi8(hi,lo));
+	}
+#endif
+
+	for (;n > 0;n--,d += 2) memcpy(d,tx_hex2[*s++],2);
+}
+
+/* n bytes as base64, padded if n isn't a multiple of 3 */
+static char *TxBase64(char *d,const unsigned char *s,size_t n)
+{
+	unsigned int v;
+
+	for (;n >= 3;n -= 3,s += 3,d += 4) {
+		v = ((unsigned int)s[0] << 16) | ((unsigned int)s[1] << 8) | s[2];
+		memcpy(d,tx_b64pair[v >> 12],2);
+		memcpy(d+2,tx_b64pair[v & 0xFFF],2);
+	}
+	if (n > 0) {
+		v = ((unsigned int)s[0] << 16) | (n > 1 ? (unsigned int)s[1] << 8 : 0);
+		memcpy(d,tx_b64pair[v >> 12],2);
+		d[2] = n > 1 ? tx_b64[(v >> 6) & 63] : '=';
+		d[3] = '=';
+		d += 4;
+	}
+	return d;
+}
+
+/* encode n bytes, whole lines except maybe the last. returns the end */
+static char *TxEncode(int fmt,char *d,const unsigned char *s,size_t n)
+{
+	size_t k,l = tx_line[fmt];
+	int i;
+
+	for (;n > 0;n -= k,s += k) {
+		k = n < l ? n : l;
+		if (fmt == TX_HEX) {
+			TxHex(d,s,k);
+			d += k * 2;
+		}
+		else if (fmt == TX_BASE64) {
+			d = TxBase64(d,s,k);
+		}
+		else {
+			*d++ = ' ';
+			*d++ = ' ';
+			for (i=0;i < (int)k;i++,d += 6) memcpy(d,tx_carr[s[i]],6);
+			d--;		/* no space before the newline */
+		}
+		*d++ = '\n';
+	}
+	return d;
+}
+
+/* write [start,start+len) of the file to "path" in format "name".
+ * returns 0 on an unknown format or an I/O error */
+int TxExport(const char *name,unsigned long long start,unsigned long long len,const char *path)
+{
+	unsigned long long done;
+	unsigned char *in;
+	size_t k,chunk;
+	char *out,*e;
+	int fmt,fd,ok;
+
+	for (fmt=0;fmt < TX_COUNT && strcasecmp(name,tx_names[fmt]);fmt++);
+	if (fmt == TX_COUNT) return 0;
+	if (start > file_size) start = file_size;
+	if (len > (file_size - start)) len = file_size - start;
+	TxInit();
+
+	chunk = (TX_CHUNK / tx_line[fmt]) * tx_line[fmt];
+	in = (unsigned char*)malloc(chunk);
+	out = (char*)malloc((chunk * 6) + 256);
+	if (in == NULL || out == NULL || (fd=open(path,O_WRONLY | O_CREAT | O_TRUNC,0644)) < 0) {
+		free(in);
+		free(out);
+		return 0;
+	}
+
+	ok = 1;
+	if (fmt == TX_CARRAY && write(fd,"unsigned char shex_export[] = {\n",32) != 32) ok = 0;
+	for (done=0;ok && done < len;done += k) {
+		k = (len - done) < chunk ? (size_t)(len - done) : chunk;
+		if (FaBulkRead(start + done,k,in) != k) {
+			ok = 0;
+			break;
+		}
+		e = TxEncode(fmt,out,in,k);
+		if (write(fd,out,e - out) != (ssize_t)(e - out)) ok = 0;
+	}
+	if (ok && fmt == TX_CARRAY) {
+		k = (size_t)snprintf(out,256,"};\nunsigned int shex_export_len = %llu;\n",len);
+		if (write(fd,out,k) != (ssize_t)k) ok = 0;
+	}
+
+	if (close(fd) < 0) ok = 0;
+	free(in);
+	free(out);
+	return ok;
+}
+
+/* decode hex digits, carrying an odd digit over in *half (-1 if none).
+ * returns the bytes written to d or -1 on a bad character */
+static long long TxUnhex(unsigned char *d,const char *s,size_t n,int *half)
+{
+	unsigned char *d0 = d,c;
+	size_t i = 0;
+
+#ifdef SHEX_SSE
+	const __m128i c0 = _mm_set1_epi8('0' - 1),c9 = _mm_set1_epi8('9' + 1);
+	const __m128i ca = _mm_set1_epi8('a' - 1),cf = _mm_set1_epi8('f' + 1);
+	const __m128i l20 = _mm_set1_epi8(0x20),d0x = _mm_set1_epi8('0'),a10 = _mm_set1_epi8('a' - 10);
+	const __m128i mlo = _mm_set1_epi16(0x00FF);
+	__m128i v,lc,dig,alp,nib,w;
+#endif
+
+	while (i < n) {
+#ifdef SHEX_SSE
+		/* whole runs of 16 digits between line breaks go 8 bytes at a time */
+		if (*half < 0) {
+			for (;(i + 16) <= n;i += 16,d += 8) {
+				v = _mm_loadu_si128((const __m128i*)(s+i));
+				lc = _mm_or_si128(v,l20);
+				dig = _mm_and_si128(_mm_cmpgt_epi8(v,c0),_mm_cmplt_epi8(v,c9));
+				alp = _mm_and_si128(_mm_cmpgt_epi8(lc,ca),_mm_cmplt_epi8(lc,cf));
+				if (_mm_movemask_epi8(_mm_or_si128(dig,alp)) != 0xFFFF) break;
+
+				nib = _mm_or_si128(_mm_and_si128(dig,_mm_sub_epi8(v,d0x)),_mm_andnot_si128(dig,_mm_sub_epi8(lc,a10)));
+				/* each 16-bit lane holds the high digit in its low byte */
+				w = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(nib,mlo),4),_mm_srli_epi16(nib,8));
+				_mm_storel_epi64((__m128i*)d,_mm_packus_epi16(w,w));
+			}
+			if (i >= n) break;
+		}
+#endif
+
+		if ((c=tx_dec[(unsigned char)s[i++]]) == TX_WS) continue;
+		if (c == TX_BAD) return -1;
+		if (*half < 0) {
+			*half = c;
+		}
+		else {
+			*d++ = (unsigned char)((*half << 4) | c);
+			*half = -1;
+		}
+	}
+
+	return (long long)(d - d0);
+}
+
+/* decode base64, carrying a partial quantum through acc and nacc and
+ * stopping at padding (nacc is -1 after that). returns bytes written or -1 */
+static long long TxUnbase64(unsigned char *d,const char *s,size_t n,unsigned int *acc,int *nacc)
+{
+	unsigned char *d0 = d,c;
+	size_t i;
+
+	for (i=0;i < n;i++) {
+		if ((c=tx_b64dec[(unsigned char)s[i]]) == TX_WS) continue;
+		if (*nacc < 0) {
+			if (c == TX_PAD) continue;
+			return -1;
+		}
+		if (c == TX_BAD) return -1;
+		if (c == TX_PAD) {
+			/* "xx==" gives one byte, "xxx=" two */
+			if (*nacc == 2)		*d++ = (unsigned char)(*acc >> 4);
+			else if (*nacc == 3)	{ *d++ = (unsigned char)(*acc >> 10); *d++ = (unsigned char)(*acc >> 2); }
+			else			return -1;
+			*nacc = -1;
+			continue;
+		}
+
+		*acc = (*acc << 6) | c;
+		if (++(*nacc) == 4) {
+			*d++ = (unsigned char)(*acc >> 16);
+			*d++ = (unsigned char)(*acc >> 8);
+			*d++ = (unsigned char)(*acc);
+			*acc = 0;
+			*nacc = 0;
+		}
+	}
+
+	return (long long)(d - d0);
+}
+
+/* decode "path" (format "name", hex or base64) over the file at "ofs".
+ * returns the number of bytes imported, or -1 on an unknown format, a
+ * bad file or a decoding error */
+long long TxImport(const char *name,const char *path,unsigned long long ofs)
+{
+	unsigned long long total,start;
+	unsigned int acc = 0;
+	int fmt,fd,half = -1,nacc = 0;
+	long long got;
+	ssize_t rd;
+	char *in;
+
+	for (fmt=0;fmt < TX_BASE64+1 && strcasecmp(name,tx_names[fmt]);fmt++);
+	if (fmt > TX_BASE64 || ofs > file_size) return -1;
+	TxInit();
+
+	if ((in=(char*)malloc(TX_CHUNK)) == NULL) return -1;
+	if ((fd=open(path,O_RDONLY)) < 0) {
+		free(in);
+		return -1;
+	}
+
+	start = ed_add_len;
+	total = 0;
+	got = 0;
+	while ((rd=read(fd,in,TX_CHUNK)) > 0) {
+		/* decode straight onto the end of the add buffer */
+		if (!EdAddRoom((size_t)rd)) {
+			got = -1;
+			break;
+		}
+		if (fmt == TX_HEX)	got = TxUnhex(ed_add+ed_add_len,in,(size_t)rd,&half);
+		else			got = TxUnbase64(ed_add+ed_add_len,in,(size_t)rd,&acc,&nacc);
+		if (got < 0) break;
+		ed_add_len += (size_t)got;
+		total += (unsigned long long)got;
+	}
+	close(fd);
+	free(in);
+
+	/* a lone hex digit or a cut off base64 quantum is an error too */
+	if (rd < 0 || got < 0 || half >= 0 || nacc > 0 ||
+		(total != 0 && !EdEditAdd(ofs,(file_size - ofs) < total ? file_size - ofs : total,start,total))) {
+		ed_add_len = start;
+		return -1;
+	}
+
+	return (long long)total;
+}
+
+/* binary patches.
+ * PatchApply() reads an IPS, BPS or text ("<hex offset>: <hex bytes>"
+ * lines, "size: <n>" to resize) patch into a list of records, each a run
+ * of new bytes for the file. the records are sorted and gathered into
+ * spans, records less than PATCH_GAP apart sharing a span with the file's
+ * own bytes read in between, and every span goes out in one write,
+ * straight to disk like replace. a later record wins where two overlap.
+ * PatchCreate() compares the file with another a chunk at a time and
+ * writes what differs as a patch in any of the three formats. */
+#define PATCH_GAP		4096
+#define PATCH_CHUNK		(1 << 20)
+#define PATCH_IPS_MAX		0xFFFFFF	/* IPS offsets have 24 bits */
+#define PATCH_IPS_EOF		0x454F46	/* "EOF", can't start a record */
+
+enum {				PATCH_IPS=0,
+				PATCH_BPS,
+				PATCH_TEXT };
+
+typedef struct PatchRec {
+	unsigned long long	ofs,len;
+	size_t			data;		/* offset in Patch.data */
+	int			span;
+} PatchRec;
+
+typedef struct PatchKey {
+	unsigned long long	ofs;
+	size_t			rec;
+} PatchKey;
+
+typedef struct PatchSpan {
+	unsigned long long	ofs,len;
+	size_t			buf;		/* offset in the span buffer */
+	int			gaps;		/* has bytes no record covers */
+} PatchSpan;
+
+typedef struct Patch {
+	PatchRec		*recs;
+	size_t			nrecs,arecs;
+	unsigned char		*data;
+	size_t			dlen,dalloc;
+	long long		size;		/* size to leave the file at, -1 = as it comes out */
+	const char		*why;		/* what was wrong with it */
+} Patch;
+
+/* room for "len" more bytes of record data. returns where or -1 */
+static long long PatchRoom(Patch *p,unsigned long long len)
+{
+	unsigned char *nd;
+	size_t na;
+
+	if ((p->dlen + len) > p->dalloc) {
+		for (na=p->dalloc ? p->dalloc : 65536;na < (p->dlen + len);) na *= 2;
+		if ((nd=(unsigned char*)realloc(p->data,na)) == NULL) return -1;
+		p->data = nd;
+		p->dalloc = na;
+	}
+	return (long long)p->dlen;
+}
+
+/* the "len" bytes just put at data offset "d" belong at "ofs" */
+static int PatchPut(Patch *p,unsigned long long ofs,size_t d,unsigned long long len)
+{
+	PatchRec *r,*nr;
+
+	p->dlen = d + len;
+	r = p->nrecs ? p->recs + p->nrecs - 1 : NULL;
+	if (r && (r->ofs + r->len) == ofs && (r->data + r->len) == d) {
+		r->len += len;
+		return 1;
+	}
+
+	if (p->nrecs >= p->arecs) {
+		if ((nr=(PatchRec*)realloc(p->recs,sizeof(PatchRec) * (p->arecs + 4096))) == NULL) return 0;
+		p->recs = nr;
+		p->arecs += 4096;
+	}
+	r = p->recs + p->nrecs++;
+	r->ofs = ofs;
+	r->len = len;
+	r->data = d;
+	r->span = -1;
+	return 1;
+}
+
+static int PatchBytes(Patch *p,unsigned long long ofs,const unsigned char *s,unsigned long long len)
+{
+	long long d;
+
+	if ((d=PatchRoom(p,len)) < 0) return 0;
+	memcpy(p->data+d,s,(size_t)len);
+	return PatchPut(p,ofs,(size_t)d,len);
+}
+
+static unsigned int PatchLe32(const unsigned char *s)
+{
+	return (unsigned int)s[0] | ((unsigned int)s[1] << 8) | ((unsigned int)s[2] << 16) | ((unsigned int)s[3] << 24);
+}
+
+static int PatchIps(Patch *p,const unsigned char *s,size_t n)
+{
+	unsigned long long ofs,len;
+	size_t i = 5;
+	long long d;
+
+	for (;;) {
+		if ((i + 3) > n) return 0;
+		if (!memcmp(s+i,"EOF",3)) break;
+		if ((i + 5) > n) return 0;
+		ofs = ((unsigned long long)s[i] << 16) | ((unsigned long long)s[i+1] << 8) | s[i+2];
+		len = ((unsigned long long)s[i+3] << 8) | s[i+4];
+		i += 5;
+
+		if (len != 0) {
+			if ((i + len) > n || !PatchBytes(p,ofs,s+i,len)) return 0;
+			i += (size_t)len;
+		}
+		else {
+			/* run of one byte */
+			if ((i + 3) > n) return 0;
+			len = ((unsigned long long)s[i] << 8) | s[i+1];
+			if ((d=PatchRoom(p,len)) < 0) return 0;
+			memset(p->data+d,s[i+2],(size_t)len);
+			if (!PatchPut(p,ofs,(size_t)d,len)) return 0;
+			i += 3;
+		}
+	}
+
+	/* the truncation extension */
+	i += 3;
+	if ((i + 3) <= n) p->size = ((long long)s[i] << 16) | ((long long)s[i+1] << 8) | s[i+2];
+	return 1;
+}
+
+static int PatchText(Patch *p,const unsigned char *s,size_t n)
+{
+	const unsigned char *l,*e,*c;
+	unsigned long long ofs;
+	long long d,got;
+	char *x;
+	int half;
+
+	for (l=s;l < (s + n);l=e+1) {
+		if ((e=(const unsigned char*)memchr(l,'\n',(s + n) - l)) == NULL) e = s + n;
+		while (l < e && isspace(*l)) l++;
+		if (l == e || *l == '#') continue;
+
+		if ((c=(const unsigned char*)memchr(l,':',e - l)) == NULL) return 0;
+		if ((c - l) == 4 && !strncasecmp((const char*)l,"size",4)) {
+			p->size = (long long)strtoull((const char*)c+1,&x,0);
+			continue;
+		}
+		ofs = strtoull((const char*)l,&x,16);
+		while (x < (const char*)c && *x == ' ') x++;
+		if (x != (const char*)c) return 0;
+
+		half = -1;
+		if ((d=PatchRoom(p,(e - c) / 2)) < 0) return 0;
+		if ((got=TxUnhex(p->data+d,(const char*)c+1,e - c - 1,&half)) <= 0 || half >= 0) return 0;
+		if (!PatchPut(p,ofs,(size_t)d,(unsigned long long)got)) return 0;
+	}
+
+	return 1;
+}
+
+static int PatchVar(const unsigned char *s,size_t n,size_t *i,unsigned long long *v)
+{
+	unsigned long long sh = 1;
+	unsigned char x;
+
+	for (*v=0;;) {
+		if (*i >= n) return 0;
+		x = s[(*i)++];
+		*v += (unsigned long long)(x & 0x7F) * sh;
+		if (x & 0x80) return 1;
+		sh <<= 7;
+		*v += sh;
+	}
+}
+
+/* copy "len" bytes of the target being built from "t" to "at" */
+static int PatchTargetCopy(Patch *p,unsigned long long t,unsigned long long at,unsigned long long len)
+{
+	unsigned long long k;
+	size_t lo,hi,mid;
+	PatchRec *r;
+	long long d;
+
+	while (len > 0) {
+		/* which record holds t, the last one most likely */
+		r = p->nrecs ? p->recs + p->nrecs - 1 : NULL;
+		if (r && t < r->ofs) {
+			for (lo=0,hi=p->nrecs;lo < hi;) {
+				mid = (lo + hi) / 2;
+				if (p->recs[mid].ofs <= t)	lo = mid + 1;
+				else				hi = mid;
+			}
+			r = lo > 0 ? p->recs + lo - 1 : NULL;
+		}
+
+		/* never past what is there so far, which makes overlapping copies repeat */
+		k = (at - t) < len ? at - t : len;
+		if (r && t >= r->ofs && t < (r->ofs + r->len)) {
+			if (k > (r->ofs + r->len - t)) k = r->ofs + r->len - t;
+			if ((d=PatchRoom(p,k)) < 0) return 0;
+			memcpy(p->data+d,p->data+r->data+(t - r->ofs),(size_t)k);
+		}
+		else {
+			/* bytes no record has touched are still the file's own */
+			r = (r && t >= r->ofs) ? r + 1 : p->recs;
+			if (r < (p->recs + p->nrecs) && k > (r->ofs - t)) k = r->ofs - t;
+			if ((d=PatchRoom(p,k)) < 0) return 0;
+			if (FaBulkRead(t,(size_t)k,p->data+d) != (size_t)k) return 0;
+		}
+		if (!PatchPut(p,at,(size_t)d,k)) return 0;
+		t += k;
+		at += k;
+		len -= k;
+	}
+
+	return 1;
+}
+
+static int PatchBps(Patch *p,const unsigned char *s,size_t n)
+{
+	unsigned long long ssize,tsize,meta,v,len,at,srel,trel;
+	char want[16],have[80];
+	size_t i = 4,end;
+	long long d;
+
+	if (n < 16 || Crc(HASH_CRC32,0,s,n - 4) != PatchLe32(s+n-4)) {
+		p->why = "Patch checksum mismatch";
+		return 0;
+	}
+	end = n - 12;
+	if (!PatchVar(s,end,&i,&ssize) || !PatchVar(s,end,&i,&tsize) || !PatchVar(s,end,&i,&meta) || (end - i) < meta) return 0;
+	i += (size_t)meta;
+
+	sprintf(want,"%08x",PatchLe32(s+n-12));
+	if (ssize != file_size || !HashRange("crc32",0,file_size,have) || strcmp(want,have)) {
+		p->why = "Patch is for a different file";
+		return 0;
+	}
+
+	for (at=srel=trel=0;i < end;at += len) {
+		if (!PatchVar(s,end,&i,&v)) return 0;
+		len = (v >> 2) + 1;
+		if ((at + len) > tsize) return 0;
+
+		switch (v & 3) {
+		case 0:		/* source read: the file already has those */
+			if ((at + len) > ssize) return 0;
+			break;
+		case 1:		/* target read */
+			if ((end - i) < len || !PatchBytes(p,at,s+i,len)) return 0;
+			i += (size_t)len;
+			break;
+		case 2:		/* source copy */
+			if (!PatchVar(s,end,&i,&v)) return 0;
+			srel += (v & 1) ? -(v >> 1) : (v >> 1);
+			if (srel > ssize || (ssize - srel) < len) return 0;
+			if (srel != at) {
+				if ((d=PatchRoom(p,len)) < 0 || FaBulkRead(srel,(size_t)len,p->data+d) != (size_t)len) return 0;
+				if (!PatchPut(p,at,(size_t)d,len)) return 0;
+			}
+			srel += len;
+			break;
+		default:	/* target copy */
+			if (!PatchVar(s,end,&i,&v)) return 0;
+			trel += (v & 1) ? -(v >> 1) : (v >> 1);
+			if (trel >= at || !PatchTargetCopy(p,trel,at,len)) return 0;
+			trel += len;
+			break;
+		}
+	}
+
+	if (at != tsize) return 0;
+	p->size = (long long)tsize;
+	return 1;
+}
+
+static int PatchKeyCmp(const void *a,const void *b)
+{
+	const PatchKey *x = (const PatchKey*)a,*y = (const PatchKey*)b;
+
+	if (x->ofs != y->ofs) return x->ofs < y->ofs ? -1 : 1;
+	return x->rec < y->rec ? -1 : (x->rec > y->rec ? 1 : 0);
+}
+
+/* put the records on disk. returns the bytes written or -1 */
+static long long PatchWrite(Patch *p)
+{
+	unsigned long long e,uend,total,size;
+	PatchSpan *spans = NULL;
+	unsigned char *sb = NULL;
+	PatchKey *keys = NULL;
+	size_t i,ns;
+	PatchRec *r;
+	int ok = 0;
+
+	size = fa_size;
+	if (p->nrecs > 0) {
+		if ((keys=(PatchKey*)malloc(sizeof(PatchKey) * p->nrecs)) == NULL ||
+			(spans=(PatchSpan*)malloc(sizeof(PatchSpan) * p->nrecs)) == NULL) goto done;
+		for (i=0;i < p->nrecs;i++) {
+			keys[i].ofs = p->recs[i].ofs;
+			keys[i].rec = i;
+		}
+		qsort(keys,p->nrecs,sizeof(PatchKey),PatchKeyCmp);
+	}
+
+	/* gather the records into spans */
+	for (ns=0,total=0,uend=0,i=0;i < p->nrecs;i++) {
+		r = p->recs + keys[i].rec;
+		e = r->ofs + r->len;
+		if (ns > 0 && r->ofs <= (spans[ns-1].ofs + spans[ns-1].len + PATCH_GAP)) {
+			if (r->ofs > uend) spans[ns-1].gaps = 1;
+			if (e > (spans[ns-1].ofs + spans[ns-1].len)) {
+				total += e - (spans[ns-1].ofs + spans[ns-1].len);
+				spans[ns-1].len = e - spans[ns-1].ofs;
+			}
+		}
+		else {
+			spans[ns].ofs = r->ofs;
+			spans[ns].len = r->len;
+			spans[ns].buf = (size_t)total;
+			spans[ns].gaps = 0;
+			total += r->len;
+			ns++;
+		}
+		if (e > uend) uend = e;
+		r->span = (int)(ns - 1);
+	}
+
+	if (total != 0 && (sb=(unsigned char*)malloc((size_t)total)) == NULL) goto done;
+
+	/* what lies between records comes from the file, then each record in the order given */
+	for (i=0;i < ns;i++) {
+		if (!spans[i].gaps) continue;
+		memset(sb+spans[i].buf,0,(size_t)spans[i].len);
+		FaBulkRead(spans[i].ofs,(size_t)spans[i].len,sb+spans[i].buf);
+	}
+	for (i=0;i < p->nrecs;i++) {
+		r = p->recs + i;
+		if (r->len) memcpy(sb+spans[r->span].buf+(r->ofs - spans[r->span].ofs),p->data+r->data,(size_t)r->len);
+	}
+
+	for (i=0;i < ns;i++) {
+		if (FaIoWrite(file_fd,sb+spans[i].buf,(size_t)spans[i].len,spans[i].ofs) != (ssize_t)spans[i].len) goto done;
+		if ((spans[i].ofs + spans[i].len) > size) size = spans[i].ofs + spans[i].len;
+	}
+	if (p->size >= 0 && (unsigned long long)p->size != size) {
+		if (ftruncate(file_fd,(off_t)p->size) < 0) goto done;
+		size = (unsigned long long)p->size;
+	}
+	ok = 1;
+
+done:
+	/* whatever happened, the file may not be what the cache thinks */
+	FaExtReset();
+	FaCacheFlush();
+	file_size = fa_size = ok ? size : (unsigned long long)StatLseek(file_fd,0,SEEK_END);
+	free(sb);
+	free(spans);
+	free(keys);
+	return ok ? (long long)total : -1;
+}
+
+/* apply the patch in "path" to the file. returns the number of bytes
+ * written, or -1 with *why saying what went wrong */
+long long PatchApply(const char *path,const char **why)
+{
+	unsigned char *s = NULL,*ns;
+	size_t n = 0,a = 0;
+	long long ret = -1;
+	ssize_t rd;
+	Patch p;
+	int fd,ok;
+
+	memset(&p,0,sizeof(p));
+	p.size = -1;
+	*why = "Bad patch";
+	if (file_fd < 0 || !(file_mode & O_RDWR) || EdDirty()) {
+		*why = "File must be open read-write with no unwritten changes";
+		return -1;
+	}
+	if ((fd=open(path,O_RDONLY)) < 0) {
+		*why = "Unable to open patch";
+		return -1;
+	}
+
+	/* the whole patch, read a megabyte at a time */
+	for (;;) {
+		if ((n + PATCH_CHUNK) > a) {
+			if ((ns=(unsigned char*)realloc(s,a + PATCH_CHUNK)) == NULL) {
+				rd = -1;
+				break;
+			}
+			s = ns;
+			a += PATCH_CHUNK;
+		}
+		if ((rd=read(fd,s+n,a - n)) <= 0) break;
+		n += (size_t)rd;
+	}
+	close(fd);
+	if (rd < 0 || s == NULL || (ns=(unsigned char*)realloc(s,n + 1)) == NULL) {
+		free(s);
+		*why = "Unable to read patch";
+		return -1;
+	}
+	s = ns;
+	s[n] = 0;		/* for strtoull() at the end of a text patch */
+
+	CrcInit();
+	TxInit();
+	if (n >= 8 && !memcmp(s,"PATCH",5))		ok = PatchIps(&p,s,n);
+	else if (n >= 4 && !memcmp(s,"BPS1",4))		ok = PatchBps(&p,s,n);
+	else						ok = PatchText(&p,s,n);
+	free(s);
+
+	if (!ok) {
+		if (p.why) *why = p.why;
+	}
+	else if ((ret=PatchWrite(&p)) < 0) {
+		*why = "Error writing file";
+	}
+
+	free(p.recs);
+	free(p.data);
+	return ret;
+}
+
+/* patch output, buffered, with the CRC of everything written for BPS */
+typedef struct PatchOut {
+	int			fmt;
+	int			fd,ofd;		/* the patch, the other file */
+	unsigned char		buf[65536];
+	size_t			len;
+	unsigned int		crc;
+	int			failed;
+	unsigned long long	rofs;		/* pending run of changed bytes */
+	unsigned char		*run;
+	size_t			rlen,rmax;
+	unsigned long long	bpos;		/* BPS output position */
+	unsigned long long	nrecs;
+} PatchOut;
+
+static void PoFlush(PatchOut *o)
+{
+	o->crc = Crc(HASH_CRC32,o->crc,o->buf,o->len);
+	if (o->len != 0 && write(o->fd,o->buf,o->len) != (ssize_t)o->len) o->failed = 1;
+	o->len = 0;
+}
+
+static void PoPut(PatchOut *o,const void *s,size_t n)
+{
+	size_t k;
+
+	for (;n > 0;n -= k,s = (const unsigned char*)s + k) {
+		if (o->len == sizeof(o->buf)) PoFlush(o);
+		k = (sizeof(o->buf) - o->len) < n ? sizeof(o->buf) - o->len : n;
+		memcpy(o->buf+o->len,s,k);
+		o->len += k;
+	}
+}
+
+static void PoVar(PatchOut *o,unsigned long long v)
+{
+	unsigned char b[12];
+	int n = 0;
+
+	for (;;) {
+		b[n] = (unsigned char)(v & 0x7F);
+		if ((v >>= 7) == 0) {
+			b[n++] |= 0x80;
+			break;
+		}
+		n++;
+		v--;
+	}
+	PoPut(o,b,n);
+}
+
+static void PoLe32(PatchOut *o,unsigned int v)
+{
+	unsigned char b[4];
+
+	b[0] = (unsigned char)v;
+	b[1] = (unsigned char)(v >> 8);
+	b[2] = (unsigned char)(v >> 16);
+	b[3] = (unsigned char)(v >> 24);
+	PoPut(o,b,4);
+}
+
+static void PoIpsRecord(PatchOut *o,unsigned long long ofs,const unsigned char *s,size_t n,int rle)
+{
+	unsigned char h[8],c;
+
+	/* a record at "EOF" would end the patch: the first byte goes in a
+	 * record of its own starting a byte early */
+	if (ofs == PATCH_IPS_EOF) {
+		if (pread(o->ofd,&c,1,(off_t)(ofs - 1)) != 1) o->failed = 1;
+		h[0] = (unsigned char)((ofs - 1) >> 16); h[1] = (unsigned char)((ofs - 1) >> 8); h[2] = (unsigned char)(ofs - 1);
+		h[3] = 0; h[4] = 2; h[5] = c; h[6] = s[0];
+		PoPut(o,h,7);
+		o->nrecs++;
+		if (--n == 0) return;
+		ofs++;
+		if (!rle) s++;
+	}
+
+	h[0] = (unsigned char)(ofs >> 16); h[1] = (unsigned char)(ofs >> 8); h[2] = (unsigned char)ofs;
+	if (rle) {
+		h[3] = h[4] = 0;
+		h[5] = (unsigned char)(n >> 8); h[6] = (unsigned char)n; h[7] = s[0];
+		PoPut(o,h,8);
+	}
+	else {
+		h[3] = (unsigned char)(n >> 8); h[4] = (unsigned char)n;
+		PoPut(o,h,5);
+		PoPut(o,s,n);
+	}
+	o->nrecs++;
+}
+
+/* write out the pending run of changed bytes */
+static void PoRun(PatchOut *o)
+{
+	unsigned long long ofs = o->rofs;
+	const unsigned char *s = o->run;
+	char line[96];
+	size_t n = o->rlen,i,j,k,m;
+
+	if (n == 0) return;
+	o->rlen = 0;
+
+	if (o->fmt == PATCH_BPS) {
+		if (ofs > o->bpos) PoVar(o,((ofs - o->bpos - 1) << 2) | 0);
+		PoVar(o,((unsigned long long)(n - 1) << 2) | 1);
+		PoPut(o,s,n);
+		o->bpos = ofs + n;
+		o->nrecs++;
+	}
+	else if (o->fmt == PATCH_TEXT) {
+		for (;n > 0;n -= k,s += k,ofs += k) {
+			k = n < 32 ? n : 32;
+			i = (size_t)sprintf(line,"%llx: ",ofs);
+			TxHex(line+i,s,k);
+			line[i+(k*2)] = '\n';
+			PoPut(o,line,i + (k*2) + 1);
+			o->nrecs++;
+		}
+	}
+	else {
+		/* IPS: runs of 16 or more of one byte as RLE records */
+		for (i=0;i < n;) {
+			for (j=i;j < n;j++) {
+				for (k=j;k < n && s[k] == s[j] && (k - j) < 0xFFFF;) k++;
+				if ((k - j) >= 16) break;
+				j = k - 1;
+			}
+			for (;i < j;i += m) {
+				m = (j - i) < 0xFFFF ? j - i : 0xFFFF;
+				PoIpsRecord(o,ofs + i,s+i,m,0);
+			}
+			if (j < n) {
+				PoIpsRecord(o,ofs + j,s+j,k - j,1);
+				i = k;
+			}
+		}
+	}
+}
+
+/* bytes "s" of the other file at "ofs" differ */
+static void PoDiff(PatchOut *o,unsigned long long ofs,const unsigned char *s,size_t n)
+{
+	size_t k;
+
+	if (o->rlen != 0 && (o->rofs + o->rlen) != ofs) PoRun(o);
+	for (;n > 0;n -= k,s += k,ofs += k) {
+		if (o->rlen == o->rmax) PoRun(o);
+		if (o->rlen == 0) o->rofs = ofs;
+		k = (o->rmax - o->rlen) < n ? o->rmax - o->rlen : n;
+		memcpy(o->run+o->rlen,s,k);
+		o->rlen += k;
+	}
+}
+
+/* write a patch to "out" that turns the file into "other": IPS if "out"
+ * ends in .ips, BPS for .bps, text otherwise. returns the number of
+ * records or -1 with *why set */
+long long PatchCreate(const char *other,const char *out,const char **why)
+{
+	unsigned long long osize,pos,k,i,j,gap,ecount;
+	unsigned char *a = NULL,*b = NULL;
+	char hex[80],line[64];
+	unsigned int tcrc = 0;
+	const char *x;
+	size_t na;
+	PatchOut *o;
+	ssize_t nb;
+
+	if ((o=(PatchOut*)calloc(1,sizeof(PatchOut))) == NULL) {
+		*why = "Out of memory";
+		return -1;
+	}
+	x = strrchr(out,'.');
+	o->fmt = x && !strcasecmp(x,".ips") ? PATCH_IPS : (x && !strcasecmp(x,".bps") ? PATCH_BPS : PATCH_TEXT);
+	o->rmax = o->fmt == PATCH_IPS ? 0xFFFF * 16 : PATCH_CHUNK;
+	gap = o->fmt == PATCH_IPS ? 6 : (o->fmt == PATCH_BPS ? 4 : 8);	/* cheaper to repeat than to start over */
+
+	*why = "Unable to open file";
+	if ((o->ofd=open(other,O_RDONLY)) < 0) {
+		free(o);
+		return -1;
+	}
+	osize = (unsigned long long)lseek(o->ofd,0,SEEK_END);
+	if (o->fmt == PATCH_IPS && (osize > PATCH_IPS_MAX || file_size > PATCH_IPS_MAX)) {
+		*why = "Too big for IPS";
+		close(o->ofd);
+		free(o);
+		return -1;
+	}
+
+	o->run = (unsigned char*)malloc(o->rmax);
+	a = (unsigned char*)malloc(PATCH_CHUNK);
+	b = (unsigned char*)malloc(PATCH_CHUNK);
+	if (!o->run || !a || !b || (o->fd=open(out,O_WRONLY | O_CREAT | O_TRUNC,0644)) < 0) {
+		*why = !o->run || !a || !b ? "Out of memory" : "Unable to create patch";
+		o->failed = 2;
+		goto done;
+	}
+
+	CrcInit();
+	TxInit();
+	if (o->fmt == PATCH_IPS) {
+		PoPut(o,"PATCH",5);
+	}
+	else if (o->fmt == PATCH_BPS) {
+		PoPut(o,"BPS1",4);
+		PoVar(o,file_size);
+		PoVar(o,osize);
+		PoVar(o,0);
+	}
+
+	for (pos=0;pos < osize && !o->failed;pos += k) {
+		k = (osize - pos) < PATCH_CHUNK ? osize - pos : PATCH_CHUNK;
+		na = FaBulkRead(pos,(size_t)k,a);
+		if ((nb=pread(o->ofd,b,(size_t)k,(off_t)pos)) != (ssize_t)k) {
+			o->failed = 1;
+			break;
+		}
+		tcrc = Crc(HASH_CRC32,tcrc,b,(size_t)k);
+
+		/* runs that differ, with short equal stretches between them folded in */
+		for (i=CmpFirst(a,b,na);i < k;i=j+CmpFirst(a+j,b+j,na > j ? na - j : 0)) {
+			for (j=i,ecount=0;j < k;j++) {
+				if (j < na && a[j] == b[j]) {
+					if (++ecount >= gap) break;
+				}
+				else {
+					ecount = 0;
+				}
+			}
+			if (j < k) j = j + 1 - ecount;
+			PoDiff(o,pos + i,b+i,(size_t)(j - i));
+			if (j >= na) break;
+		}
+	}
+	PoRun(o);
+
+	if (o->fmt == PATCH_IPS) {
+		PoPut(o,"EOF",3);
+		if (osize < file_size) {
+			line[0] = (char)(osize >> 16);
+			line[1] = (char)(osize >> 8);
+			line[2] = (char)osize;
+			PoPut(o,line,3);
+		}
+	}
+	else if (o->fmt == PATCH_BPS) {
+		if (osize > o->bpos) PoVar(o,((osize - o->bpos - 1) << 2) | 0);
+		if (!HashRange("crc32",0,file_size,hex)) o->failed = 1;
+		PoLe32(o,(unsigned int)strtoul(hex,NULL,16));
+		PoLe32(o,tcrc);
+		PoFlush(o);
+		PoLe32(o,o->crc);
+	}
+	else if (osize != file_size) {
+		PoPut(o,line,(size_t)sprintf(line,"size: %llu\n",osize));
+	}
+	PoFlush(o);
+	if (close(o->fd) < 0) o->failed = 1;
+	if (o->failed) *why = "Error writing patch";
+
+done:
+	close(o->ofd);
+	free(a);
+	free(b);
+	free(o->run);
+	k = o->nrecs;
+	i = o->failed;
+	free(o);
+	return i ? -1 : (long long)k;
+}
+
+/* terminal output buffer.
+ * everything drawn for a frame (cursor moves, colors, rows, the status
+ * line) is appended here and goes out with one write() in TermFlush(). */
+int			term_out_fd = 1;
+int			term_sync = 0;			/* wrap frames in synchronized update mode */
+int			batch_mode = 0;			/* -batch: no terminal, nothing is drawn */
+unsigned long long	term_frame_bytes = 0;		/* bytes sent by the last frame */
+unsigned long long	term_total_bytes = 0;
+static char		*term_out = NULL;
+static size_t		term_out_len = 0;
+static size_t		term_out_alloc = 0;
+static size_t		term_frame_start = 0;
+static char		term_in_frame = 0;
+static double		term_frame_began = 0;
+
+void TermPut(const char *s,size_t len)
+{
+	size_t na;
+	char *p;
+
+	if (batch_mode) return;
+	if ((term_out_len + len) > term_out_alloc) {
+		na = term_out_alloc ? term_out_alloc : 16384;
+		while (na < (term_out_len + len)) na *= 2;
+		if ((p=(char*)realloc(term_out,na)) == NULL) return;
+		term_out = p;
+		term_out_alloc = na;
+	}
+
+	memcpy(term_out+term_out_len,s,len);
+	term_out_len += len;
+}
+
+void TermPuts(const char *s)
+{
+	TermPut(s,strlen(s));
+}
+
+void TermPrintf(const char *fmt,...)
+{
+	char buf[512];
+	va_list va;
+	int l;
+
+	va_start(va,fmt);
+	l = vsnprintf(buf,sizeof(buf),fmt,va);
+	va_end(va);
+	if (l < 0) return;
+	if (l >= (int)sizeof(buf)) l = sizeof(buf) - 1;
+	TermPut(buf,l);
+}
+
+/* send everything buffered so far to the terminal */
+void TermFlush()
+{
+	size_t o;
+	ssize_t w;
+
+	for (o=0;o < term_out_len;o += w) {
+		w = write(term_out_fd,term_out+o,term_out_len-o);
+		stat_total.term_writes++;
+		if (w <= 0) break;
+	}
+
+	term_total_bytes += term_out_len;
+	stat_total.term_bytes += term_out_len;
+	term_out_len = 0;
+	term_frame_start = 0;
+}
+
+void TermFrameBegin()
+{
+	if (term_in_frame) return;
+	term_in_frame = 1;
+	term_frame_start = term_out_len;
+	term_frame_began = JobNow();
+	stat_frame0 = stat_total;
+	if (term_sync) TermPuts("\x1B[?2026h");
+}
+
+void TermFrameEnd()
+{
+	if (!term_in_frame) return;
+	if (term_sync) TermPuts("\x1B[?2026l");
+	term_in_frame = 0;
+	term_frame_bytes = term_out_len - term_frame_start;
+	TermFlush();
+	StatFrame(JobNow() - term_frame_began);
+}
+
+/* console setup code */
+int TermSetup()
+{
+	struct termios t;
+	const char *nowrap = "\x1B[?7l";
+
+	/* get STDIN to send us all input UNBUFFERED */
+	if (tcgetattr(0,&t) < 0) return 0;
+	t.c_lflag &= ~(ICANON | ECHO | ECHOE);
+	if (tcsetattr(0,TCSAFLUSH,&t) < 0) return 0;
+
+	/* disable wrap-around */
+	TermPuts(nowrap);
+	TermFlush();
+
+	return 1;
+}
+
+int TermReset()
+{
+	struct termios t;
+
+	if (tcgetattr(0,&t) < 0) return 0;
+	t.c_lflag |= ICANON | ECHO | ECHOE;
+	if (tcsetattr(0,TCSAFLUSH,&t) < 0) return 0;
+	return 1;
+}
+
+int TermEcho(int x)
+{
+	struct termios t;
+
+	if (tcgetattr(0,&t) < 0) return 0;
+	if (x)	t.c_lflag |= ECHO | ECHOE;
+	else	t.c_lflag &= ~(ECHO | ECHOE);
+	if (tcsetattr(0,TCSADRAIN,&t) < 0) return 0;
+	return 1;
+}
+
+/* keyboard input.
+ * everything the terminal has sent is read into term_in with one read()
+ * and keys are decoded from there, so a burst of auto-repeat costs one
+ * system call instead of one per byte. the main loop uses TermMovePending()
+ * to skip drawing while more movement keys are already waiting. */
+#define TERM_IN_MAX		4096
+#define TERM_FRAME_MIN		(1.0 / 30)	/* draw at least this often while keys pile up */
+
+static char		term_in[TERM_IN_MAX];
+static int		term_in_len = 0;
+static int		term_in_pos = 0;
+double			term_frame_time = 0;		/* when the last frame was drawn */
+double			term_idle = 0;			/* give up waiting for a key after this long */
+int			term_resize_wakes = 0;		/* a SIGWINCH ends the wait for a key */
+volatile sig_atomic_t	term_resized = 0;		/* SIGWINCH seen, TermResize() not yet run */
+static sigset_t		term_wake_mask;			/* signal mask while waiting, SIGWINCH let through */
+static int		term_wake_set = 0;
+
+/* read whatever input is available into term_in, waiting for some if
+ * "wait" is set (for up to term_idle seconds if that is set). SIGWINCH is
+ * kept blocked and only let through while pselect() waits with
+ * term_resize_wakes set, so one that comes in while a frame is drawn ends
+ * the next wait instead of being missed. returns the bytes added. */
+static int TermFill(int wait)
+{
+	struct timespec ts;
+	fd_set fds;
+	ssize_t rd;
+
+	if (term_in_pos > 0) {
+		memmove(term_in,term_in+term_in_pos,term_in_len-term_in_pos);
+		term_in_len -= term_in_pos;
+		term_in_pos = 0;
+	}
+	if (term_in_len >= TERM_IN_MAX) return 0;
+
+	if (!wait || term_idle > 0 || (term_resize_wakes && term_wake_set)) {
+		FD_ZERO(&fds);
+		FD_SET(0,&fds);
+		ts.tv_sec = wait ? (long)term_idle : 0;
+		ts.tv_nsec = wait ? (long)((term_idle - (long)term_idle) * 1e9) : 0;
+		if (pselect(1,&fds,NULL,NULL,(wait && term_idle <= 0) ? NULL : &ts,
+			(term_resize_wakes && term_wake_set) ? &term_wake_mask : NULL) <= 0) return 0;
+	}
+
+	rd = read(0,term_in+term_in_len,TERM_IN_MAX-term_in_len);
+	if (rd <= 0) return 0;
+	term_in_len += (int)rd;
+	return (int)rd;
+}
+
+/* length of the key at the front of term_in, 0 if it isn't all there yet */
+static int TermKeyLen()
+{
+	int n = term_in_len - term_in_pos,i;
+	const char *k = term_in + term_in_pos;
+
+	if (n < 1) return 0;
+	if (k[0] != 27) return 1;
+	if (n < 2) return 0;
+	if (k[1] != '[') return 2;		/* ESC ESC or ESC whatever */
+
+	/* ESC[ means a VT100 scan code, digits and ';' up to a final char */
+	for (i=2;i < n && i < 31;i++)
+		if (!(isdigit((unsigned char)k[i]) || k[i] == ';')) return i+1;
+
+	return i >= 31 ? 31 : 0;
+}
+
+static char TermBuf[32];
+char *TermRead()
+{
+	int n;
+
+	/* nobody to press ENTER in batch mode */
+	if (batch_mode) return "\n";
+
+	/* anything we drew should be visible before we wait for a key */
+	TermFlush();
+
+	/* a resize only interrupts the wait if the caller is going to redraw,
+	 * prompts waiting for a single key keep waiting */
+	TermBuf[0]=0;
+	while ((n=TermKeyLen()) == 0) {
+		if (term_resized && term_resize_wakes) return TermBuf;
+		if (TermFill(1) < 1 && (!term_resized || term_resize_wakes)) return TermBuf;
+	}
+
+	memcpy(TermBuf,term_in+term_in_pos,n);
+	TermBuf[n]=0;
+	term_in_pos += n;
+	return TermBuf;
+}
+
+/* is this a key that only moves the cursor? */
+int TermMoveKey(const char *k)
+{
+	return	!strcmp(k,"\x1B[A") || !strcmp(k,"\x1B[B") ||
+		!strcmp(k,"\x1B[C") || !strcmp(k,"\x1B[D") ||
+		!strcmp(k,"\x1B[5~") || !strcmp(k,"\x1B[6~") ||
+		!strcmp(k,"\x1B[1~") || !strcmp(k,"\x1B[4~");
+}
+
+/* is a movement key already waiting, without blocking? */
+int TermMovePending()
+{
+	char k[32];
+	int n;
+
+	TermFill(0);
+	if ((n=TermKeyLen()) == 0) return 0;
+	memcpy(k,term_in+term_in_pos,n);
+	k[n]=0;
+	return TermMoveKey(k);
+}
+
+int TermPosCurs(int y,int x)
+{
+	char buf[16];
+
+	if (x < 1) x=1;
+	if (y < 1) y=1;
+	if (x > con_width) x=con_width;
+	if (y > con_height) y=con_height;
+
+	sprintf(buf,"\x1b[%d;%df",y,x);
+	TermPuts(buf);
+	return 1;
+}
+
+/* terminal size.
+ * the kernel knows it for a tty (TIOCGWINSZ), which costs one ioctl and
+ * no round trip. only when it doesn't (a serial line, say) ask the
+ * terminal where the cursor ends up after sending it to 255,255, giving up
+ * after TERM_QUERY_WAIT seconds without an answer. SIGWINCH only raises
+ * term_resized, the main loop picks the new size up in TermResize() before
+ * it draws the next frame. */
+#define TERM_QUERY_WAIT		0.5
+
+static void TermWinch(int sig)
+{
+	(void)sig;
+	term_resized = 1;
+}
+
+/* the size the kernel has for the terminal, 0 if it has none */
+static int TermWinSize(int *w,int *h)
+{
+	struct winsize ws;
+
+	if ((ioctl(1,TIOCGWINSZ,&ws) < 0 && ioctl(0,TIOCGWINSZ,&ws) < 0) ||
+		ws.ws_col == 0 || ws.ws_row == 0) return 0;
+	*w = ws.ws_col < 16 ? 16 : ws.ws_col;
+	*h = ws.ws_row < 4 ? 4 : ws.ws_row;
+	return 1;
+}
+
+/* wait for a cursor position report, NULL if none comes in time */
+static char *TermQueryPos()
+{
+	double idle = term_idle;
+	char *r;
+
+	term_idle = TERM_QUERY_WAIT;
+	do { r=TermRead(); } while (r[0] && r[0] != 27);
+	term_idle = idle;
+	return r[0] ? r : NULL;
+}
+
+int TermSize()
+{
+	const char *rq = "\x1b[6n";		/* "ESC [ 6n" cursor position request */
+	const char *rqcm = "\x1b[255;255f";	/* tell it to put the cursor down to 255,255 or as far as it goes */
+	struct sigaction sa;
+	sigset_t set;
+	char *r,*r2;
+	char buf[32];
+	int ox,oy;
+
+	/* no SA_RESTART, a resize should wake up a wait for a key. blocked
+	 * before any threads start, so they all inherit it and only
+	 * TermFill()'s pselect() takes it */
+	memset(&sa,0,sizeof(sa));
+	sa.sa_handler = TermWinch;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGWINCH,&sa,NULL);
+	sigemptyset(&set);
+	sigaddset(&set,SIGWINCH);
+	if (!term_wake_set && pthread_sigmask(SIG_BLOCK,&set,&term_wake_mask) == 0) {
+		sigdelset(&term_wake_mask,SIGWINCH);
+		term_wake_set = 1;
+	}
+
+	if (TermWinSize(&con_width,&con_height)) {
+		CmpLayout();
+		return 1;
+	}
+
+	/* print notice */
+	fprintf(stderr,"querying terminal..."); fflush(stderr);
+
+	/* current cursor position? */
+	TermPuts(rq);
+	if ((r=TermQueryPos()) == NULL) {
+		fprintf(stderr,"\x0D");
+		return 0;
+	}
+	oy=atoi(r+2); r2=strstr(r,";");
+	ox=r2 ? atoi(r2+1) : 1;
+
+	/* how far can we go? */
+	TermPuts(rqcm);
+	TermPuts(rq);
+	if ((r=TermQueryPos()) == NULL) {
+		fprintf(stderr,"\x0D");
+		return 0;
+	}
+	con_height = atoi(r+2); r2=strstr(r,";");
+	con_width = r2 ? atoi(r2+1) : 1;
+
+	/* restore cursor */
+	sprintf(buf,"\x1b[%d;%dH",oy,ox);
+	TermPuts(buf);
+	TermFlush();
+
+	/* sanity check */
+	if (con_width < 16) con_width = 16;
+	if (con_height < 4) con_height = 4;
+
+	/* print it to the console */
+	fflush(stderr);
+	fprintf(stderr,"\x0D");
+	fflush(stderr);
+	fprintf(stderr,"console size: %d rows x %d cols\n",con_height,con_width);
+	CmpLayout();
+
+	return 1;
+}
+
+void TermSizeSet(int w,int h)
+{
+	con_width = w;
+	con_height = h;
+	CmpLayout();
+}
+
+/* after a SIGWINCH: take the new size and have the next frame drawn from
+ * scratch. the cursor stays on the same byte, ViewOfsToCoord() moves the
+ * view around it. returns 1 if the size changed */
+int TermResize()
+{
+	int w,h;
+
+	term_resized = 0;
+	if (!TermWinSize(&w,&h) || (w == con_width && h == con_height)) return 0;
+	TermSizeSet(w,h);
+	if (view_map_sel >= (int)view_rows) view_map_sel = view_rows - 1;
+	TermPuts("\x1B[2J");
+	viewup_all = 1;
+	return 1;
+}
+
+/* shadow screen.
+ * scr_text/scr_attr hold what the terminal is showing in the view rows.
+ * DrawRow() composes a row into scr_row_text/scr_row_attr and
+ * ScrRowCommit() sends only the cells that differ from the shadow. moving
+ * the view by less than a screen scrolls the terminal instead. */
+enum {				SA_BLANK=0,
+				SA_ROW=1,
+				SA_CURROW=2,
+				SA_DIFF=3,
+				SA_CURDIFF=4,
+				SA_TITLE=5,
+				SA_MAP0=6,
+				SA_MAP1=7,
+				SA_MAP2=8,
+				SA_MAP3=9,
+				SA_MAPSEL=10,
+				SA_HOLE=11,
+				SA_INVALID=255 };
+
+static const char		*scr_sgr[] = {
+	"\x1B[0m",			/* SA_BLANK */
+	"\x1B[0;36m",			/* SA_ROW */
+	"\x1B[0;1;37m",		/* SA_CURROW */
+	"\x1B[0;1;31m",		/* SA_DIFF */
+	"\x1B[0;1;37;41m",		/* SA_CURDIFF */
+	"\x1B[0;7m",			/* SA_TITLE */
+	"\x1B[0;37;44m",		/* SA_MAP0, entropy under 2 bits */
+	"\x1B[0;30;42m",		/* SA_MAP1, under 5 */
+	"\x1B[0;30;43m",		/* SA_MAP2, under 7 */
+	"\x1B[0;1;37;41m",		/* SA_MAP3 */
+	"\x1B[0;1;7m",			/* SA_MAPSEL */
+	"\x1B[0;2;34m"			/* SA_HOLE */
+};
+
+static unsigned char		*scr_text = NULL;
+static unsigned char		*scr_attr = NULL;
+static unsigned char		*scr_row_text = NULL;
+static unsigned char		*scr_row_attr = NULL;
+static unsigned char		*RowTmp = NULL;
+static int			scr_w = 0;
+static int			scr_h = 0;
+static int			scr_cx = -1;	/* where the terminal cursor is, -1 = unknown */
+static int			scr_cy = -1;
+static int			scr_cur_attr = -1;
+
+/* the layout the shadow rows were drawn with */
+static int			scr_valid = 0;
+static unsigned long long	scr_view_offset;
+static unsigned long long	scr_view_columns;
+static unsigned long long	scr_view_colofs;
+static unsigned long long	scr_view_scrcols;
+static int			scr_view_panels;
+
+void ScrInvalidate()
+{
+	if (scr_attr) memset(scr_attr,SA_INVALID,scr_w*scr_h);
+	scr_valid = 0;
+}
+
+/* (re)allocate the shadow screen for the current console size */
+int ScrSetup()
+{
+	if (scr_w == con_width && scr_h == con_height && scr_text) return 1;
+	scr_w = con_width;
+	scr_h = con_height;
+	scr_text = (unsigned char*)realloc(scr_text,scr_w*scr_h);
+	scr_attr = (unsigned char*)realloc(scr_attr,scr_w*scr_h);
+	/* a composed row may run past the right edge, ScrRowCommit() clips it */
+	scr_row_text = (unsigned char*)realloc(scr_row_text,(scr_w*4)+64);
+	scr_row_attr = (unsigned char*)realloc(scr_row_attr,(scr_w*4)+64);
+	RowTmp = (unsigned char*)realloc(RowTmp,scr_w+64);
+	if (!scr_text || !scr_attr || !scr_row_text || !scr_row_attr || !RowTmp) return 0;
+	ScrInvalidate();
+	return 1;
+}
+
+static void ScrAttr(int a)
+{
+	if (a == scr_cur_attr) return;
+	TermPuts(scr_sgr[a]);
+	scr_cur_attr = a;
+}
+
+/* send the differences between the composed row "len" cells long and
+ * shadow row y, then make the shadow match */
+void ScrRowCommit(int y,int len)
+{
+	unsigned char *ot,*oa;
+	int x,s,e;
+
+	if (y < 0 || y >= scr_h) return;
+	if (len > scr_w) len = scr_w;
+	memset(scr_row_text+len,' ',scr_w-len);
+	memset(scr_row_attr+len,SA_BLANK,scr_w-len);
+	ot = scr_text + (y * scr_w);
+	oa = scr_attr + (y * scr_w);
+
+	x = 0;
+	while (x < scr_w) {
+		if (ot[x] == scr_row_text[x] && oa[x] == scr_row_attr[x]) {
+			x++;
+			continue;
+		}
+
+		/* changed span; short runs of unchanged cells are cheaper to resend than to skip */
+		s = x;
+		for (e=++x;x < scr_w && (x - e) < 8;x++)
+			if (ot[x] != scr_row_text[x] || oa[x] != scr_row_attr[x]) e = x+1;
+		x = e;
+
+		if (scr_cy != y || scr_cx != s) TermPosCurs(y+1,s+1);
+		if (e > len) {
+			/* the rest of the row is blank: erase it instead */
+			for (x=s;x < len;x++) {
+				ScrAttr(scr_row_attr[x]);
+				TermPut((char*)scr_row_text+x,1);
+			}
+			ScrAttr(SA_BLANK);
+			TermPuts("\x1B[K");
+			e = scr_w;
+		}
+		else {
+			for (x=s;x < e;x++) {
+				ScrAttr(scr_row_attr[x]);
+				TermPut((char*)scr_row_text+x,1);
+			}
+		}
+
+		memcpy(ot+s,scr_row_text+s,e-s);
+		memcpy(oa+s,scr_row_attr+s,e-s);
+		scr_cy = y;
+		scr_cx = e < scr_w ? e : -1;
+		x = e;
+	}
+}
+
+/* scroll shadow rows [top,top+rows) and the terminal by n rows, n > 0 moves content up */
+void ScrScroll(int top,int rows,int n)
+{
+	unsigned char *text,*attr;
+	char buf[32];
+	int k;
+
+	k = n < 0 ? -n : n;
+	if (k == 0 || k >= rows) return;
+	text = scr_text + (top * scr_w);
+	attr = scr_attr + (top * scr_w);
+
+	ScrAttr(SA_BLANK);
+	sprintf(buf,"\x1B[%d;%dr",top+1,top+rows);
+	TermPuts(buf);
+	sprintf(buf,"\x1B[%d%c",k,n > 0 ? 'S' : 'T');
+	TermPuts(buf);
+	sprintf(buf,"\x1B[1;%dr",con_height);
+	TermPuts(buf);
+	scr_cx = scr_cy = -1;
+
+	if (n > 0) {
+		memmove(text,text+(k*scr_w),(rows-k)*scr_w);
+		memmove(attr,attr+(k*scr_w),(rows-k)*scr_w);
+		memset(text+((rows-k)*scr_w),' ',k*scr_w);
+		memset(attr+((rows-k)*scr_w),SA_BLANK,k*scr_w);
+	}
+	else {
+		memmove(text+(k*scr_w),text,(rows-k)*scr_w);
+		memmove(attr+(k*scr_w),attr,(rows-k)*scr_w);
+		memset(text,' ',k*scr_w);
+		memset(attr,SA_BLANK,k*scr_w);
+	}
+}
+
+/* put the minimap cell for row y at the right edge of the composed row */
+static int DrawMapCell(int y,int len)
+{
+	int x,level,sel;
+	char c;
+
+	x = scr_w - VIEW_MAP_W;
+	if (len > x) len = x;
+	memset(scr_row_text+len,' ',scr_w-len);
+	memset(scr_row_attr+len,SA_BLANK,scr_w-len);
+
+	c = MapRowClass(y,view_rows,&level);
+	sel = view_tab == 3 ? view_map_sel : MapRowOf(file_cursor,view_rows);
+	scr_row_text[scr_w-1] = (unsigned char)c;
+	scr_row_attr[scr_w-1] = y == sel ? SA_MAPSEL : (level < 0 ? SA_BLANK : SA_MAP0 + level);
+	return scr_w;
+}
+
+/* format the n bytes at "row" for offset o into shadow row y. in compare
+ * mode "other" is the same row of the other file, on bytes long, and the
+ * bytes that differ from it are highlighted */
+static void DrawRowBytes(int y,unsigned long long o,const unsigned char *row,int n,const unsigned char *other,int on,int cur,int hole)
+{
+	int w,i,len,hx,ax;
+	unsigned char a;
+	char *d;
+
+	w = view_scrcols;
+	d = (char*)scr_row_text;
+	FmtOffset(d,o);
+	d[16] = view_colofs != 0 ? '<' : ' ';
+	len = 17 + view_fmtrow(d+17,row,n,w,(w+view_colofs) < view_columns ? '>' : ' ');
+	memset(scr_row_attr,cur ? SA_CURROW : (hole ? SA_HOLE : SA_ROW),len);
+
+	if (cmp_fd >= 0) {
+		a = cur ? SA_CURDIFF : SA_DIFF;
+		hx = view_with_hex ? 17 : -1;
+		ax = view_with_asc ? (view_with_hex ? 17 + (w * 3) + 1 : 17) : -1;
+		for (i=0;i < n;i++) {
+			if (i < on && row[i] == other[i]) continue;
+			if (hx >= 0) scr_row_attr[hx+(i*3)] = scr_row_attr[hx+(i*3)+1] = a;
+			if (ax >= 0) scr_row_attr[ax+i] = a;
+		}
+	}
+
+	if (view_with_map && y < (int)view_rows) len = DrawMapCell(y,len);
+	ScrRowCommit(y,len);
+}
+
+/* bytes of a row at "fo" on screen for a file "size" bytes long */
+static int DrawRowLen(unsigned long long fo,unsigned long long size)
+{
+	int n = 0;
+
+	if (view_colofs < view_columns && fo < size) {
+		n = (int)(view_columns - view_colofs < view_scrcols ? view_columns - view_colofs : view_scrcols);
+		if ((unsigned long long)n > (size - fo)) n = (int)(size - fo);
+	}
+
+	return n;
+}
+
+void DrawRow(int y,unsigned long long o)
+{
+	const unsigned char *row,*crow;
+	unsigned long long fo;
+	int n,cn,len,hole;
+
+	fo = o + view_colofs;
+
+	/* how many bytes of this row are on screen and in the file */
+	n = DrawRowLen(fo,file_size);
+
+	/* rows in a hole are zeros without reading anything, otherwise
+	 * format straight out of the mapping or cache block if we can */
+	if ((hole=FaIsHole(fo,n)) != 0) {
+		memset(RowTmp,0,n);
+		row = RowTmp;
+	}
+	else if ((row=FaMap(fo,n,&len)) == NULL) {
+		FaRead(fo,n,RowTmp);
+		row = RowTmp;
+	}
+
+	if (cmp_fd < 0) {
+		DrawRowBytes(y,o,row,n,NULL,0,y == view_ofs_y,hole);
+		return;
+	}
+
+	/* and the same row of the second file in the bottom half */
+	cn = DrawRowLen(fo,cmp_size);
+	if ((crow=CmpRow(fo,cn,view_scrcols)) == NULL) cn = 0;
+	DrawRowBytes(y,o,row,n,crow,cn,y == view_ofs_y,hole);
+	DrawRowBytes(y+view_rows+1,o,crow,cn,row,n,y == view_ofs_y,0);
+}
+
+/* the bar between the two halves in compare mode */
+void DrawCmpTitle()
+{
+	int len;
+
+	len = snprintf((char*)scr_row_text,scr_w+1," %s  %llu bytes%s",cmp_name,cmp_size,
+		cmp_size != file_size ? " (size differs)" : "");
+	if (len > scr_w) len = scr_w;
+	memset(scr_row_text+len,' ',scr_w-len);
+	memset(scr_row_attr,SA_TITLE,scr_w);
+	ScrRowCommit(view_rows,scr_w);
+}
+
+void ViewRefresh()
+{
+	unsigned long long d;
+	int x,y,w,panels;
+	double t0,t1;
+
+	w = view_scrcols;
+	panels = (view_with_hex ? 1 : 0) | (view_with_asc ? 2 : 0);
+	if (!ScrSetup()) return;
+	t0 = JobNow();
+
+	/* anything written outside of here leaves the cursor and colors unknown */
+	scr_cx = scr_cy = scr_cur_attr = -1;
+
+	if (viewup_all) {
+		ScrInvalidate();
+		viewup_all = 0;
+	}
+	else if (scr_valid && scr_view_columns == view_columns && scr_view_colofs == view_colofs &&
+		scr_view_scrcols == view_scrcols && scr_view_panels == panels && scr_view_offset != view_offset) {
+		/* same layout, moved by whole rows: let the terminal scroll what is still visible */
+		if (view_offset > scr_view_offset) {
+			d = view_offset - scr_view_offset;
+			if ((d % view_columns) == 0 && (d / view_columns) < view_rows) {
+				ScrScroll(0,view_rows,(int)(d / view_columns));
+				if (cmp_fd >= 0) ScrScroll(view_rows+1,view_rows,(int)(d / view_columns));
+			}
+		}
+		else {
+			d = scr_view_offset - view_offset;
+			if ((d % view_columns) == 0 && (d / view_columns) < view_rows) {
+				ScrScroll(0,view_rows,-((int)(d / view_columns)));
+				if (cmp_fd >= 0) ScrScroll(view_rows+1,view_rows,-((int)(d / view_columns)));
+			}
+		}
+	}
+
+	if (view_with_map) MapStart();
+	map_changed = 0;
+	CmpViewLoad(view_offset,view_rows,view_columns,view_colofs,w);
+	t1 = JobNow();
+	for (y=0;y < view_rows;y++)
+		DrawRow(y,view_offset + (y * view_columns));
+	stat_total.draw += JobNow() - t1;
+
+	if (cmp_fd >= 0) {
+		DrawCmpTitle();
+		for (y=(view_rows*2)+1;y < (con_height-1);y++)
+			ScrRowCommit(y,0);
+	}
+
+	scr_valid = 1;
+	scr_view_offset = view_offset;
+	scr_view_columns = view_columns;
+	scr_view_colofs = view_colofs;
+	scr_view_scrcols = view_scrcols;
+	scr_view_panels = panels;
+
+	switch (view_tab) {
+		case 0:		/* offset column */
+			y=view_ofs_y;
+			x=0;
+			break;
+
+		case 1:		/* hex dump column */
+			y=view_ofs_y;
+			x=((view_ofs_x-view_colofs)*3)+17;
+			break;
+
+		case 2:		/* ASCII dump column */
+			y=view_ofs_y;
+			if (view_with_hex)	x=(view_ofs_x-view_colofs)+(w*3)+18;
+			else			x=(view_ofs_x-view_colofs)+17;
+			break;
+
+		case 3:		/* minimap */
+			y=view_map_sel;
+			x=scr_w-1;
+			break;
+
+		default:
+			x=y=0;
+			break;
+	}
+
+	viewcon_x = x;
+	viewcon_y = y;
+	stat_total.refresh += JobNow() - t0;
+}
+
+void ReadInLine(char *buf,int len)
+{
+	int i,so;
+	char *r;
+	char act;
+	const char *erase = "\x1B[D \x1B[D";
+
+	TermEcho(0);
+
+	i=0;
+	so=0;
+	act=1;
+	while (act) {
+		r=TermRead();
+		if (r[0] >= 32 && r[0] < 127) {	/* non-escape code */
+			if (i < len && i < (con_width-1)) {
+				buf[i++] = r[0];
+				TermPut(r,1);
+			}
+		}
+		else if (r[0] == 8 || r[0] == 127) {	/* backspace? */
+			if (i > 0) {
+				buf[--i] = 0;
+				TermPuts(erase);
+			}
+		}
+		else if (r[0] == 13 || r[0] == 10) {	/* enter? */
+			act=0;
+			buf[i]=0;
+		}
+		else if (!strcmp(r,"\x1B\x1B")) {
+			act=0;
+			i=0;
+			buf[i]=0;
+		}
+	}
+}
+
+int			batch_line = 0;		/* script line being run */
+int			batch_failed = 0;
+
+/* show a message on the status line and wait for ENTER. in batch mode
+ * it is an error, which stops the script */
+void StatusWait(const char *fmt,...)
+{
+	char buf[256];
+	va_list va;
+	char *r;
+
+	va_start(va,fmt);
+	vsnprintf(buf,sizeof(buf),fmt,va);
+	va_end(va);
+
+	if (batch_mode) {
+		fprintf(stderr,"line %d: %s\n",batch_line,buf);
+		batch_failed = 1;
+		return;
+	}
+
+	TermPosCurs(con_height,1);
+	TermPuts("\x1B[K");
+	TermPuts(buf);
+	do { r=TermRead(); } while (r[0] != 10);
+}
+
+/* message shown on the status line with the next frame */
+static char status_msg[128];
+void StatusMsg(const char *fmt,...)
+{
+	va_list va;
+
+	va_start(va,fmt);
+	vsnprintf(status_msg,sizeof(status_msg),fmt,va);
+	va_end(va);
+
+	/* batch mode prints it instead */
+	if (batch_mode) {
+		puts(status_msg);
+		status_msg[0] = 0;
+	}
+}
+
+/* a result to read: held on the status line until ENTER, or printed in batch mode */
+void StatusShow(const char *fmt,...)
+{
+	char buf[256];
+	va_list va;
+
+	va_start(va,fmt);
+	vsnprintf(buf,sizeof(buf),fmt,va);
+	va_end(va);
+
+	if (batch_mode)	puts(buf);
+	else		StatusWait("%s",buf);
+}
+
+/* an offset argument: <n>, +<n> or -<n> from the cursor, "here" or "end".
+ * an empty argument gives "def" */
+unsigned long long CmdOffset(const char *a,unsigned long long def)
+{
+	unsigned long long d;
+
+	if (!a[0])			return def;
+	if (!strcasecmp(a,"here"))	return file_cursor;
+	if (!strcasecmp(a,"end"))	return file_size;
+	if (a[0] == '+') {
+		d = strtoull(a+1,NULL,0);
+		return (file_size - file_cursor) < d ? file_size : file_cursor + d;
+	}
+	if (a[0] == '-') {
+		d = strtoull(a+1,NULL,0);
+		return file_cursor < d ? 0 : file_cursor - d;
+	}
+	return strtoull(a,NULL,0);
+}
+
+/* keep the cursor on the last byte of the file */
+void FaClampCursor()
+{
+	if (file_cursor >= file_size)
+		file_cursor = file_size ? file_size - 1 : 0;
+}
+
+/* modify mode: store a typed byte at the cursor and move past it */
+void EdPutByte(unsigned char c)
+{
+	if (view_insertmode)	EdInsert(file_cursor,&c,1);
+	else			EdOverwrite(file_cursor,&c,1);
+	if (file_cursor < (file_size-1)) file_cursor++;
+}
+
+/* put the cursor where an undo/redo happened */
+void EdUndoCursor(long long ofs)
+{
+	if (ofs < 0) {
+		StatusMsg("No more changes");
+		return;
+	}
+
+	file_cursor = (unsigned long long)ofs;
+	FaClampCursor();
+}
+
+/* search for the last pattern from the cursor and move there */
+void SrchGo(int back)
+{
+	unsigned long long hit;
+
+	if (srch_len < 1) {
+		StatusMsg("Nothing to find");
+		return;
+	}
+	if (back && file_cursor == 0) {
+		StatusMsg("Not found");
+		return;
+	}
+
+	TermPosCurs(con_height,1);
+	TermPuts("\x1B[K" "searching...");
+	TermFlush();
+
+	if (back)	hit = SrchFile(srch_pat,srch_len,0,file_cursor - 1 + srch_len,1);
+	else		hit = SrchFile(srch_pat,srch_len,file_cursor + 1,file_size,0);
+
+	if (hit == SRCH_NONE) {
+		StatusMsg("Not found");
+		return;
+	}
+
+	file_cursor = hit;
+	FaAdvise(FA_ADV_RANDOM);
+}
+
+/* move to scan hit "n" and say which signature it is */
+void ScanGoHit(int n)
+{
+	if (scan_nhits == 0) {
+		StatusMsg("No hits");
+		return;
+	}
+	if (n < 0 || n >= scan_nhits) {
+		StatusMsg("No more hits");
+		return;
+	}
+
+	scan_hit_pos = n;
+	file_cursor = scan_hits[n].ofs;
+	FaClampCursor();
+	FaAdvise(FA_ADV_RANDOM);
+	StatusMsg("hit %d/%d %s",n+1,scan_nhits,scan_pats[scan_hits[n].pat].name);
+}
+
+/* list the scan hits from the current one on, a screenful */
+void ScanList()
+{
+	int i,n;
+	char *r;
+
+	if (batch_mode) {
+		for (i=0;i < scan_nhits;i++)
+			printf("%016llX %s\n",scan_hits[i].ofs,scan_pats[scan_hits[i].pat].name);
+		return;
+	}
+
+	TermPuts("\x1B[2J\x1B[1;1H");
+	TermPrintf("%d HITS, %d SIGNATURES\n",scan_nhits,scan_npats);
+	i = scan_hit_pos < 0 ? 0 : scan_hit_pos;
+	for (n=0;i < scan_nhits && n < (con_height - 3);i++,n++)
+		TermPrintf("%6d  %016llX  %s\n",i+1,scan_hits[i].ofs,scan_pats[scan_hits[i].pat].name);
+	TermPuts("\nHIT RETURN TO CONTINUE.\n");
+
+	do { r=TermRead(); } while (r[0] != 10);
+	viewup_all = 1;
+}
+
+/* the "stats" report, a line at a time. returns the number of lines */
+int StatLines(char l[][96])
+{
+	StatCount *a = &stat_total,*d = &stat_last;
+	int n = 0;
+
+	snprintf(l[n++],96,"FILE        %llu reads (%llu bytes), %llu writes (%llu bytes), %llu seeks",
+		a->reads,a->read_bytes,a->writes,a->write_bytes,a->seeks);
+	snprintf(l[n++],96,"TERMINAL    %llu writes (%llu bytes)",a->term_writes,a->term_bytes);
+	snprintf(l[n++],96,"FRAMES      %llu in %.1fms: %.1fms in ViewRefresh(), %.1fms in DrawRow()",
+		a->frames,a->frame * 1000.0,a->refresh * 1000.0,a->draw * 1000.0);
+	snprintf(l[n++],96,"LAST FRAME  %.2fms, %llu reads (%llu bytes), %llu writes, %llu seeks, %llu bytes out",
+		d->frame * 1000.0,d->reads,d->read_bytes,d->writes,d->seeks,d->term_bytes);
+	snprintf(l[n++],96,"FRAME TIME  p50 %.2fms, p99 %.2fms over the last %u frames",
+		StatPercentile(0.50),StatPercentile(0.99),stat_nring);
+	return n;
+}
+
+/* write the counters to "path" as JSON. returns 0 on error */
+int StatDump(const char *path)
+{
+	StatCount *a = &stat_total;
+	FILE *f;
+
+	if ((f=fopen(path,"w")) == NULL) return 0;
+	fprintf(f,"{\"reads\":%llu,\"read_bytes\":%llu,\"writes\":%llu,\"write_bytes\":%llu,\"seeks\":%llu,"
+		"\"term_writes\":%llu,\"term_bytes\":%llu,\"frames\":%llu,\"frame_ms\":%.3f,\"refresh_ms\":%.3f,"
+		"\"draw_ms\":%.3f,\"p50_ms\":%.3f,\"p99_ms\":%.3f}\n",
+		a->reads,a->read_bytes,a->writes,a->write_bytes,a->seeks,a->term_writes,a->term_bytes,a->frames,
+		a->frame * 1000.0,a->refresh * 1000.0,a->draw * 1000.0,StatPercentile(0.50),StatPercentile(0.99));
+	return fclose(f) == 0;
+}
+
+/* draw the status line */
+void ViewStatus()
+{
+	char seg[96];
+	int sl = 0;
+
+	TermPosCurs(con_height,1);
+	TermPrintf("\x1B[0;7m" "%016llX ",file_cursor);
+	if (view_tab == 0)		TermPuts("ofs ");
+	else if (view_tab == 1)		TermPuts("hex ");
+	else if (view_tab == 2)		TermPuts("asc ");
+	else if (view_tab == 3)		TermPuts("map ");
+	if (file_mode & O_RDWR)		TermPuts(EdDirty() ? "[rw*]" : "[rw] ");
+	else				TermPuts("[ro] ");
+	if (view_modifymode)		TermPuts(view_insertmode ? " [INS] " : " [EDIT]");
+	else				TermPuts("       ");
+	if (view_with_stats) {
+		/* the frame before this one, which is the last one finished */
+		sl = snprintf(seg,sizeof(seg)," r%llu w%llu s%llu %lluB %.2fms p50 %.1f p99 %.1f",
+			stat_last.reads,stat_last.writes,stat_last.seeks,stat_last.term_bytes,stat_last.frame * 1000.0,
+			StatPercentile(0.50),StatPercentile(0.99));
+		if (sl > (con_width - 34)) sl = con_width > 34 ? con_width - 34 : 0;
+		TermPut(seg,sl);
+	}
+	if (status_msg[0]) {
+		TermPrintf(" %.*s",con_width > (48 + sl) ? con_width - 48 - sl : 0,status_msg);
+		status_msg[0] = 0;
+	}
+	TermPuts("\x1B[0m" "\x1B[K");
+}
+
+/* run one command line (as typed after ':' or read from a batch script).
+ * returns 0 once the program should quit */
+int CmdExec(char *buf)
+{
+	char *args[32];
+	char argq[32];
+	int argsc=0;
+	int run=1;
+	int good=0;
+	int i;
+	char *r;
+
+	i = 0;
+	memset(argq,0,sizeof(argq));
+
+	while (argsc < 31 && buf[i] != 0) {
+		while (buf[i] == ' ') i++;
+		if (buf[i] == '\"') {
+			buf[i++] = 0;
+			argq[argsc] = 1;
+			args[argsc++] = buf+i;
+			while (buf[i] && buf[i] != '\"') i++;
+			if (buf[i] == '\"') buf[i++] = 0;
+		}
+		else {
+			args[argsc++] = buf+i;
+			while (buf[i] && buf[i] != ' ') i++;
+			if (buf[i] == ' ') buf[i++]=0;
+		}
+	}
+	
+	while (argsc < 32)
+		args[argsc++] = "";
+	
+	if (!strcasecmp(args[0],"column")) {
+		if (!strcasecmp(args[1],"width")) {
+			view_columns = strtol(args[2],NULL,0);
+			if (view_columns < 1) view_columns = 1;
+			good = 1;
+		}
+	}
+	else if (!strcasecmp(args[0],"cache")) {
+		if (!strcasecmp(args[1],"size")) {
+			if (!FaCacheSetup(strtoull(args[2],NULL,0) << 10)) {
+				StatusWait("Unable to allocate cache");
+			}
+			good = 1;
+		}
+	}
+	else if (!strcasecmp(args[0],"stats")) {
+		char lines[8][96];
+		int n;
+
+		/* stats [show|hide|reset|dump <file>] */
+		good = 1;
+		if (!strcasecmp(args[1],"show") || !strcasecmp(args[1],"hide")) {
+			view_with_stats = !strcasecmp(args[1],"show");
+		}
+		else if (!strcasecmp(args[1],"reset")) {
+			StatReset();
+		}
+		else if (!strcasecmp(args[1],"dump")) {
+			if (!args[2][0] || !StatDump(args[2])) StatusWait("Unable to write %s",args[2]);
+		}
+		else if (batch_mode) {
+			n = StatLines(lines);
+			for (i=0;i < n;i++) puts(lines[i]);
+		}
+		else {
+			n = StatLines(lines);
+			TermPuts("\x1B[2J\x1B[1;1H");
+			for (i=0;i < n;i++) {
+				TermPuts(lines[i]);
+				TermPuts("\n");
+			}
+			TermPuts("\nHIT RETURN TO CONTINUE.\n");
+			TermFlush();
+			do { r=TermRead(); } while (r[0] != 10);
+			viewup_all = 1;
+		}
+	}
+	else if (!strcasecmp(args[0],"frame")) {
+		StatusMsg("last frame %llu bytes, %llu sent total",term_frame_bytes,term_total_bytes);
+		good = 1;
+	}
+	else if (!strcasecmp(args[0],"view")) {
+		if (!strcasecmp(args[1],"sync")) {
+			good = 1;
+			view_offset = file_cursor;
+		}
+	}
+	else if (!strcasecmp(args[0],"truncate") && EdDirty()) {
+		StatusWait("Write or revert your changes first");
+		good = 1;
+	}
+	else if (!strcasecmp(args[0],"truncate")) {
+		if (!strcasecmp(args[1],"here")) {
+			/* ok */
+			if (!FaTruncate(file_cursor)) {
+				StatusWait("ERROR TRUNCATING FILE!!");
+			}
+			else if (file_size > 0) file_cursor--;
+			good = 1;
+		}
+		else if (!strcasecmp(args[1],"at") || !strcasecmp(args[1],"to")) {
+			unsigned long long pt;
+
+			pt = strtoull(args[2],NULL,0);
+			if (!FaTruncate(pt)) {
+				StatusWait("ERROR TRUNCATING FILE!!");
+			}
+			else if (file_cursor >= file_size) {
+				if (file_size == 0)	file_cursor = 0;
+				else			file_cursor = file_size - 1;
+			}
+			good = 1;
+		}
+	}
+	else if (!strcasecmp(args[0],"go")) {
+		if (!strcasecmp(args[1],"to")) {
+			FaAdvise(FA_ADV_RANDOM);
+			if (isdigit(args[2][0])) {
+				file_cursor = strtoll(args[2],NULL,0);
+				good = 1;
+			}
+			else if (args[2][0] == '+') {
+				unsigned long long delta;
+
+				good = 1;
+				delta = strtoull(args[2]+1,NULL,0);
+				if ((0xFFFFFFFFFFFFFFFFLL - file_cursor) < delta)
+					file_cursor = 0xFFFFFFFFFFFFFFFFLL;
+				else
+					file_cursor += delta;
+			}
+			else if (args[2][0] == '-') {
+				unsigned long long delta;
+
+				good = 1;
+				delta = strtoull(args[2]+1,NULL,0);
+				if (file_cursor < delta)
+					file_cursor = 0;
+				else
+					file_cursor -= delta;
+			}
+			else if (!strcasecmp(args[2],"end")) {
+				if (file_size == 0)	file_cursor = 0;
+				else			file_cursor = file_size - 1;
+				good = 1;
+			}
+			else if (!strcasecmp(args[2],"next") && (!strcasecmp(args[3],"data") || !strcasecmp(args[3],"hole"))) {
+				unsigned long long at;
+				int hole;
+
+				/* past the end of the run the cursor is in, then to the start of the next */
+				good = 1;
+				hole = !strcasecmp(args[3],"hole");
+				at = FaNextExtent(FaNextExtent(file_cursor,!hole),hole);
+				if (at >= file_size)
+					StatusMsg(hole ? "No more holes" : "No more data");
+				else
+					file_cursor = at;
+			}
+		}
+	}
+	else if (!strcasecmp(args[0],"show")) {
+		if (!strcasecmp(args[1],"hex")) {
+			good = 1;
+			view_with_hex = 1;
+		}
+		else if (!strcasecmp(args[1],"asc")) {
+			good = 1;
+			view_with_asc = 1;
+		}
+		else if (!strcasecmp(args[1],"map")) {
+			good = 1;
+			view_with_map = 1;
+		}
+	}
+	else if (!strcasecmp(args[0],"hide")) {
+		if (!strcasecmp(args[1],"hex")) {
+			good = 1;
+			if (view_with_hex) {
+				view_with_hex = 0;
+				if (view_tab == 1) view_tab = 2;
+				if (view_tab == 2 && !view_with_asc) view_tab = 0;
+			}
+		}
+		else if (!strcasecmp(args[1],"asc")) {
+			good = 1;
+			if (view_with_asc) {
+				view_with_asc = 0;
+				if (view_tab == 2) view_tab = 0;
+			}
+		}
+		else if (!strcasecmp(args[1],"map")) {
+			good = 1;
+			view_with_map = 0;
+			if (view_tab == 3) view_tab = 0;
+		}
+	}
+	/* "quit" or "q" (bad VIM habits die hard) */
+	else if ((!strcasecmp(args[0],"quit") || !strcasecmp(args[0],"q")) && EdDirty()) {
+		StatusWait("Unsaved changes, use write or quit!");
+		good = 1;
+	}
+	else if (!strcasecmp(args[0],"quit") || !strcasecmp(args[0],"q") ||
+		!strcasecmp(args[0],"quit!") || !strcasecmp(args[0],"q!")) {
+		run = 0;
+		good = 1;
+	}
+	else if (!strcasecmp(args[0],"help")) {
+		TermPuts("\x1B[2J\x1B[1;1H");
+		TermPuts("KEYS:\n");
+		TermPuts("ARROW KEYS            CONTROLS THE CURSOR POSITION.\n");
+		TermPuts("PAGE UP, PAGE DOWN    JUMPS SEVERAL ROWS.\n");
+		TermPuts("HOME, END             JUMPS THE CURSOR TO THE BEGINNING OR END OF A ROW.\n");
+		TermPuts("ESC,ESC               QUITS THIS PROGRAM.\n");
+		TermPuts(":                     GOES INTO COMMAND MODE.\n");
+		TermPuts("ESC,M                 GOES INTO MODIFY MODE.\n");
+		TermPuts("ESC,S                 EXITS MODIFY MODE.\n");
+		TermPuts("ESC,I                 TOGGLES INSERT/OVERWRITE WHILE MODIFYING.\n");
+		TermPuts("ESC,U  ESC,R          UNDO, REDO.\n");
+		TermPuts("ESC,N  ESC,P          FINDS THE NEXT OR PREVIOUS MATCH.\n");
+		TermPuts("\n");
+		TermPuts("COMMAND SUMMARY\n");
+		TermPuts("quit                  QUITS THE PROGRAM. quit! DISCARDS CHANGES.\n");
+		TermPuts("open                  OPENS A FILE FOR PEEKING.\n");
+		TermPuts("openrw                OPENS A FILE FOR MODIFICATION.\n");
+		TermPuts("write, sync           WRITES CHANGES TO THE FILE.\n");
+		TermPuts("revert                DISCARDS CHANGES NOT YET WRITTEN.\n");
+		TermPuts("undo, redo            UNDOES OR REDOES THE LAST CHANGE.\n");
+		TermPuts("insert <n> [<xx>]     INSERTS <n> BYTES (VALUE <xx>) AT THE CURSOR\n");
+		TermPuts("append <n> [<xx>]     APPENDS <n> BYTES (VALUE <xx>) TO THE FILE\n");
+		TermPuts("delete <n>            DELETES <n> BYTES AT THE CURSOR\n");
+		TermPuts("poke <xx..|\"text\">    OVERWRITES BYTES AT THE CURSOR AND MOVES PAST THEM\n");
+		TermPuts("peek [<n>]            SHOWS <n> BYTES AT THE CURSOR IN HEX\n");
+		TermPuts("find <xx..|\"text\">    FINDS HEX BYTES OR TEXT AFTER THE CURSOR\n");
+		TermPuts("rfind <xx..|\"text\">   FINDS HEX BYTES OR TEXT BEFORE THE CURSOR\n");
+		TermPuts("find next, find prev  REPEATS THE LAST SEARCH\n");
+		TermPuts("replace <xx..|\"text\"> <xx..|\"text\"> [<start> <end>]\n");
+		TermPuts("                      REPLACES EVERY MATCH IN PLACE (SAME LENGTH)\n");
+		TermPuts("compare <file|off>    SHOWS ANOTHER FILE UNDER THIS ONE, DIFFERENCES IN RED\n");
+		TermPuts("nextdiff, prevdiff    JUMPS TO THE NEXT OR PREVIOUS DIFFERENCE\n");
+		TermPuts("hash <algo> [<s> <e>] HASHES [<s>,<e>) WITH crc32 crc32c xxh64 sha256 md5\n");
+		TermPuts("                      <s>,<e> CAN BE +<n>/-<n> FROM THE CURSOR, here OR end\n");
+		TermPuts("export <s> <n|end> <file> [hex|base64|c-array]\n");
+		TermPuts("                      WRITES <n> BYTES FROM <s> TO <file> AS TEXT\n");
+		TermPuts("import <file> [hex|base64]\n");
+		TermPuts("                      DECODES <file> OVER THE BYTES AT THE CURSOR\n");
+		TermPuts("patch apply <file>    APPLIES AN IPS, BPS OR \"<ofs>: <xx..>\" TEXT PATCH\n");
+		TermPuts("patch create <file> <out>\n");
+		TermPuts("                      WRITES A PATCH TO <file> (.ips .bps OR TEXT)\n");
+		TermPuts("scan <sigfile>        FINDS EVERY SIGNATURE (\"<name> <hex ?? | \"text\">\" LINES)\n");
+		TermPuts("hits [next|prev|<n>]  LISTS THE SCAN HITS OR MOVES TO ONE\n");
+		TermPuts("column width <n>      SETS THE COLUMN WIDTH TO <n> BYTES/ROW\n");
+		TermPuts("cache size <n>        SETS THE BLOCK CACHE SIZE TO <n> KB\n");
+		TermPuts("frame                 SHOWS HOW MANY BYTES THE LAST SCREEN UPDATE SENT\n");
+		TermPuts("stats [show|hide|reset|dump <file>]\n");
+		TermPuts("                      SYSCALLS, BYTES AND FRAME TIMES, ON THE STATUS LINE TOO\n");
+		TermPuts("view sync             SETS THE VIEWPORT TO THE CURSOR POSITION\n");
+		TermPuts("truncate here         TRUNCATES THE FILE AT THE CURSOR POSITION\n");
+		TermPuts("truncate <at|to> <n>  TRUNCATES THE FILE AT THE GIVEN OFFSET\n");
+		TermPuts("go to <-|+><n>        JUMPS THE CURSOR TO OFFSET <n> OR RELATIVE OFS IF +/-<n>\n");
+		TermPuts("go to end             JUMPS TO THE END OF THE FILE\n");
+		TermPuts("go to next data|hole  JUMPS TO WHERE THE NEXT DATA OR HOLE OF A SPARSE FILE STARTS\n");
+		TermPuts("show <panel>          SHOWS THE SPECIFIED PANEL. 'PANEL' CAN BE 'asc', 'hex' or 'map'\n");
+		TermPuts("                      MAP: 0 ZEROS, a TEXT, # RANDOM, : OTHER; COLOR = ENTROPY.\n");
+		TermPuts("                      TAB TO IT, MOVE WITH THE ARROWS AND ENTER TO JUMP THERE\n");
+		TermPuts("hide <panel>          HIDES THE SPECIFIED PANEL.\n");
+		TermPuts("\n");
+		TermPuts("HIT RETURN TO CONTINUE.\n");
+
+		do { r=TermRead(); } while (r[0] != 10);
+		viewup_all = 1;
+		good = 1;
+	}
+	else if ((!strcasecmp(args[0],"open") || !strcasecmp(args[0],"openrw")) && EdDirty()) {
+		StatusWait("Write or revert your changes first");
+		good = 1;
+	}
+	else if (!strcasecmp(args[0],"write") || !strcasecmp(args[0],"sync")) {
+		if (!EdDirty())
+			StatusMsg("No changes");
+		else if (!EdCommit())
+			StatusWait("ERROR WRITING FILE!!");
+		else
+			StatusMsg("Written");
+		good = 1;
+	}
+	else if (!strcasecmp(args[0],"revert")) {
+		EdReset();
+		FaClampCursor();
+		good = 1;
+	}
+	else if (!strcasecmp(args[0],"insert") || !strcasecmp(args[0],"append")) {
+		unsigned long long n,at;
+		unsigned char *fill;
+
+		/* insert <n> [<byte>] at the cursor, append <n> [<byte>] at the end */
+		n = strtoull(args[1],NULL,0);
+		at = !strcasecmp(args[0],"append") ? file_size : file_cursor;
+		good = 1;
+		if (!(file_mode & O_RDWR)) {
+			StatusWait("Can't modify a file in read-only mode");
+		}
+		else if (n != 0 && n <= (1ULL << 30) && (fill=(unsigned char*)malloc((size_t)n)) != NULL) {
+			memset(fill,(int)strtol(args[2],NULL,16),(size_t)n);
+			if (!EdInsert(at,fill,(size_t)n)) StatusWait("Unable to insert");
+			free(fill);
+			file_cursor = at;
+			FaClampCursor();
+		}
+		else {
+			StatusWait("Bad length");
+		}
+	}
+	else if (!strcasecmp(args[0],"delete")) {
+		good = 1;
+		if (!(file_mode & O_RDWR))
+			StatusWait("Can't modify a file in read-only mode");
+		else if (!EdDelete(file_cursor,strtoull(args[1],NULL,0)))
+			StatusWait("Nothing to delete");
+		FaClampCursor();
+	}
+	else if (!strcasecmp(args[0],"find") || !strcasecmp(args[0],"rfind")) {
+		int back = !strcasecmp(args[0],"rfind");
+		int m;
+
+		good = 1;
+		if (!argq[1] && (!strcasecmp(args[1],"next") || !strcasecmp(args[1],"prev"))) {
+			SrchGo(!strcasecmp(args[1],"prev"));
+		}
+		else if ((m=SrchPattern(args+1,argq+1,srch_pat,SRCH_MAX)) < 1) {
+			StatusWait("Bad search pattern");
+		}
+		else {
+			srch_len = m;
+			SrchGo(back);
+		}
+	}
+	else if (!strcasecmp(args[0],"scan")) {
+		double t;
+		int err;
+
+		good = 1;
+		TermPosCurs(con_height,1);
+		TermPuts("\x1B[K" "scanning...");
+		TermFlush();
+
+		if (!ScanLoad(args[1],&err)) {
+			if (err)	StatusWait("Bad signature on line %d",err);
+			else		StatusWait("Unable to load signatures");
+		}
+		else {
+			t = JobNow();
+			err = ScanFile();
+			t = JobNow() - t;
+			StatusMsg("%d hits%s %.0fMB/s",scan_nhits,err ? " (list full)" : "",
+				t > 0 ? ((double)file_size / 1048576.0) / t : 0.0);
+		}
+	}
+	else if (!strcasecmp(args[0],"hits")) {
+		good = 1;
+		if (!strcasecmp(args[1],"next"))
+			ScanGoHit(scan_hit_pos + 1);
+		else if (!strcasecmp(args[1],"prev"))
+			ScanGoHit(scan_hit_pos < 0 ? -1 : scan_hit_pos - 1);
+		else if (args[1][0])
+			ScanGoHit((int)strtol(args[1],NULL,0) - 1);
+		else
+			ScanList();
+	}
+	else if (!strcasecmp(args[0],"replace")) {
+		unsigned char pat[SRCH_MAX],rpl[SRCH_MAX];
+		unsigned long long st,en;
+		char *a1[2],*a2[2];
+		char q1[2],q2[2];
+		long long n;
+		int m,mr;
+		double t;
+
+		/* replace <pattern> <replacement> [<start> <end>], one argument each */
+		a1[0] = args[1]; a1[1] = ""; q1[0] = argq[1]; q1[1] = 0;
+		a2[0] = args[2]; a2[1] = ""; q2[0] = argq[2]; q2[1] = 0;
+		m = SrchPattern(a1,q1,pat,SRCH_MAX);
+		mr = SrchPattern(a2,q2,rpl,SRCH_MAX);
+		st = args[3][0] ? strtoull(args[3],NULL,0) : 0;
+		en = args[4][0] ? strtoull(args[4],NULL,0) : file_size;
+		if (en > file_size) en = file_size;
+		if (st > en) st = en;
+		good = 1;
 
-	if (y == view_ofs_y)	printf("\x1B[0;1;37m");
-	else			printf("\x1B[0;36m");
+		if (!(file_mode & O_RDWR)) {
+			StatusWait("Can't modify a file in read-only mode");
+		}
+		else if (EdDirty()) {
+			StatusWait("Write or revert your changes first");
+		}
+		else if (m < 1 || mr != m) {
+			StatusWait("Pattern and replacement must be the same length");
+		}
+		else {
+			TermPosCurs(con_height,1);
+			TermPuts("\x1B[K" "replacing...");
+			TermFlush();
 
-	w = view_scrcols;
-	printf("%016LX",o);
-	if (view_colofs != 0)	printf("<");
-	else			printf(" ");
-
-	if (view_with_hex) {
-		FaSeek(o+view_colofs);
-		if (o != LastRowTmp || !LastRowTmpI) {
-			memset(RowTmp,0,w);
-			read(file_fd,RowTmp,w);
-			LastRowTmp = o;
-			LastRowTmpI = 1;
+			t = JobNow();
+			n = ReplFile(pat,rpl,m,st,en);
+			t = JobNow() - t;
+			if (n < 0)
+				StatusWait("ERROR WRITING FILE!!");
+			else
+				StatusMsg("%lld replaced %.0fMB/s",n,
+					t > 0 ? ((double)(en - st) / 1048576.0) / t : 0.0);
 		}
-		
-		for (x=0;x < w && (x+view_colofs) < view_columns && (o+x+view_colofs) < file_size;x++)
-			printf("%02X ",RowTmp[x]);
+	}
+	else if (!strcasecmp(args[0],"compare")) {
+		good = 1;
+		if (!strcasecmp(args[1],"off") && !argq[1])
+			CmpClose();
+		else if (!CmpOpen(args[1]))
+			StatusWait("Unable to open file");
+		viewup_all = 1;
+	}
+	else if (!strcasecmp(args[0],"nextdiff") || !strcasecmp(args[0],"prevdiff")) {
+		unsigned long long hit;
+		int back = !strcasecmp(args[0],"prevdiff");
 
-		for (;x < w;x++)
-			printf("   ");
+		good = 1;
+		if (cmp_fd < 0) {
+			StatusWait("Not comparing (compare <file>)");
+		}
+		else {
+			TermPosCurs(con_height,1);
+			TermPuts("\x1B[K" "comparing...");
+			TermFlush();
 
-		if ((w+view_colofs) < view_columns)	printf(">");
-		else					printf(" ");
+			if ((hit=CmpFind(back ? file_cursor : file_cursor + 1,back)) == SRCH_NONE) {
+				StatusMsg("No more differences");
+			}
+			else if (hit >= file_size) {
+				StatusMsg("Differs past the end of this file");
+				file_cursor = file_size;
+				FaClampCursor();
+			}
+			else {
+				file_cursor = hit;
+				FaAdvise(FA_ADV_RANDOM);
+			}
+		}
 	}
+	else if (!strcasecmp(args[0],"hash")) {
+		unsigned long long st,en;
+		char out[80];
+		double t;
 
-	if (view_with_asc) {
-		FaSeek(o+view_colofs);
-		fflush(stdout);
-		if (o != LastRowTmp || !LastRowTmpI) {
-			memset(RowTmp,0,w);
-			read(file_fd,RowTmp,w);
-			LastRowTmp = o;
-			LastRowTmpI = 1;
-		}
-		
-		for (x=0;x < w && (x+view_colofs) < view_columns && (o+x+view_colofs) < file_size;x++) {
-			c=RowTmp[x];
-			if (c < 32 || c >= 127) c = '.';
-			printf("%c",c);
+		good = 1;
+		st = CmdOffset(args[2],0);
+		en = CmdOffset(args[3],file_size);
+		if (en > file_size) en = file_size;
+		if (st > en) {
+			StatusWait("Bad range, the start is past the end");
 		}
+		else {
+			TermPosCurs(con_height,1);
+			TermPuts("\x1B[K" "hashing...");
+			TermFlush();
 
-		c=' '; for (;x < w;x++) printf(" ");
-		if ((w+view_colofs) < view_columns)	printf(">");
-		else					printf(" ");
+			t = JobNow();
+			if (!HashRange(args[1],st,en,out)) {
+				StatusWait("Unknown hash (crc32 crc32c xxh64 sha256 md5) or read error");
+			}
+			else {
+				t = JobNow() - t;
+				StatusShow("%s %llX-%llX: %s  %.0fMB/s",args[1],st,en,out,
+					t > 0 ? ((double)(en - st) / 1048576.0) / t : 0.0);
+			}
+		}
 	}
+	else if (!strcasecmp(args[0],"export")) {
+		unsigned long long st,en;
+		double t;
 
-	printf("\x1B[K");
-	fflush(stdout);
-}
-
-static int VRlastrow = -1;
-void ViewRefresh()
-{
-	int y;
-	int w;
+		/* export <start> <len|end> <file> hex|base64|c-array */
+		good = 1;
+		st = CmdOffset(args[1],0);
+		en = !args[2][0] || !strcasecmp(args[2],"end") ? file_size : st + strtoull(args[2],NULL,0);
+		if (st > file_size) st = file_size;
+		if (en > file_size || en < st) en = file_size;
 
-	w = view_scrcols;
+		TermPosCurs(con_height,1);
+		TermPuts("\x1B[K" "exporting...");
+		TermFlush();
 
-	if (viewup_all) {
-		unsigned long long of;
-//		const char *rv = "\x1B[2J";
-		
-		of = view_offset;
-		viewup_cursor = 1;
-//		write(1,rv,strlen(rv));
+		t = JobNow();
+		if (!args[3][0] || !TxExport(args[4][0] ? args[4] : "hex",st,en - st,args[3])) {
+			StatusWait("Unknown format (hex base64 c-array) or write error");
+		}
+		else {
+			t = JobNow() - t;
+			StatusMsg("Exported %llu bytes  %.0fMB/s",en - st,
+				t > 0 ? ((double)(en - st) / 1048576.0) / t : 0.0);
+		}
+	}
+	else if (!strcasecmp(args[0],"import")) {
+		long long n;
+		double t;
 
-		for (y=0;y < view_rows;y++) {
-			TermPosCurs(y+1,1);
-			DrawRow(y,of);
-			of += view_columns;
+		/* import <file> hex|base64, overwriting at the cursor */
+		good = 1;
+		if (!(file_mode & O_RDWR)) {
+			StatusWait("Can't modify a file in read-only mode");
 		}
+		else {
+			TermPosCurs(con_height,1);
+			TermPuts("\x1B[K" "importing...");
+			TermFlush();
 
-		viewup_all=0;
-		viewup_scroll=0;
-		VRlastrow = view_ofs_y;
+			t = JobNow();
+			if ((n=TxImport(args[2][0] ? args[2] : "hex",args[1],file_cursor)) < 0) {
+				StatusWait("Unknown format (hex base64), unreadable file or bad data");
+			}
+			else {
+				t = JobNow() - t;
+				StatusMsg("Imported %lld bytes  %.0fMB/s",n,
+					t > 0 ? ((double)n / 1048576.0) / t : 0.0);
+			}
+			FaClampCursor();
+		}
 	}
+	else if (!strcasecmp(args[0],"patch")) {
+		const char *why;
+		long long n;
+		double t;
 
-	if (viewup_scroll == VUPS_DOWN) {
-		unsigned long long of;
-		const char *scrd = "\x1B[L";	/* insert one line, make the rest scroll down */
-		char buf[18];
+		/* patch apply <file> | patch create <other-file> <out> */
+		good = 1;
+		TermPosCurs(con_height,1);
+		TermPuts("\x1B[K" "patching...");
+		TermFlush();
 
-		if (VRlastrow >= 0) {
-			TermPosCurs(VRlastrow+1,1);
-			of = view_offset + ((VRlastrow+1) * view_columns);
-			DrawRow(-1,of);
+		t = JobNow();
+		if (!strcasecmp(args[1],"apply") && args[2][0]) {
+			if ((n=PatchApply(args[2],&why)) < 0) {
+				StatusWait("%s",why);
+			}
+			else {
+				StatusMsg("Patched %lld bytes  %.0fms",n,(JobNow() - t) * 1000.0);
+			}
+			FaClampCursor();
+			viewup_all = 1;
+		}
+		else if (!strcasecmp(args[1],"create") && args[2][0] && args[3][0]) {
+			if ((n=PatchCreate(args[2],args[3],&why)) < 0)
+				StatusWait("%s",why);
+			else
+				StatusMsg("Wrote %lld records  %.0fms",n,(JobNow() - t) * 1000.0);
+		}
+		else {
+			StatusWait("patch apply <file> or patch create <other-file> <out>");
 		}
+	}
+	else if (!strcasecmp(args[0],"poke")) {
+		unsigned char pb[4096];
+		int m;
 
-		sprintf(buf,"\x1B[1;%dr",view_rows);
-		write(1,buf,strlen(buf));
-		TermPosCurs(1,1);
-		write(1,scrd,strlen(scrd));
-		TermPosCurs(1,1);
-		of = view_offset;
-		DrawRow(0,of);
-		sprintf(buf,"\x1B[1;%dr",con_height);
-		write(1,buf,strlen(buf));
+		/* poke <xx..|"text">: overwrite at the cursor and move past, growing the file at its end */
+		good = 1;
+		if (!(file_mode & O_RDWR))
+			StatusWait("Can't modify a file in read-only mode");
+		else if (file_cursor > file_size || (m=SrchPattern(args+1,argq+1,pb,sizeof(pb))) < 1)
+			StatusWait("Bad bytes");
+		else if (!EdEdit(file_cursor,(file_size - file_cursor) < (unsigned long long)m ? file_size - file_cursor : m,pb,m))
+			StatusWait("Unable to write");
+		else
+			file_cursor += m;
+	}
+	else if (!strcasecmp(args[0],"peek")) {
+		unsigned char pb[16];
+		char line[64];
+		unsigned long long at,n,k;
 
-		viewup_cursor = 1;
-		viewup_scroll = 0;
-		viewup_all = 0;
-		VRlastrow = view_ofs_y;
+		/* peek [<n>]: the bytes at the cursor, in hex */
+		good = 1;
+		n = args[1][0] ? strtoull(args[1],NULL,0) : 16;
+		if (n > (file_size - file_cursor)) n = file_size - file_cursor;
+		TxInit();
+		for (at=file_cursor;n > 0;at += k,n -= k) {
+			k = n < 16 ? n : 16;
+			if (FaRead(at,(int)k,pb) != (int)k) break;
+			TxHex(line,pb,(size_t)k);
+			line[k*2] = 0;
+			if (!batch_mode) {
+				StatusShow("%016llX: %s",at,line);
+				break;
+			}
+			printf("%016llX: %s\n",at,line);
+		}
+	}
+	else if (!strcasecmp(args[0],"undo")) {
+		good = 1;
+		EdUndoCursor(EdUndoLast());
+	}
+	else if (!strcasecmp(args[0],"redo")) {
+		good = 1;
+		EdUndoCursor(EdRedo());
+	}
+	else if (!strcasecmp(args[0],"open")) {
+		if (!FaOpen(args[1],O_RDONLY)) {
+			StatusWait("Unable to open file");
+		}
+		
+		file_cursor = 0;
+		view_offset = 0;
+		good = 1;
 	}
+	else if (!strcasecmp(args[0],"openrw")) {
+		if (!FaOpen(args[1],O_RDWR)) {
+			StatusWait("Unable to open file");
+		}
 
-	if (viewup_scroll == VUPS_UP) {
-		unsigned long long of;
-		char buf[18];
+		file_cursor = 0;
+		view_offset = 0;
+		good = 1;
+	}
+	else if (!strlen(args[0])) {
+		good = 1;
+	}
 
-		if (VRlastrow >= 0) {
-			TermPosCurs(VRlastrow+1,1);
-			of = view_offset + ((VRlastrow-1) * view_columns);
-			DrawRow(-1,of);
-		}
+	if (!good) {
+		StatusWait("UNKNOWN COMMAND");
+	}
 
-		sprintf(buf,"\x1B[1;%dr",view_rows);
-		write(1,buf,strlen(buf));
-		TermPosCurs(view_rows,1);
-		write(1,"\r\n",2);
-		sprintf(buf,"\x1B[1;%dr",con_height);
-		write(1,buf,strlen(buf));
-		TermPosCurs(view_rows,1);
-		of = view_offset + ((view_rows-1)*view_columns);
-		DrawRow(view_rows-1,of);
+	return run;
+}
 
-		viewup_cursor = 1;
-		viewup_scroll = 0;
-		viewup_all = 0;
-		VRlastrow = view_ofs_y;
+/* batch mode.
+ * -batch <script> (- for stdin) runs the script's commands against the
+ * file with no terminal at all: nothing is drawn, StatusMsg() output goes
+ * to stdout and anything StatusWait() would complain about goes to stderr
+ * and stops the script. edits collect in the overlay like they do on
+ * screen and EdCommit() writes them with pwritev(), on "sync" (or
+ * "write") and at the end of the script unless it failed. */
+int BatchRun(const char *path)
+{
+	char line[4096];
+	size_t l;
+	FILE *f;
+	char *c;
+
+	if ((f=strcmp(path,"-") ? fopen(path,"r") : stdin) == NULL) {
+		fprintf(stderr,"unable to open script %s\n",path);
+		return 1;
 	}
 
-	if (viewup_cursor) {
-		int x,y;
+	while (!batch_failed && fgets(line,sizeof(line),f) != NULL) {
+		batch_line++;
+		l = strlen(line);
+		while (l > 0 && (line[l-1] == '\n' || line[l-1] == '\r')) line[--l] = 0;
+		for (c=line;*c == ' ' || *c == '\t';) c++;
+		if (*c == 0 || *c == '#') continue;
+		if (!CmdExec(c)) break;
+	}
+	if (f != stdin) fclose(f);
 
-		switch (view_tab) {
-			case 0:		/* offset column */
-				y=view_ofs_y;
-				x=0;
-				break;
+	if (!batch_failed && EdDirty() && !EdCommit()) {
+		fprintf(stderr,"error writing file\n");
+		batch_failed = 1;
+	}
 
-			case 1:		/* hex dump column */
-				y=view_ofs_y;
-				x=((view_ofs_x-view_colofs)*3)+17;
-				break;
+	fflush(stdout);
+	return batch_failed ? 1 : 0;
+}
 
-			case 2:		/* ASCII dump column */
-				y=view_ofs_y;
-				if (view_with_hex)	x=(view_ofs_x-view_colofs)+(w*3)+18;
-				else			x=(view_ofs_x-view_colofs)+17;
-				break;
+/* dump mode.
+ * -dump writes [start,start+len) of the file to stdout in the layout of
+ * the screen rows (offset, hex, ASCII) and exits. the range is cut into
+ * chunks of whole rows which worker threads read and format with the row
+ * kernels in parallel; a finished chunk waits for the one before it to be
+ * written, so the output stays in order with one write() per chunk. */
+#define DUMP_CHUNK		(1 << 20)
 
-			default:
-				x=y=0;
-				break;
-		}
+typedef struct DumpJob {
+	unsigned long long	start,end;
+	unsigned long long	chunk;		/* bytes per chunk, whole rows */
+	unsigned long long	nchunks,next;
+	unsigned long long	turn;		/* the chunk to write next */
+	int			columns;
+	FmtRowFn		fmt;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	int			failed;
+} DumpJob;
 
-		viewcon_x = x;
-		viewcon_y = y;
-		viewup_cursor = 0;
+static void *DumpWorker(void *arg)
+{
+	DumpJob *j = (DumpJob*)arg;
+	unsigned long long k,cs,ce,o;
+	unsigned char *buf;
+	size_t rowmax,got;
+	ssize_t wr;
+	char *out,*d;
+	int n;
 
-		if (VRlastrow != viewcon_y) {
-			unsigned long long of;
+	rowmax = 17 + ((size_t)j->columns * 4) + 2;
+	buf = (unsigned char*)malloc((size_t)j->chunk);
+	out = (char*)malloc((size_t)(j->chunk / j->columns) * rowmax);
+	if (buf == NULL || out == NULL) j->failed = 1;
 
-			if (VRlastrow >= 0) {
-				TermPosCurs(VRlastrow+1,1);
-				of = view_offset + (VRlastrow * view_columns);
-				DrawRow(VRlastrow,of);
+	while ((k=__sync_fetch_and_add(&j->next,1)) < j->nchunks) {
+		cs = j->start + (k * j->chunk);
+		ce = (j->end - cs) > j->chunk ? cs + j->chunk : j->end;
+		d = out;
+		if (!j->failed) {
+			if ((got=FaBulkRead(cs,(size_t)(ce - cs),buf)) != (size_t)(ce - cs)) {
+				j->failed = 1;
+				ce = cs + got;
 			}
+			for (o=cs;o < ce;o += n) {
+				n = (ce - o) < (unsigned long long)j->columns ? (int)(ce - o) : j->columns;
+				FmtOffset(d,o);
+				d[16] = ' ';
+				d += 17 + j->fmt(d+17,buf+(o - cs),n,j->columns,' ');
+				d[-1] = '\n';		/* in place of the right edge */
+			}
+		}
 
-			TermPosCurs(viewcon_y+1,1);
-			of = view_offset + (viewcon_y * view_columns);
-			DrawRow(viewcon_y,of);
-			VRlastrow = viewcon_y;
+		/* wait for our turn, then write with nobody else writing */
+		pthread_mutex_lock(&j->lock);
+		while (j->turn != k) pthread_cond_wait(&j->cond,&j->lock);
+		pthread_mutex_unlock(&j->lock);
+
+		for (o=0;o < (unsigned long long)(d - out) && !j->failed;o += (unsigned long long)wr) {
+			if ((wr=write(1,out+o,(d - out) - o)) <= 0) {
+				if (wr < 0 && errno == EINTR) wr = 0;
+				else j->failed = 1;
+			}
 		}
+
+		pthread_mutex_lock(&j->lock);
+		j->turn++;
+		pthread_cond_broadcast(&j->cond);
+		pthread_mutex_unlock(&j->lock);
 	}
+
+	free(out);
+	free(buf);
+	return NULL;
 }
 
-void ReadInLine(char *buf,int len)
+/* dump "len" bytes from "start", "columns" bytes to a row. returns 0 on
+ * a read or write error */
+int DumpRun(unsigned long long start,unsigned long long len,int columns)
 {
-	int i,so;
-	char *r;
-	char act;
-	const char *erase = "\x1B[D \x1B[D";
+	DumpJob j;
 
-	TermEcho(0);
+	if (columns < 1) columns = 16;
+	if (start > file_size) start = file_size;
+	if (len > (file_size - start)) len = file_size - start;
 
-	i=0;
-	so=0;
-	act=1;
-	while (act) {
-		r=TermRead();
-		if (r[0] >= 32 && r[0] < 127) {	/* non-escape code */
-			if (i < len && i < (con_width-1)) {
-				buf[i++] = r[0];
-				write(1,r,1);
-			}
-		}
-		else if (r[0] == 8 || r[0] == 127) {	/* backspace? */
-			if (i > 0) {
-				buf[--i] = 0;
-				write(1,erase,strlen(erase));
-			}
-		}
-		else if (r[0] == 13 || r[0] == 10) {	/* enter? */
-			act=0;
-			buf[i]=0;
-		}
-		else if (!strcmp(r,"\x1B\x1B")) {
-			act=0;
-			i=0;
-			buf[i]=0;
-		}
-	}
+	memset(&j,0,sizeof(j));
+	j.start = start;
+	j.end = start + len;
+	j.columns = columns;
+	j.chunk = (unsigned long long)columns * ((DUMP_CHUNK + columns - 1) / columns);
+	j.nchunks = (len + j.chunk - 1) / j.chunk;
+	j.fmt = FmtRowSelect(1,1,(unsigned long long)columns,(unsigned long long)columns);
+	pthread_mutex_init(&j.lock,NULL);
+	pthread_cond_init(&j.cond,NULL);
+
+	FaAdvise(FA_ADV_SEQUENTIAL);
+	JobRun(JobThreads(len),DumpWorker,&j);
+
+	pthread_cond_destroy(&j.cond);
+	pthread_mutex_destroy(&j.lock);
+	return !j.failed;
 }
 
-/* main */
+/* main, left out when shex.c is built into bench.c */
+#ifndef SHEX_NO_MAIN
 int main(int argc,char **argv)
 {
 	int mainloop;
+	int moved = 0;
 	int act;
 	int i;
-	char stt[68];
 	char *r;
 	char *fn;
+	char *cmpfn;
 	int fnmod;
-	
-	if (!isatty(0) || !isatty(1)) {
-		fprintf(stderr,"%s: STDIN/STDOUT must not be redirected!\n",argv[0]);
-		return 1;
-	}
-
-	if (!TermSetup()) {
-		fprintf(stderr,"%s: Unable to reconfigure terminal\n",argv[0]);
-		return 0;
-	}
-
-	if (!TermSize()) {
-		fprintf(stderr,"%s: cannot determine terminal size\n",argv[0]);
-		TermSizeSet(80,25);
-	}
+	char *script;
+	int dump = 0,dump_cols = 16;
+	unsigned long long dump_start = 0,dump_len = ~0ULL;
 
+	FmtInit();
 	fn=NULL;
+	cmpfn=NULL;
+	script=NULL;
 	fnmod=O_RDONLY;
 	for (i=1;i < argc;i++) {
 		if (argv[i][0] == '-') {
@@ -566,15 +6613,74 @@ int main(int argc,char **argv)
 			else if (!strcmp(argv[i]+1,"rw")) {
 				fnmod=O_RDWR;
 			}
+			else if (!strcmp(argv[i]+1,"sync")) {
+				term_sync=1;
+			}
+			else if (!strcmp(argv[i]+1,"mmap")) {
+				fa_use_mmap=1;
+			}
+			else if (!strcmp(argv[i]+1,"mapwin") && (i+1) < argc) {
+				fa_map_window = strtoull(argv[++i],NULL,0) << 20;
+				if (fa_map_window < (1ULL << 20)) fa_map_window = 1ULL << 20;
+			}
+			else if (!strcmp(argv[i]+1,"cache") && (i+1) < argc) {
+				fa_cache_max = strtoull(argv[++i],NULL,0) << 10;
+			}
+			else if (!strcmp(argv[i]+1,"map")) {
+				view_with_map=1;
+			}
+			else if (!strcmp(argv[i]+1,"direct")) {
+				fa_direct=1;
+			}
+			else if (!strcmp(argv[i]+1,"dbuf") && (i+1) < argc) {
+				fa_dio_size = strtoull(argv[++i],NULL,0) << 10;
+			}
+			else if (!strcmp(argv[i]+1,"ra") && (i+1) < argc) {
+				ra_max = strtoull(argv[++i],NULL,0) << 20;
+			}
+			else if (!strcmp(argv[i]+1,"batch") && (i+1) < argc) {
+				script = argv[++i];
+			}
+			else if (!strcmp(argv[i]+1,"dump")) {
+				dump=1;
+			}
+			else if (!strcmp(argv[i]+1,"stats")) {
+				view_with_stats=1;
+			}
+			else if (!strcmp(argv[i]+1,"statsfile") && (i+1) < argc) {
+				stat_file = argv[++i];
+			}
+			else if (!strcmp(argv[i]+1,"s") && (i+1) < argc) {
+				dump_start = strtoull(argv[++i],NULL,0);
+			}
+			else if (!strcmp(argv[i]+1,"n") && (i+1) < argc) {
+				dump_len = strtoull(argv[++i],NULL,0);
+			}
+			else if (!strcmp(argv[i]+1,"c") && (i+1) < argc) {
+				dump_cols = atoi(argv[++i]);
+			}
 			/* -h or --help works */
 			else if (!strcmp(argv[i]+1,"h") || !strcmp(argv[i]+1,"-help")) {
 				TermReset();
-				printf("%s [options] [file]\n",argv[0]);
+				printf("%s [options] [file [file to compare with]]\n",argv[0]);
 				printf("Simple Hex editor (C) 2004 Jonathan Campbell\n");
 				printf("where options can be:\n");
-				printf("  -ro    open read-only (default)\n");
-				printf("  -rw    open in read-write mode\n");
-				printf("  -h     help\n");
+				printf("  -ro                open read-only (default)\n");
+				printf("  -rw                open in read-write mode\n");
+				printf("  -cache <KB>        block cache size (default 4096)\n");
+				printf("  -mmap              view read-only files through a memory mapping\n");
+				printf("  -mapwin <MB>       mapping window size (default 1024)\n");
+				printf("  -map               show the minimap column\n");
+				printf("  -ra <MB>           background readahead limit, 0 = off (default 64)\n");
+				printf("  -direct            use O_DIRECT, bypassing the page cache (for devices)\n");
+				printf("  -dbuf <KB>         aligned bounce buffer size for -direct (default 1024)\n");
+				printf("  -sync              use synchronized update mode (terminal must support it)\n");
+				printf("  -stats             show syscall, byte and frame counters on the status line\n");
+				printf("  -statsfile <file>  write the counters to <file> as JSON on exit\n");
+				printf("  -batch <script>    run the commands in <script> (- = stdin), no terminal\n");
+				printf("  -dump              write the file as hex rows to stdout and exit, with\n");
+				printf("                     -s <start> -n <len> -c <bytes per row> (default 16)\n");
+				printf("  -h                 help\n");
 				exit(0);
 			}
 			else {
@@ -584,11 +6690,52 @@ int main(int argc,char **argv)
 		else if (!fn) {
 			fn=argv[i];
 		}
+		else if (!cmpfn) {
+			cmpfn=argv[i];
+		}
 		else {
 			fprintf(stderr,"%s: ignoring param %s\n",argv[0],argv[i]);
 		}
 	}
 
+	if (script) {
+		batch_mode = 1;
+		if (fn && !FaOpen(fn,fnmod)) {
+			fprintf(stderr,"%s: unable to open file %s\n",argv[0],fn);
+			return 1;
+		}
+		if (cmpfn && !CmpOpen(cmpfn)) {
+			fprintf(stderr,"%s: unable to open file %s\n",argv[0],cmpfn);
+			return 1;
+		}
+		i = BatchRun(script);
+		if (stat_file && !StatDump(stat_file)) fprintf(stderr,"%s: unable to write %s\n",argv[0],stat_file);
+		return i;
+	}
+
+	if (dump) {
+		if (!fn || !FaOpen(fn,O_RDONLY)) {
+			fprintf(stderr,"%s: unable to open file %s\n",argv[0],fn ? fn : "");
+			return 1;
+		}
+		return DumpRun(dump_start,dump_len,dump_cols) ? 0 : 1;
+	}
+
+	if (!isatty(0) || !isatty(1)) {
+		fprintf(stderr,"%s: STDIN/STDOUT must not be redirected!\n",argv[0]);
+		return 1;
+	}
+
+	if (!TermSetup()) {
+		fprintf(stderr,"%s: Unable to reconfigure terminal\n",argv[0]);
+		return 0;
+	}
+
+	if (!TermSize()) {
+		fprintf(stderr,"%s: cannot determine terminal size\n",argv[0]);
+		TermSizeSet(80,25);
+	}
+
 	if (fn) {
 		if (!FaOpen(fn,fnmod)) {
 			fprintf(stderr,"%s: unable to open file %s\n",argv[0],fn);
@@ -596,33 +6743,65 @@ int main(int argc,char **argv)
 		}
 	}
 
+	if (cmpfn) {
+		if (!CmpOpen(cmpfn)) {
+			fprintf(stderr,"%s: unable to open file %s\n",argv[0],cmpfn);
+			do { r=TermRead(); } while (r[0] != 10);
+		}
+	}
+
 	viewup_all=1;
 	mainloop=1;
-	DrawRowCacheFlush();
 	while (mainloop) {
-		/* update screen */
+		/* update screen, unless this was a movement key with more of them
+		 * waiting, in which case just move on until a frame is due */
+		if (term_resized) TermResize();
 		ViewOfsToCoord();
-		ViewRefresh();
-
-		/* status */
-		sprintf(stt,"\x1B[0;7m" "%016LX ",file_cursor);
-		if (view_tab == 0)		strcat(stt,"ofs ");
-		else if (view_tab == 1)		strcat(stt,"hex ");
-		else if (view_tab == 2)		strcat(stt,"asc ");
-		if (file_mode & O_RDWR)		strcat(stt,"[rw] ");
-		else				strcat(stt,"[ro] ");
-		if (view_modifymode)		strcat(stt," [EDIT]");
-		else				strcat(stt,"       ");
-		strcat(stt,"\x1B[0m" "\x1B[K");
-		TermPosCurs(con_height,1);
-		write(1,stt,strlen(stt));
-		TermPosCurs(viewcon_y+1,viewcon_x+1);
+		RaNote(view_offset,(unsigned long long)view_rows * view_columns);
+		if (!moved || !TermMovePending() || (JobNow() - term_frame_time) >= TERM_FRAME_MIN) {
+			TermFrameBegin();
+			ViewRefresh();
+			ViewStatus();
+			TermPosCurs(viewcon_y+1,viewcon_x+1);
+			TermFrameEnd();
+			term_frame_time = JobNow();
+		}
 
 		/* input */
 		act=0;
 		do {
+			/* while the map fills in, wake up now and then to show it */
+			term_idle = (view_with_map && MapBusy()) ? 0.25 : 0;
+			term_resize_wakes = 1;
 			r=TermRead();
-			if (!strcmp(r,"\x1B[5~")) {		/* page up */
+			term_resize_wakes = 0;
+			term_idle = 0;
+			moved = TermMoveKey(r);
+			if (!r[0]) {				/* nothing typed */
+				if (map_changed || term_resized) act = 1;
+			}
+			else if (view_tab == 3 && (!strcmp(r,"\x1B[A") || !strcmp(r,"\x1B[B") ||
+				!strcmp(r,"\x1B[5~") || !strcmp(r,"\x1B[6~") || !strcmp(r,"\x1B[1~") ||
+				!strcmp(r,"\x1B[4~") || !strcmp(r,"\x1B[C") || !strcmp(r,"\x1B[D"))) {
+				/* moving around the minimap */
+				if (!strcmp(r,"\x1B[A"))	view_map_sel--;
+				else if (!strcmp(r,"\x1B[B"))	view_map_sel++;
+				else if (!strcmp(r,"\x1B[5~"))	view_map_sel -= view_rows / 2;
+				else if (!strcmp(r,"\x1B[6~"))	view_map_sel += view_rows / 2;
+				else if (!strcmp(r,"\x1B[1~"))	view_map_sel = 0;
+				else if (!strcmp(r,"\x1B[4~"))	view_map_sel = view_rows - 1;
+				if (view_map_sel >= (int)view_rows) view_map_sel = view_rows - 1;
+				if (view_map_sel < 0) view_map_sel = 0;
+				act = 1;
+			}
+			else if (view_tab == 3 && (r[0] == 10 || r[0] == 13)) {	/* jump to the map row */
+				file_cursor = MapRowOfs(view_map_sel,view_rows);
+				FaClampCursor();
+				FaAdvise(FA_ADV_RANDOM);
+				act = 1;
+			}
+			else if (!strcmp(r,"\x1B[5~")) {		/* page up */
+				FaAdvise(FA_ADV_SEQUENTIAL);
 				if (view_ofs_y > 0) {
 					file_cursor -= view_ofs_y * view_columns;
 					act = 1;
@@ -651,6 +6830,10 @@ int main(int argc,char **argv)
 					if (file_size == 0)	file_cursor = 0;
 					else			file_cursor = file_size - 1;
 				}
+
+				/* and get the screen after this one on its way */
+				FaAdvise(FA_ADV_SEQUENTIAL);
+				FaWillNeed(file_cursor + (view_rows * view_columns),view_rows * view_columns);
 			}
 			else if (!strcmp(r,"\x1B[A")) {		/* up arrow */
 				act = 1;
@@ -704,14 +6887,12 @@ int main(int argc,char **argv)
 			else if (!strcmp(r,"\x1B[1~")) {	/* HOME */
 				if (view_ofs_x > 0) {
 					file_cursor -= view_ofs_x;
-					viewup_cursor = 1;
 					act = 1;
 				}
 			}
 			else if (!strcmp(r,"\x1B[4~")) {	/* END */
 				if (view_ofs_x < (view_columns-1)) {
 					file_cursor += (view_columns-1) - view_ofs_x;
-					viewup_cursor = 1;
 					act = 1;
 				}
 
@@ -721,18 +6902,20 @@ int main(int argc,char **argv)
 				}
 			}
 			else if (!strcmp(r,"\x09")) {		/* TAB */
-				view_tab = (view_tab + 1) % 3;
+				view_tab = (view_tab + 1) % 4;
 				if (view_tab == 1 && !view_with_hex) view_tab = 2;
-				if (view_tab == 2 && !view_with_asc) view_tab = 0;
-				viewup_cursor = 1;
+				if (view_tab == 2 && !view_with_asc) view_tab = 3;
+				if (view_tab == 3 && !view_with_map) view_tab = 0;
+				if (view_tab == 3) view_map_sel = MapRowOf(file_cursor,view_rows);
 				act = 1;
 			}
 			else if (!strcmp(r,"\x1B\x1B")) {	/* ESC+ESC */
 				char *r2;
 				
 				TermPosCurs(con_height,1);
-				printf("\x1B[?25l" "\x1B[0;1;43;31;7m" "Are you sure you want to quit?" "\x1B[0m" "\x1B[K");
-				fflush(stdout);
+				TermPuts("\x1B[?25l" "\x1B[0;1;43;31;7m" "Are you sure you want to quit?");
+				if (EdDirty()) TermPuts(" Unsaved changes will be lost!");
+				TermPuts("\x1B[0m" "\x1B[K");
 				r2=TermRead();
 				if (!strcasecmp(r2,"y")) {
 					mainloop = 0;
@@ -743,231 +6926,19 @@ int main(int argc,char **argv)
 				}
 
 				/* unhide cursor */
-				printf("\x1B[?25h");
-				fflush(stdout);
+				TermPuts("\x1B[?25h");
 			}
 			else if (!strcmp(r,":") && !view_modifymode) {		/* user is entering command */
 				char buf[255];
-				char *args[32];
-				int argsc=0;
-				int i;
-				int good=0;
 
 				TermPosCurs(con_height,1);
-				printf("\x1B[K" "command: ");
-				fflush(stdout);
+				TermPuts("\x1B[K" "command: ");
 				ReadInLine(buf,254);
 				act = 1;
-				i = 0;
-
-				while (argsc < 31 && buf[i] != 0) {
-					while (buf[i] == ' ') i++;
-					if (buf[i] == '\"') {
-						buf[++i] = 0;
-						args[argsc++] = buf+i;
-						while (buf[i] && buf[i] != '\"') i++;
-						if (buf[i] == '\"') buf[i++] = 0;
-					}
-					else {
-						args[argsc++] = buf+i;
-						while (buf[i] && buf[i] != ' ') i++;
-						if (buf[i] == ' ') buf[i++]=0;
-					}
-				}
-				
-				while (argsc < 32)
-					args[argsc++] = "";
-				
-				if (!strcasecmp(args[0],"column")) {
-					if (!strcasecmp(args[1],"width")) {
-						view_columns = strtol(args[2],NULL,0);
-						if (view_columns < 1) view_columns = 1;
-						viewup_all = 1;
-						good = 1;
-					}
-				}
-				else if (!strcasecmp(args[0],"view")) {
-					if (!strcasecmp(args[1],"sync")) {
-						good = 1;
-						view_offset = file_cursor;
-						viewup_all = 1;
-					}
-				}
-				else if (!strcasecmp(args[0],"truncate")) {
-					if (!strcasecmp(args[1],"here")) {
-						/* ok */
-						if (ftruncate(file_fd,file_cursor) < 0) {
-							TermPosCurs(con_height,1);
-							printf("\x1B[K" "ERROR TRUNCATING FILE!!");
-							fflush(stdout);
-							do { r=TermRead(); } while (r[0] != 10);
-						}
-
-						file_size = file_cursor;
-						if (file_size > 0) file_cursor--;
-						viewup_all = 1;
-						good = 1;
-					}
-					else if (!strcasecmp(args[1],"at") || !strcasecmp(args[1],"to")) {
-						unsigned long long pt;
-
-						pt = strtoull(args[2],NULL,0);
-						if (ftruncate(file_fd,file_cursor) < 0) {
-							TermPosCurs(con_height,1);
-							printf("\x1B[K" "ERROR TRUNCATING FILE!!");
-							fflush(stdout);
-							do { r=TermRead(); } while (r[0] != 10);
-						}
-
-						file_size = pt;
-						if (file_cursor >= file_size) {
-							if (file_size == 0)	file_cursor = 0;
-							else			file_cursor = file_size - 1;
-						}
-						good = 1;
-					}
-				}
-				else if (!strcasecmp(args[0],"go")) {
-					if (!strcasecmp(args[1],"to")) {
-						if (isdigit(args[2][0])) {
-							file_cursor = strtoll(args[2],NULL,0);
-							good = 1;
-						}
-						else if (args[2][0] == '+') {
-							unsigned long long delta;
-
-							good = 1;
-							delta = strtoull(args[2]+1,NULL,0);
-							if ((0xFFFFFFFFFFFFFFFFLL - file_cursor) < delta)
-								file_cursor = 0xFFFFFFFFFFFFFFFFLL;
-							else
-								file_cursor += delta;
-						}
-						else if (args[2][0] == '-') {
-							unsigned long long delta;
-
-							good = 1;
-							delta = strtoull(args[2]+1,NULL,0);
-							if (file_cursor < delta)
-								file_cursor = 0;
-							else
-								file_cursor -= delta;
-						}
-						else if (!strcasecmp(args[2],"end")) {
-							if (file_size == 0)	file_cursor = 0;
-							else			file_cursor = file_size - 1;
-							good = 1;
-						}
-					}
-				}
-				else if (!strcasecmp(args[0],"show")) {
-					if (!strcasecmp(args[1],"hex")) {
-						good = 1;
-						if (!view_with_hex) {
-							view_with_hex = 1;
-							viewup_all = 1;
-						}
-					}
-					else if (!strcasecmp(args[1],"asc")) {
-						good = 1;
-						if (!view_with_asc) {
-							view_with_asc = 1;
-							viewup_all = 1;
-						}
-					}
-				}
-				else if (!strcasecmp(args[0],"hide")) {
-					if (!strcasecmp(args[1],"hex")) {
-						good = 1;
-						if (view_with_hex) {
-							view_with_hex = 0;
-							viewup_all = 1;
-							if (view_tab == 1) view_tab = 2;
-							if (view_tab == 2 && !view_with_asc) view_tab = 0;
-						}
-					}
-					else if (!strcasecmp(args[1],"asc")) {
-						good = 1;
-						if (view_with_asc) {
-							view_with_asc = 0;
-							viewup_all = 1;
-							if (view_tab == 2) view_tab = 0;
-						}
-					}
-				}
-				/* "quit" or "q" (bad VIM habits die hard) */
-				else if (!strcasecmp(args[0],"quit") || !strcasecmp(args[0],"q")) {
-					mainloop = 0;
-					good = 1;
-				}
-				else if (!strcasecmp(args[0],"help")) {
-					printf("\x1B[2J\x1B[1;1H");
-					printf("KEYS:\n");
-					printf("ARROW KEYS            CONTROLS THE CURSOR POSITION.\n");
-					printf("PAGE UP, PAGE DOWN    JUMPS SEVERAL ROWS.\n");
-					printf("HOME, END             JUMPS THE CURSOR TO THE BEGINNING OR END OF A ROW.\n");
-					printf("ESC,ESC               QUITS THIS PROGRAM.\n");
-					printf(":                     GOES INTO COMMAND MODE.\n");
-					printf("ESC,M                 GOES INTO MODIFY MODE.\n");
-					printf("ESC,S                 EXITS MODIFY MODE.\n");
-					printf("\n");
-					printf("COMMAND SUMMARY\n");
-					printf("quit                  QUITS THE PROGRAM.\n");
-					printf("open                  OPENS A FILE FOR PEEKING.\n");
-					printf("openrw                OPENS A FILE FOR MODIFICATION.\n");
-					printf("column width <n>      SETS THE COLUMN WIDTH TO <n> BYTES/ROW\n");
-					printf("view sync             SETS THE VIEWPORT TO THE CURSOR POSITION\n");
-					printf("truncate here         TRUNCATES THE FILE AT THE CURSOR POSITION\n");
-					printf("truncate <at|to> <n>  TRUNCATES THE FILE AT THE GIVEN OFFSET\n");
-					printf("go to <-|+><n>        JUMPS THE CURSOR TO OFFSET <n> OR RELATIVE OFS IF +/-<n>\n");
-					printf("go to end             JUMPS TO THE END OF THE FILE\n");
-					printf("show <panel>          SHOWS THE SPECIFIED PANEL. 'PANEL' CAN BE 'asc' or 'hex'\n");
-					printf("hide <panel>          HIDES THE SPECIFIED PANEL.\n");
-					printf("\n");
-					printf("HIT RETURN TO CONTINUE.\n");
-
-					do { r=TermRead(); } while (r[0] != 10);
-					viewup_all = 1;
-					good = 1;
-				}
-				else if (!strcasecmp(args[0],"open")) {
-					if (!FaOpen(args[1],O_RDONLY)) {
-						TermPosCurs(con_height,1);
-						printf("\x1B[K" "Unable to open file");
-						fflush(stdout);
-						do { r=TermRead(); } while (r[0] != 10);
-					}
-					
-					file_cursor = 0;
-					view_offset = 0;
-					viewup_all = 1;
-					good = 1;
-				}
-				else if (!strcasecmp(args[0],"openrw")) {
-					if (!FaOpen(args[1],O_RDWR)) {
-						TermPosCurs(con_height,1);
-						printf("\x1B[K" "Unable to open file");
-						fflush(stdout);
-						do { r=TermRead(); } while (r[0] != 10);
-					}
-
-					file_cursor = 0;
-					view_offset = 0;
-					viewup_all = 1;
-					good = 1;
-				}
-				else if (!strlen(args[0])) {
-					good = 1;
-				}
-
-				if (!good) {
-					TermPosCurs(con_height,1);
-					printf("\x1B[K" "UNKNOWN COMMAND");
-					fflush(stdout);
-					do { r=TermRead(); } while (r[0] != 10);
-				}
+				if (!CmdExec(buf)) mainloop = 0;
 			}
-			else if (r[0] >= 32 && r[0] < 127 && view_modifymode && file_cursor < file_size) {
+			else if (r[0] >= 32 && r[0] < 127 && view_modifymode &&
+				(file_cursor < file_size || (view_insertmode && file_cursor == file_size))) {
 				char *r2;
 				char buft[3];
 				char cc;
@@ -976,8 +6947,7 @@ int main(int argc,char **argv)
 				if (view_tab == 1) {
 					if (isxdigit(r[0])) {
 						TermPosCurs(con_height,1);
-						printf("\x1B[K" "%c?",r[0]);
-						fflush(stdout);
+						TermPrintf("\x1B[K" "%c?",r[0]);
 						
 						buft[0] = r[0];
 						r2=TermRead();
@@ -985,22 +6955,12 @@ int main(int argc,char **argv)
 							buft[1] = r2[0];
 							buft[2] = 0;
 							cc = (char)strtol(buft,NULL,16);	// hexadecimal
-							FaSeek(file_cursor);
-							write(file_fd,&cc,1);
-							viewup_cursor = 1;
-							VRlastrow = -1;
-							if (file_cursor < (file_size-1)) file_cursor++;
-							DrawRowCacheFlush();
+							EdPutByte((unsigned char)cc);
 						}
 					}
 				}
 				else if (view_tab == 2) {
-					FaSeek(file_cursor);
-					write(file_fd,r,1);
-					viewup_cursor = 1;
-					VRlastrow = -1;
-					if (file_cursor < (file_size-1)) file_cursor++;
-					DrawRowCacheFlush();
+					EdPutByte((unsigned char)r[0]);
 				}
 
 				act = 1;
@@ -1011,25 +6971,58 @@ int main(int argc,char **argv)
 					view_modifymode = 1;
 				}
 				else {
-					TermPosCurs(con_height,1);
-					printf("\x1B[K" "Can't modify a file in read-only mode");
-					fflush(stdout);
-					do { r=TermRead(); } while (r[0] != 10);
+					StatusWait("Can't modify a file in read-only mode");
 				}
 			}
 			else if (!strcmp(r,"\x1Bs")) {		/* command to exit modify mode */
 				view_modifymode = 0;
 				act = 1;
 			}
+			else if (!strcmp(r,"\x1Bi")) {		/* toggle insert/overwrite typing */
+				view_insertmode = !view_insertmode;
+				act = 1;
+			}
+			else if (!strcmp(r,"\x1B[3~") && view_modifymode) {	/* DELETE */
+				EdDelete(file_cursor,1);
+				FaClampCursor();
+				act = 1;
+			}
+			else if ((r[0] == 8 || r[0] == 127) && view_modifymode && view_insertmode) {	/* BACKSPACE */
+				if (file_cursor > 0) {
+					EdDelete(--file_cursor,1);
+					FaClampCursor();
+				}
+				act = 1;
+			}
+			else if (!strcmp(r,"\x1Bu")) {		/* undo */
+				EdUndoCursor(EdUndoLast());
+				act = 1;
+			}
+			else if (!strcmp(r,"\x1Br")) {		/* redo */
+				EdUndoCursor(EdRedo());
+				act = 1;
+			}
+			else if (!strcmp(r,"\x1Bn") && !view_modifymode) {	/* find next */
+				SrchGo(0);
+				act = 1;
+			}
+			else if (!strcmp(r,"\x1Bp") && !view_modifymode) {	/* find previous */
+				SrchGo(1);
+				act = 1;
+			}
 		} while (!act);
 	}
 
 	TermPosCurs(255,1);
-	printf("\x1B[0m" "\x1B[K");
+	TermPuts("\x1B[0m" "\x1B[K");
+	TermFlush();
+	RaShutdown();
 
 	if (!TermReset())
 		fprintf(stderr,"%s: Unable to restore terminal!\n",argv[0]);
+	if (stat_file && !StatDump(stat_file))
+		fprintf(stderr,"%s: unable to write %s\n",argv[0],stat_file);
 
 	return 0;
 }
-
+#endif